@@ -0,0 +1,1219 @@
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/endian.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <prop/proplib.h>
+
+#include "dlmd.h"
+#include "lock.h"
+#include "client.h"
+
+/*
+ * Server side of local client protocol (see client.h). Requests are read by
+ * event loop or by reader thread of connection. Lock requests are queued
+ * with lock_resource_async and replied to from completion callback, so
+ * nothing waits for them and client can have any number outstanding.
+ * Requests of closed connection which are not granted yet are cancelled,
+ * requests with timeout are cancelled by timer thread at their deadline.
+ *
+ * Conversions and LKM_NOQUEUE requests have no async variant, they are
+ * passed to pool of conf.client_threads threads, more of them wait in job
+ * queue. Everything else is done right away.
+ *
+ * XXX Conversion waiting in pool can wait for conversion queued behind it
+ *     when all pool threads are busy.
+ *
+ * Replies never wait for client. What socket doesn't take is queued on
+ * connection and written when socket becomes writable, by event loop or by
+ * writer thread of connection.
+ *
+ * Client can move its requests and replies to shared memory rings, then
+ * socket only wakes up side which sleeps (see client.h). Lock which is
+ * granted locally costs no syscall when I am busy and client spins for
+ * reply.
+ *
+ * XXX Blocking callback of LKM_CACHE locks is not sent to clients, cached
+ *     lock held by client is given away after it is unlocked.
+ *
+ * XXX Client can truncate its shared memory object and I get SIGBUS.
+ */
+
+struct client_lock {
+	int lockid;
+	LIST_ENTRY(client_lock) next;
+};
+
+struct client_conn {
+	int fd;				/* closed with last reference */
+	struct dlmd_event *ev;
+	pthread_mutex_t mtx;		/* guards writes and everything below */
+	pthread_cond_t cv;		/* writer thread waits for replies */
+	uint32_t refs;			/* reader, writer and queued jobs */
+	int closed;
+	LIST_HEAD(, client_job) pending; /* async lock requests not finished */
+	struct dlmd_event *wev;		/* event loop waits for writable socket */
+	size_t out_len;			/* queued reply bytes */
+	char out[DLMD_CLIENT_OUT_MAX];
+	LIST_HEAD(, client_lock) locks;	/* locks held by client */
+	int shm_fd;			/* descriptor sent by client */
+	struct dlmc_shm *shm;		/* rings, socket is doorbell */
+	uint32_t sq_head;		/* my copies, client can't move them */
+	uint32_t cq_tail;
+	size_t len;			/* bytes in buf */
+	char buf[DLMC_MSG_MAX];
+};
+
+struct client_job {
+	struct client_conn *conn;
+	uint32_t id;
+	int mode;
+	int flags;			/* LKM_* flags */
+	uint32_t dflags;		/* DLMC_F_* flags */
+	int lockid;
+	uint32_t refs;			/* completion callback and submitter */
+	int cancelled;			/* lock_cancel was called */
+	/* guarded by timer_mtx */
+	int done;			/* completion callback was called */
+	int timer;			/* on timer_queue */
+	int timedout;			/* cancelled by timer */
+	struct timespec deadline;
+	TAILQ_ENTRY(client_job) next;	/* in job_queue or timer_queue */
+	LIST_ENTRY(client_job) pending;	/* in conn->pending */
+	char name[];
+};
+
+static TAILQ_HEAD(, client_job) job_queue = TAILQ_HEAD_INITIALIZER(job_queue);
+static pthread_mutex_t job_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cv = PTHREAD_COND_INITIALIZER;
+
+/* Async requests with timeout, sorted by deadline */
+static TAILQ_HEAD(client_job_head, client_job) timer_queue =
+    TAILQ_HEAD_INITIALIZER(timer_queue);
+static pthread_mutex_t timer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cv = PTHREAD_COND_INITIALIZER;
+
+static bool client_shm_enabled;
+
+static uint64_t client_requests;
+static uint64_t client_shm_requests;
+static uint64_t client_doorbells;
+static uint32_t client_conns;
+
+static struct client_conn * client_conn_alloc(int);
+static void client_conn_unref(struct client_conn *);
+static void client_close(struct client_conn *);
+static void client_cancel(struct client_conn *);
+static int client_cancel_id(struct client_conn *, uint32_t);
+static int client_read(struct client_conn *);
+static void client_request(struct client_conn *, const char *, size_t);
+static void client_reply(struct client_conn *, uint32_t, int, int, int,
+    const char *);
+static int client_flush(struct client_conn *);
+static void client_write_wait(struct client_conn *);
+static int client_lock_find(struct client_conn *, int, int);
+static void client_lock_async(struct client_job *);
+static void client_lock_ast(int, int, void *);
+static void client_job_unref(struct client_job *);
+static void client_timer_add(struct client_job *);
+static void * client_timer_start(void *);
+static int client_shm_attach(struct client_conn *, struct dlmc_shm **);
+static int client_shm_drain(struct client_conn *);
+static void client_shm_reply(struct client_conn *, const char *, size_t);
+static void client_event_read(int, void *);
+static void client_event_write(int, void *);
+static void * client_reader(void *);
+static void * client_writer(void *);
+static void * client_worker_start(void *);
+
+/*
+ * Create client socket and start lock request threads. Returns listening
+ * socket or -1 when client socket is not configured.
+ */
+int
+client_init(dlmd_conf_t *conf)
+{
+	struct sockaddr_un sun;
+	pthread_t thread;
+	uint32_t i;
+	int sock;
+
+	if (conf->client_socket == NULL || conf->client_socket[0] == '\0')
+		return -1;
+
+	client_shm_enabled = conf->client_shm;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_LOCAL;
+	if (strlcpy(sun.sun_path, conf->client_socket, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		errx(EXIT_FAILURE, "Client socket path %s too long",
+		    conf->client_socket);
+
+	if ((sock = socket(AF_LOCAL, SOCK_STREAM, 0)) == -1)
+		err(EXIT_FAILURE, "Creating client socket failed");
+
+	/* Socket left by previous instance */
+	unlink(conf->client_socket);
+
+	if (bind(sock, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(EXIT_FAILURE, "Binding client socket %s failed",
+		    conf->client_socket);
+
+	chmod(conf->client_socket, 0660);
+
+	if (listen(sock, DLMD_CLIENT_BACKLOG) == -1)
+		err(EXIT_FAILURE, "Listening on client socket failed");
+
+	for (i = 0; i < conf->client_threads; i++) {
+		pthread_create(&thread, NULL, &client_worker_start, NULL);
+		pthread_detach(thread);
+	}
+
+	pthread_create(&thread, NULL, &client_timer_start, NULL);
+	pthread_detach(thread);
+
+	return sock;
+}
+
+static struct client_conn *
+client_conn_alloc(int fd)
+{
+	struct client_conn *conn;
+
+	if ((conn = malloc(sizeof(struct client_conn))) == NULL)
+		return NULL;
+
+	memset(conn, 0, sizeof(struct client_conn));
+
+	conn->fd = fd;
+	conn->shm_fd = -1;
+	conn->refs = 1;
+	LIST_INIT(&conn->locks);
+	LIST_INIT(&conn->pending);
+	pthread_mutex_init(&conn->mtx, NULL);
+	pthread_cond_init(&conn->cv, NULL);
+
+	atomic_inc_32(&client_conns);
+
+	return conn;
+}
+
+static void
+client_conn_unref(struct client_conn *conn)
+{
+	int last;
+
+	pthread_mutex_lock(&conn->mtx);
+	last = (--conn->refs == 0);
+	pthread_mutex_unlock(&conn->mtx);
+
+	if (!last)
+		return;
+
+	close(conn->fd);
+	pthread_cond_destroy(&conn->cv);
+	pthread_mutex_destroy(&conn->mtx);
+	free(conn);
+	atomic_dec_32(&client_conns);
+}
+
+/*
+ * Client went away, release all its locks and cancel its requests. Lock
+ * requests which can't be cancelled are released when they finish.
+ * Descriptor stays open until writer thread lets it go, it can be polling
+ * it.
+ */
+static void
+client_close(struct client_conn *conn)
+{
+	LIST_HEAD(, client_lock) locks;
+	struct client_lock *cl;
+
+	if (conn->ev != NULL)
+		dlmd_event_del(conn->ev);
+
+	pthread_mutex_lock(&conn->mtx);
+
+	conn->closed = 1;
+	shutdown(conn->fd, SHUT_RDWR);
+	pthread_cond_signal(&conn->cv);
+
+	if (conn->wev != NULL) {
+		dlmd_event_del(conn->wev);
+		conn->wev = NULL;
+	}
+
+	if (conn->shm_fd != -1)
+		close(conn->shm_fd);
+
+	if (conn->shm != NULL) {
+		munmap(conn->shm, sizeof(struct dlmc_shm));
+		conn->shm = NULL;
+	}
+
+	/* Unlock can grant my pending request, client_lock_ast takes conn->mtx */
+	LIST_INIT(&locks);
+	while ((cl = LIST_FIRST(&conn->locks)) != NULL) {
+		LIST_REMOVE(cl, next);
+		LIST_INSERT_HEAD(&locks, cl, next);
+	}
+
+	pthread_mutex_unlock(&conn->mtx);
+
+	while ((cl = LIST_FIRST(&locks)) != NULL) {
+		LIST_REMOVE(cl, next);
+		unlock_resource(cl->lockid);
+		free(cl);
+	}
+
+	client_cancel(conn);
+
+	client_conn_unref(conn);
+}
+
+/*
+ * Cancel async lock requests of closed connection. Cancelled request is
+ * finished by client_lock_ast, so conn->mtx can't be held over
+ * lock_cancel.
+ */
+static void
+client_cancel(struct client_conn *conn)
+{
+	struct client_job *job;
+	int lockid;
+
+	pthread_mutex_lock(&conn->mtx);
+
+	while (1) {
+		LIST_FOREACH(job, &conn->pending, pending) {
+			if (!job->cancelled)
+				break;
+		}
+
+		if (job == NULL)
+			break;
+
+		job->cancelled = 1;
+		lockid = job->lockid;
+
+		pthread_mutex_unlock(&conn->mtx);
+		lock_cancel(lockid);
+		pthread_mutex_lock(&conn->mtx);
+	}
+
+	pthread_mutex_unlock(&conn->mtx);
+}
+
+/*
+ * Cancel async lock request with request id of client.
+ */
+static int
+client_cancel_id(struct client_conn *conn, uint32_t id)
+{
+	struct client_job *job;
+	int lockid;
+
+	pthread_mutex_lock(&conn->mtx);
+
+	LIST_FOREACH(job, &conn->pending, pending) {
+		if (job->id == id && !job->cancelled)
+			break;
+	}
+
+	if (job == NULL) {
+		pthread_mutex_unlock(&conn->mtx);
+		return ENOENT;
+	}
+
+	job->cancelled = 1;
+	lockid = job->lockid;
+
+	pthread_mutex_unlock(&conn->mtx);
+
+	return lock_cancel(lockid);
+}
+
+/*
+ * Accept thread, used when event loop is off.
+ */
+void *
+client_accept_start(void *arg)
+{
+	struct client_conn *conn;
+	pthread_t reader, writer;
+	int sock, fd;
+
+	sock = (int)(intptr_t)arg;
+
+	while (1) {
+		if ((fd = accept(sock, NULL, NULL)) == -1) {
+			DPRINTF(("client accept failed."));
+			continue;
+		}
+
+		if ((conn = client_conn_alloc(fd)) == NULL) {
+			close(fd);
+			continue;
+		}
+
+		conn->refs++;
+		if (pthread_create(&writer, NULL, &client_writer, conn) != 0) {
+			conn->refs--;
+			client_close(conn);
+			continue;
+		}
+
+		pthread_detach(writer);
+
+		if (pthread_create(&reader, NULL, &client_reader, conn) != 0) {
+			client_close(conn);
+			continue;
+		}
+
+		pthread_detach(reader);
+	}
+
+	return NULL;
+}
+
+static void *
+client_reader(void *arg)
+{
+	struct client_conn *conn = arg;
+
+	while (client_read(conn) == 0)
+		continue;
+
+	client_close(conn);
+
+	return NULL;
+}
+
+/*
+ * Writer thread, used when event loop is off. It writes replies which
+ * socket didn't take right away.
+ */
+static void *
+client_writer(void *arg)
+{
+	struct client_conn *conn = arg;
+	struct pollfd pfd;
+
+	pfd.fd = conn->fd;
+	pfd.events = POLLOUT;
+
+	pthread_mutex_lock(&conn->mtx);
+
+	while (!conn->closed) {
+		if (conn->out_len == 0) {
+			pthread_cond_wait(&conn->cv, &conn->mtx);
+			continue;
+		}
+
+		/* Shutdown in client_close wakes me up */
+		pthread_mutex_unlock(&conn->mtx);
+		poll(&pfd, 1, INFTIM);
+		pthread_mutex_lock(&conn->mtx);
+
+		if (!conn->closed)
+			client_flush(conn);
+	}
+
+	pthread_mutex_unlock(&conn->mtx);
+
+	client_conn_unref(conn);
+
+	return NULL;
+}
+
+/*
+ * Event loop callback, client connects.
+ */
+void
+client_event_accept(int sock, void *arg)
+{
+	struct client_conn *conn;
+	int fd;
+
+	if ((fd = accept(sock, NULL, NULL)) == -1) {
+		DPRINTF(("client accept failed."));
+		return;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	if ((conn = client_conn_alloc(fd)) == NULL) {
+		close(fd);
+		return;
+	}
+
+	if ((conn->ev = dlmd_event_add_fd(fd, &client_event_read, conn)) == NULL)
+		client_close(conn);
+}
+
+static void
+client_event_read(int fd, void *arg)
+{
+	struct client_conn *conn = arg;
+
+	if (client_read(conn) != 0)
+		client_close(conn);
+}
+
+/*
+ * Event loop callback, socket takes queued replies again.
+ */
+static void
+client_event_write(int fd, void *arg)
+{
+	struct client_conn *conn = arg;
+
+	pthread_mutex_lock(&conn->mtx);
+
+	if (client_flush(conn) != EAGAIN) {
+		dlmd_event_del(conn->wev);
+		conn->wev = NULL;
+	}
+
+	pthread_mutex_unlock(&conn->mtx);
+}
+
+/*
+ * Read what is available and handle all complete requests. Returns -1
+ * when connection is closed or broken.
+ */
+static int
+client_read(struct client_conn *conn)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	size_t len, off;
+	ssize_t n;
+
+	iov.iov_base = conn->buf + conn->len;
+	iov.iov_len = sizeof(conn->buf) - conn->len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	n = recvmsg(conn->fd, &msg, 0);
+
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+
+	if (n <= 0)
+		return -1;
+
+	/* Shared memory for DLMC_OP_SHM_ATTACH in this read */
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		if (conn->shm_fd != -1)
+			close(conn->shm_fd);
+
+		memcpy(&conn->shm_fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	conn->len += n;
+
+	for (off = 0; conn->shm == NULL && conn->len - off >= DLMC_REQ_HDR_LEN;
+	     off += len) {
+		len = be32dec(conn->buf + off);
+
+		if (len < DLMC_REQ_HDR_LEN || len > DLMC_MSG_MAX)
+			return -1;
+
+		if (conn->len - off < len)
+			break;
+
+		/* Requests after attach would be taken for doorbell */
+		if ((uint8_t)conn->buf[off + 4] == DLMC_OP_SHM_ATTACH &&
+		    conn->len - off > len) {
+			if (conn->shm_fd != -1) {
+				close(conn->shm_fd);
+				conn->shm_fd = -1;
+			}
+			client_reply(conn, be32dec(conn->buf + off + 8),
+			    DLMC_OP_SHM_ATTACH, EBUSY, be32dec(conn->buf + off + 20),
+			    NULL);
+			continue;
+		}
+
+		client_request(conn, conn->buf + off, len);
+	}
+
+	/* Attach was last request, anything after it is doorbell */
+	if (conn->shm != NULL) {
+		conn->len = 0;
+		return client_shm_drain(conn);
+	}
+
+	memmove(conn->buf, conn->buf + off, conn->len - off);
+	conn->len -= off;
+
+	return 0;
+}
+
+/*
+ * Check that lockid belongs to client, with remove it is taken from client
+ * list. Must be called with conn->mtx held.
+ */
+static int
+client_lock_find(struct client_conn *conn, int lockid, int remove)
+{
+	struct client_lock *cl;
+
+	LIST_FOREACH(cl, &conn->locks, next) {
+		if (cl->lockid != lockid)
+			continue;
+
+		if (remove) {
+			LIST_REMOVE(cl, next);
+			free(cl);
+		}
+
+		return 0;
+	}
+
+	return ENOENT;
+}
+
+/*
+ * Handle one request.
+ */
+static void
+client_request(struct client_conn *conn, const char *buf, size_t len)
+{
+	char lvb[DLMC_LVB_LEN];
+	struct dlmc_shm *shm;
+	struct client_job *job;
+	uint32_t id, name_len;
+	int op, lockid, error;
+
+	atomic_inc_64(&client_requests);
+
+	op = (uint8_t)buf[4];
+	name_len = be16dec(buf + 6);
+	id = be32dec(buf + 8);
+	lockid = be32dec(buf + 20);
+
+	if ((uint8_t)buf[5] != DLMC_VERSION) {
+		client_reply(conn, id, op, EPROTONOSUPPORT, lockid, NULL);
+		return;
+	}
+
+	switch (op) {
+	case DLMC_OP_LOCK:
+		if (name_len == 0 || name_len > DLMC_NAME_MAX ||
+		    DLMC_REQ_HDR_LEN + name_len > len ||
+		    (job = malloc(sizeof(struct client_job) + name_len + 1)) ==
+		    NULL) {
+			client_reply(conn, id, op, EINVAL, lockid, NULL);
+			return;
+		}
+
+		job->conn = conn;
+		job->id = id;
+		job->mode = be32dec(buf + 12);
+		job->flags = be32dec(buf + 16);
+		job->dflags = job->flags & (DLMC_F_TIMEOUT | DLMC_F_ASYNC);
+		job->flags &= ~(DLMC_F_TIMEOUT | DLMC_F_ASYNC);
+		job->lockid = lockid;
+		job->refs = 2;
+		job->cancelled = 0;
+		job->done = 0;
+		job->timer = 0;
+		job->timedout = 0;
+
+		/* Timeout takes lockid field, conversion needs it */
+		if (job->dflags & DLMC_F_TIMEOUT) {
+			if (job->flags & LKM_CONVERT) {
+				free(job);
+				client_reply(conn, id, op, EINVAL, lockid, NULL);
+				return;
+			}
+
+			clock_gettime(CLOCK_REALTIME, &job->deadline);
+			job->deadline.tv_sec += (uint32_t)lockid / 1000;
+			job->deadline.tv_nsec += ((uint32_t)lockid % 1000) * 1000000L;
+			if (job->deadline.tv_nsec >= 1000000000L) {
+				job->deadline.tv_sec++;
+				job->deadline.tv_nsec -= 1000000000L;
+			}
+			job->lockid = 0;
+		}
+
+		memcpy(job->name, buf + DLMC_REQ_HDR_LEN, name_len);
+		job->name[name_len] = '\0';
+
+		pthread_mutex_lock(&conn->mtx);
+		conn->refs++;
+		pthread_mutex_unlock(&conn->mtx);
+
+		if (!(job->flags & (LKM_CONVERT | LKM_NOQUEUE))) {
+			client_lock_async(job);
+			return;
+		}
+
+		pthread_mutex_lock(&job_mtx);
+		TAILQ_INSERT_TAIL(&job_queue, job, next);
+		pthread_cond_signal(&job_cv);
+		pthread_mutex_unlock(&job_mtx);
+		return;
+
+	case DLMC_OP_UNLOCK:
+		pthread_mutex_lock(&conn->mtx);
+		error = client_lock_find(conn, lockid, 1);
+		pthread_mutex_unlock(&conn->mtx);
+
+		if (error == 0)
+			error = unlock_resource(lockid);
+
+		client_reply(conn, id, op, error, lockid, NULL);
+		return;
+
+	case DLMC_OP_VALUE_GET:
+		pthread_mutex_lock(&conn->mtx);
+		error = client_lock_find(conn, lockid, 0);
+		pthread_mutex_unlock(&conn->mtx);
+
+		if (error == 0)
+			error = lock_value_get(lockid, lvb);
+
+		client_reply(conn, id, op, error, lockid, error == 0 ? lvb : NULL);
+		return;
+
+	case DLMC_OP_VALUE_SET:
+		pthread_mutex_lock(&conn->mtx);
+		error = client_lock_find(conn, lockid, 0);
+		pthread_mutex_unlock(&conn->mtx);
+
+		if (error == 0 && len < DLMC_REQ_HDR_LEN + DLMC_LVB_LEN)
+			error = EINVAL;
+
+		if (error == 0)
+			error = lock_value_set(lockid, buf + len - DLMC_LVB_LEN);
+
+		client_reply(conn, id, op, error, lockid, NULL);
+		return;
+
+	case DLMC_OP_SHM_ATTACH:
+		error = client_shm_attach(conn, &shm);
+
+		/* This reply still goes through socket */
+		client_reply(conn, id, op, error, lockid, NULL);
+
+		if (error == 0) {
+			pthread_mutex_lock(&conn->mtx);
+			conn->shm = shm;
+			pthread_mutex_unlock(&conn->mtx);
+		}
+		return;
+
+	case DLMC_OP_CANCEL:
+		error = client_cancel_id(conn, lockid);
+		client_reply(conn, id, op, error, lockid, NULL);
+		return;
+	}
+
+	client_reply(conn, id, op, EOPNOTSUPP, lockid, NULL);
+}
+
+/*
+ * Map shared memory sent by client.
+ */
+static int
+client_shm_attach(struct client_conn *conn, struct dlmc_shm **shmp)
+{
+	struct dlmc_shm *shm;
+	struct stat st;
+	int fd;
+
+	fd = conn->shm_fd;
+	conn->shm_fd = -1;
+
+	if (fd == -1)
+		return EBADF;
+
+	if (!client_shm_enabled || conn->shm != NULL) {
+		close(fd);
+		return client_shm_enabled ? EBUSY : EOPNOTSUPP;
+	}
+
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct dlmc_shm)) {
+		close(fd);
+		return EINVAL;
+	}
+
+	shm = mmap(NULL, sizeof(struct dlmc_shm), PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (shm == MAP_FAILED)
+		return errno;
+
+	conn->sq_head = shm->sq.head;
+	conn->cq_tail = shm->cq.tail;
+
+	/* I sleep until client rings */
+	shm->sq.wakeup = 1;
+	membar_sync();
+
+	*shmp = shm;
+
+	return 0;
+}
+
+/*
+ * Handle all requests in submission ring. Returns -1 when client broke
+ * ring.
+ */
+static int
+client_shm_drain(struct client_conn *conn)
+{
+	struct dlmc_ring *sq;
+	char buf[DLMC_RING_SLOT];
+	uint32_t tail, len;
+
+	sq = &conn->shm->sq;
+
+	while (1) {
+		while ((tail = sq->tail) != conn->sq_head) {
+			if (tail - conn->sq_head > DLMC_RING_SLOTS)
+				return -1;
+
+			membar_consumer();
+
+			/* Client can write to slot while I parse it, copy it */
+			memcpy(buf, sq->slot[conn->sq_head % DLMC_RING_SLOTS],
+			    sizeof(buf));
+
+			membar_sync();
+			sq->head = ++conn->sq_head;
+
+			len = be32dec(buf);
+			if (len < DLMC_REQ_HDR_LEN || len > DLMC_MSG_MAX)
+				return -1;
+
+			atomic_inc_64(&client_shm_requests);
+
+			client_request(conn, buf, len);
+		}
+
+		/* Ask for doorbell and look again, client could miss it */
+		sq->wakeup = 1;
+		membar_sync();
+
+		if (sq->tail == conn->sq_head)
+			return 0;
+
+		sq->wakeup = 0;
+	}
+}
+
+/*
+ * Put reply to completion ring and wake client if it sleeps. Must be called
+ * with conn->mtx held.
+ */
+static void
+client_shm_reply(struct client_conn *conn, const char *buf, size_t len)
+{
+	struct dlmc_ring *cq;
+
+	cq = &conn->shm->cq;
+
+	if (conn->cq_tail - cq->head >= DLMC_RING_SLOTS) {
+		/* More requests outstanding than ring holds, reader closes it */
+		DPRINTF(("client completion ring overflow."));
+		shutdown(conn->fd, SHUT_RDWR);
+		return;
+	}
+
+	memcpy(cq->slot[conn->cq_tail % DLMC_RING_SLOTS], buf, len);
+
+	membar_producer();
+	cq->tail = ++conn->cq_tail;
+	membar_sync();
+
+	if (cq->wakeup && atomic_cas_32(&cq->wakeup, 1, 0) == 1) {
+		atomic_inc_64(&client_doorbells);
+
+		/* Full socket has doorbell already */
+		if (send(conn->fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL) == -1 &&
+		    errno != EAGAIN)
+			DPRINTF(("client doorbell failed."));
+	}
+}
+
+/*
+ * Send reply to client, nothing is sent to closed connection. Reply which
+ * socket doesn't take is queued, client which doesn't read them is dropped.
+ */
+static void
+client_reply(struct client_conn *conn, uint32_t id, int op, int status,
+    int lockid, const char *lvb)
+{
+	char buf[DLMC_REP_HDR_LEN + DLMC_LVB_LEN];
+	size_t len;
+
+	len = DLMC_REP_HDR_LEN + (lvb != NULL ? DLMC_LVB_LEN : 0);
+
+	be32enc(buf, len);
+	buf[4] = op;
+	buf[5] = DLMC_VERSION;
+	be16enc(buf + 6, 0);
+	be32enc(buf + 8, id);
+	be32enc(buf + 12, status);
+	be32enc(buf + 16, lockid);
+	if (lvb != NULL)
+		memcpy(buf + DLMC_REP_HDR_LEN, lvb, DLMC_LVB_LEN);
+
+	pthread_mutex_lock(&conn->mtx);
+
+	if (conn->closed) {
+		pthread_mutex_unlock(&conn->mtx);
+		return;
+	}
+
+	if (conn->shm != NULL) {
+		client_shm_reply(conn, buf, len);
+		pthread_mutex_unlock(&conn->mtx);
+		return;
+	}
+
+	if (conn->out_len + len > sizeof(conn->out)) {
+		/* Reader finds out connection is broken and closes it */
+		DPRINTF(("client reply queue overflow."));
+		shutdown(conn->fd, SHUT_RDWR);
+		pthread_mutex_unlock(&conn->mtx);
+		return;
+	}
+
+	memcpy(conn->out + conn->out_len, buf, len);
+	conn->out_len += len;
+
+	if (client_flush(conn) == EAGAIN)
+		client_write_wait(conn);
+
+	pthread_mutex_unlock(&conn->mtx);
+}
+
+/*
+ * Write queued replies while socket takes them. Returns EAGAIN when some
+ * are left. Must be called with conn->mtx held.
+ */
+static int
+client_flush(struct client_conn *conn)
+{
+	ssize_t n;
+
+	while (conn->out_len > 0) {
+		if ((n = send(conn->fd, conn->out, conn->out_len,
+		    MSG_DONTWAIT | MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN)
+				return EAGAIN;
+
+			/* Reader finds out connection is broken and closes it */
+			conn->out_len = 0;
+			return EPIPE;
+		}
+
+		memmove(conn->out, conn->out + n, conn->out_len - n);
+		conn->out_len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Have queued replies written when socket becomes writable. Must be called
+ * with conn->mtx held.
+ */
+static void
+client_write_wait(struct client_conn *conn)
+{
+	if (conn->ev == NULL) {
+		pthread_cond_signal(&conn->cv);
+		return;
+	}
+
+	if (conn->wev == NULL &&
+	    (conn->wev = dlmd_event_add_write(conn->fd, &client_event_write,
+	    conn)) == NULL)
+		shutdown(conn->fd, SHUT_RDWR);
+}
+
+/*
+ * Queue lock request of job, client_lock_ast replies when it is granted.
+ */
+static void
+client_lock_async(struct client_job *job)
+{
+	struct client_conn *conn;
+	int error;
+
+	conn = job->conn;
+
+	pthread_mutex_lock(&conn->mtx);
+	LIST_INSERT_HEAD(&conn->pending, job, pending);
+	pthread_mutex_unlock(&conn->mtx);
+
+	/* Callback can finish job before lock_resource_async returns */
+	if ((error = lock_resource_async(job->name, job->mode, job->flags,
+	    &client_lock_ast, job, -1, &job->lockid)) != 0) {
+		client_lock_ast(job->lockid, error, job);
+	} else {
+		if (job->dflags & DLMC_F_ASYNC)
+			client_reply(conn, job->id, DLMC_OP_LOCK, EINPROGRESS,
+			    job->lockid, NULL);
+
+		if (job->dflags & DLMC_F_TIMEOUT)
+			client_timer_add(job);
+	}
+
+	client_job_unref(job);
+}
+
+/*
+ * Completion callback of async lock request, lock is handed over to client.
+ */
+static void
+client_lock_ast(int lockid, int status, void *arg)
+{
+	struct client_job *job = arg;
+	struct client_conn *conn;
+	struct client_lock *cl;
+	int release;
+
+	conn = job->conn;
+	release = 0;
+
+	pthread_mutex_lock(&timer_mtx);
+	job->done = 1;
+	if (job->timer) {
+		TAILQ_REMOVE(&timer_queue, job, next);
+		job->timer = 0;
+	}
+	if (status == ECANCELED && job->timedout)
+		status = ETIMEDOUT;
+	pthread_mutex_unlock(&timer_mtx);
+
+	pthread_mutex_lock(&conn->mtx);
+
+	LIST_REMOVE(job, pending);
+
+	if (status == 0) {
+		if (conn->closed ||
+		    (cl = malloc(sizeof(struct client_lock))) == NULL) {
+			/* Nobody would unlock it */
+			release = 1;
+			status = conn->closed ? ECONNRESET : ENOMEM;
+		} else {
+			cl->lockid = lockid;
+			LIST_INSERT_HEAD(&conn->locks, cl, next);
+		}
+	}
+
+	pthread_mutex_unlock(&conn->mtx);
+
+	/* Unlock can call me again for other request of conn */
+	if (release)
+		unlock_resource(lockid);
+
+	client_reply(conn, job->id, DLMC_OP_LOCK, status, lockid, NULL);
+
+	client_job_unref(job);
+}
+
+/*
+ * Drop reference to async job, last one frees it and its connection
+ * reference.
+ */
+static void
+client_job_unref(struct client_job *job)
+{
+	if (atomic_dec_32_nv(&job->refs) != 0)
+		return;
+
+	client_conn_unref(job->conn);
+	free(job);
+}
+
+/*
+ * Put queued request with timeout to timer queue, unless it is finished
+ * already.
+ */
+static void
+client_timer_add(struct client_job *job)
+{
+	struct client_job *job2;
+
+	pthread_mutex_lock(&timer_mtx);
+
+	if (job->done) {
+		pthread_mutex_unlock(&timer_mtx);
+		return;
+	}
+
+	TAILQ_FOREACH_REVERSE(job2, &timer_queue, client_job_head, next) {
+		if (timespeccmp(&job2->deadline, &job->deadline, <=))
+			break;
+	}
+
+	if (job2 == NULL)
+		TAILQ_INSERT_HEAD(&timer_queue, job, next);
+	else
+		TAILQ_INSERT_AFTER(&timer_queue, job2, job, next);
+
+	job->timer = 1;
+
+	/* New first deadline */
+	if (TAILQ_FIRST(&timer_queue) == job)
+		pthread_cond_signal(&timer_cv);
+
+	pthread_mutex_unlock(&timer_mtx);
+}
+
+/*
+ * Timer thread, it cancels requests whose deadline passed. Completion
+ * callback replies ETIMEDOUT for them.
+ */
+static void *
+client_timer_start(void *arg)
+{
+	struct client_job *job;
+	struct timespec now;
+	int lockid;
+
+	pthread_mutex_lock(&timer_mtx);
+
+	while (1) {
+		if ((job = TAILQ_FIRST(&timer_queue)) == NULL) {
+			pthread_cond_wait(&timer_cv, &timer_mtx);
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &now);
+
+		if (timespeccmp(&now, &job->deadline, <)) {
+			pthread_cond_timedwait(&timer_cv, &timer_mtx,
+			    &job->deadline);
+			continue;
+		}
+
+		TAILQ_REMOVE(&timer_queue, job, next);
+		job->timer = 0;
+		job->timedout = 1;
+		lockid = job->lockid;
+
+		/* Callback takes timer_mtx, job can be gone after unlock */
+		pthread_mutex_unlock(&timer_mtx);
+		lock_cancel(lockid);
+		pthread_mutex_lock(&timer_mtx);
+	}
+
+	return NULL;
+}
+
+/*
+ * Lock request thread, it waits for conversions and LKM_NOQUEUE requests.
+ */
+static void *
+client_worker_start(void *arg)
+{
+	struct client_job *job;
+	struct client_conn *conn;
+	struct client_lock *cl;
+	int lockid, error, release;
+
+	while (1) {
+		pthread_mutex_lock(&job_mtx);
+		while ((job = TAILQ_FIRST(&job_queue)) == NULL)
+			pthread_cond_wait(&job_cv, &job_mtx);
+		TAILQ_REMOVE(&job_queue, job, next);
+		pthread_mutex_unlock(&job_mtx);
+
+		conn = job->conn;
+		lockid = job->lockid;
+
+		/* Only lock held by client can be converted */
+		pthread_mutex_lock(&conn->mtx);
+		error = (job->flags & LKM_CONVERT) ?
+		    client_lock_find(conn, lockid, 0) : 0;
+		pthread_mutex_unlock(&conn->mtx);
+
+		if (error == 0)
+			error = lock_resource(job->name, job->mode, job->flags,
+			    &lockid);
+
+		if (error == 0 && !(job->flags & LKM_CONVERT)) {
+			release = 0;
+
+			pthread_mutex_lock(&conn->mtx);
+
+			if (conn->closed ||
+			    (cl = malloc(sizeof(struct client_lock))) == NULL) {
+				/* Nobody would unlock it */
+				release = 1;
+				error = conn->closed ? ECONNRESET : ENOMEM;
+			} else {
+				cl->lockid = lockid;
+				LIST_INSERT_HEAD(&conn->locks, cl, next);
+			}
+
+			pthread_mutex_unlock(&conn->mtx);
+
+			/* Unlock can grant async request of conn */
+			if (release)
+				unlock_resource(lockid);
+		}
+
+		client_reply(conn, job->id, DLMC_OP_LOCK, error, lockid, NULL);
+
+		client_conn_unref(conn);
+		free(job);
+	}
+
+	return NULL;
+}
+
+/*
+ * Print client counters.
+ */
+void
+client_stats()
+{
+	printf("Clients %u connected, %"PRIu64" requests, %"PRIu64" through "
+	    "shared memory, %"PRIu64" doorbells\n", client_conns,
+	    client_requests, client_shm_requests, client_doorbells);
+}
@@ -0,0 +1,100 @@
+#ifndef _DLMD_CLIENT_
+#define _DLMD_CLIENT_
+
+/*
+ * Local client protocol. Processes on the node lock through unix stream
+ * socket of dlmd, library in libdlmc implements lock.h API with it.
+ * Client can send any number of requests without waiting for replies,
+ * every request has id chosen by client and reply carries the same id.
+ * Replies come in order in which requests finish, not in which they were
+ * sent. All integers are big endian.
+ *
+ * Request:
+ *
+ *  0      4    5         6          8    12     16      20       24
+ *  +------+----+---------+----------+----+------+-------+--------+------+-----
+ *  | len  | op | version | name_len | id | mode | flags | lockid | name | lvb
+ *  +------+----+---------+----------+----+------+-------+--------+------+-----
+ *
+ * Reply:
+ *
+ *  0      4    5         6     8    12       16       20
+ *  +------+----+---------+-----+----+--------+--------+-----
+ *  | len  | op | version | pad | id | status | lockid | lvb
+ *  +------+----+---------+-----+----+--------+--------+-----
+ *
+ * len is length of whole request or reply. name is sent with DLMC_OP_LOCK,
+ * lvb with DLMC_OP_VALUE_SET request and DLMC_OP_VALUE_GET reply. status is
+ * errno value returned by lock.h function. Locks held by client are
+ * released and its requests cancelled when it closes connection.
+ *
+ * flags of DLMC_OP_LOCK are LKM_* flags and DLMC_F_* flags below. With
+ * DLMC_F_TIMEOUT lockid carries timeout in milliseconds, request not
+ * granted by then is withdrawn and replied with ETIMEDOUT (not for
+ * LKM_CONVERT and LKM_NOQUEUE). With DLMC_F_ASYNC request which is queued
+ * is replied with EINPROGRESS and lockid of queued lock first, final reply
+ * with the same id follows, it can also come first.
+ *
+ * DLMC_OP_CANCEL carries id of pending DLMC_OP_LOCK request in lockid. The
+ * request is withdrawn and replied with ECANCELED before cancel itself is
+ * replied. Cancel fails with EBUSY when lock is granted and with ENOENT
+ * for unknown request, conversions and LKM_NOQUEUE requests.
+ */
+#define DLMD_CLIENT_SOCKET   "/var/run/dlmd.sock"
+
+#define DLMC_VERSION         1
+
+#define DLMC_OP_LOCK         1
+#define DLMC_OP_UNLOCK       2
+#define DLMC_OP_VALUE_GET    3
+#define DLMC_OP_VALUE_SET    4
+#define DLMC_OP_SHM_ATTACH   5
+#define DLMC_OP_CANCEL       6
+
+#define DLMC_F_TIMEOUT       0x80000000 /* lockid is timeout in msec */
+#define DLMC_F_ASYNC         0x40000000 /* EINPROGRESS reply with lockid */
+
+#define DLMC_REQ_HDR_LEN     24
+#define DLMC_REP_HDR_LEN     20
+#define DLMC_NAME_MAX        1023 /* MAX_NAME_LEN without NUL */
+#define DLMC_LVB_LEN         32 /* LKM_LVB_LEN */
+#define DLMC_MSG_MAX         (DLMC_REQ_HDR_LEN + DLMC_NAME_MAX + DLMC_LVB_LEN)
+
+/*
+ * Shared memory rings. Client creates struct dlmc_shm in shared memory
+ * object and passes its descriptor with DLMC_OP_SHM_ATTACH request
+ * (SCM_RIGHTS). After successful reply requests are put to sq and replies
+ * come in cq, in the same format as on socket, one per slot. Every ring has
+ * one producer and one consumer, head is moved by consumer and tail by
+ * producer, both only grow and slot is index % DLMC_RING_SLOTS.
+ *
+ * Socket is then used only as doorbell. Consumer which is going to sleep
+ * sets wakeup of its ring, checks ring once more and waits for a byte on
+ * socket. Producer clears wakeup and writes a byte when it finds it set
+ * after moving tail, so syscall is needed only when other side sleeps.
+ *
+ * Client must not have more than DLMC_RING_SLOTS requests outstanding,
+ * replies would not fit to cq. Attach must be the only outstanding request
+ * and client sends nothing until its reply, attach followed by more data is
+ * refused with EBUSY.
+ */
+#define DLMC_RING_SLOTS      256
+#define DLMC_RING_SLOT       1088 /* >= DLMC_MSG_MAX */
+#define DLMC_CACHE_LINE      64
+
+struct dlmc_ring {
+	volatile uint32_t head;
+	char pad0[DLMC_CACHE_LINE - sizeof(uint32_t)];
+	volatile uint32_t tail;
+	char pad1[DLMC_CACHE_LINE - sizeof(uint32_t)];
+	volatile uint32_t wakeup;
+	char pad2[DLMC_CACHE_LINE - sizeof(uint32_t)];
+	char slot[DLMC_RING_SLOTS][DLMC_RING_SLOT];
+};
+
+struct dlmc_shm {
+	struct dlmc_ring sq;		/* requests, client -> dlmd */
+	struct dlmc_ring cq;		/* replies, dlmd -> client */
+};
+
+#endif
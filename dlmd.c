@@ -9,6 +9,7 @@
 
 #include <err.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +18,7 @@
 #include <prop/proplib.h>
 
 #include "dlmd.h"
+#include "client.h"
 
 /*
  * Distributed Lock Manager daemon. This program is esearch project used
@@ -34,9 +36,11 @@
  */
 
 dlmd_conf_t conf;
+dlmd_clock_t dlmd_clock;
 
 static void usage(void);
 static int parse_config_dict(prop_dictionary_t);
+static void * stats_start(void *);
 
 int
 main(int argc, char *argv[])
@@ -44,6 +48,12 @@ main(int argc, char *argv[])
 	char ch;
 	int test;
 	pthread_t listener_pthread, keepalive_pthread, tester_pthread;
+	pthread_t stats_pthread, flush_pthread, rel_pthread, stream_pthread;
+	pthread_t mcast_pthread, sender_pthread, client_pthread;
+	int client_sock;
+	prop_object_iterator_t iter;
+	prop_object_t obj;
+	sigset_t sigset;
 	
 	test = 0;
 	
@@ -80,28 +90,111 @@ main(int argc, char *argv[])
 	/* Initialize node subsystem */
 	dlmd_node_init();
 	
-	/* Initialize lock manager */
-	dlmd_lock_init();
-	
-	pthread_mutex_init(&event_mtx, NULL);
-	event_counter = 0;
+	dlmd_clock.event_counter = 0;
 	
 	/* TODO force user to suply config file */
 	parse_config_dict(conf.dict);
 
+	/* Initialize lock manager */
+	dlmd_lock_init(conf.lock_shards, conf.engine);
+
+	/* Hot resources which are passed between nodes with token */
+	if (conf.token_resources != NULL && conf.engine == DLMD_ENGINE_MASTER)
+		warnx("Token resources are not used with master engine\n");
+	else if (conf.token_resources != NULL &&
+	    (iter = prop_array_iterator(conf.token_resources)) != NULL) {
+		while ((obj = prop_object_iterator_next(iter)) != NULL)
+			dlmd_lock_token_add(prop_string_cstring_nocopy(obj));
+		prop_object_iterator_release(iter);
+	}
+
+	/* SIGINFO is handled by stats thread, block it in all others */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINFO);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+	pthread_create(&stats_pthread, NULL, &stats_start, NULL);
+	pthread_detach(stats_pthread);
+
 	/* Do I need something else then socket here ??? */
-	pthread_create(&listener_pthread, NULL, &listener_start, &conf);
+	/* Sends bundles of messages coalesced for other nodes */
+	if (conf.coalesce_usec != 0) {
+		pthread_create(&flush_pthread, NULL, &dlmd_node_flush_start, &conf);
+		pthread_detach(flush_pthread);
+	}
+
+	/* Workers have to run before first message is received */
+	listener_init(&conf);
+
+	/* Last stage, encodes and sends messages queued by everybody else */
+	if (conf.async_send) {
+		dlmd_msg_sender_init();
+		pthread_create(&sender_pthread, NULL, &dlmd_msg_sender_start, &conf);
+		pthread_detach(sender_pthread);
+	}
+
+	if (conf.event_loop) {
+		/* One thread waits for all descriptors and timers */
+		dlmd_event_init();
+
+		dlmd_event_add_fd(conf.socket, &listener_event, &conf);
+
+		if (conf.mcast_group.s_addr != INADDR_ANY)
+			dlmd_event_add_fd(dlmd_mcast_init(&conf), &dlmd_mcast_event,
+			    &conf);
+
+		if (conf.transport == DLMD_TRANSPORT_TCP)
+			dlmd_event_add_fd(dlmd_stream_listen(&conf),
+			    &dlmd_stream_event_accept, &conf);
+
+		if ((client_sock = client_init(&conf)) != -1)
+			dlmd_event_add_fd(client_sock, &client_event_accept, &conf);
+
+		dlmd_event_add_timer(DLMD_REL_TICK_USEC / 1000, &dlmd_rel_event,
+		    &conf);
+
+		/* Timer fires first after interval, first keepalive goes now */
+		if (keepalive_init(&conf) == 0) {
+			keepalive_event(0, &conf);
+			dlmd_event_add_timer(KEEP_ALIVE_INT * 1000, &keepalive_event,
+			    &conf);
+		}
+
+		pthread_create(&listener_pthread, NULL, &dlmd_event_loop_start, &conf);
+	} else {
+		/* Retransmits and acknowledges reliable datagrams */
+		pthread_create(&rel_pthread, NULL, &dlmd_rel_timer_start, &conf);
+		pthread_detach(rel_pthread);
+
+		if (conf.mcast_group.s_addr != INADDR_ANY) {
+			dlmd_mcast_init(&conf);
+			pthread_create(&mcast_pthread, NULL, &dlmd_mcast_listener_start, &conf);
+			pthread_detach(mcast_pthread);
+		}
+
+		/* Datagram listener still gets keepalives */
+		if (conf.transport == DLMD_TRANSPORT_TCP) {
+			pthread_create(&stream_pthread, NULL, &dlmd_stream_accept_start, &conf);
+			pthread_detach(stream_pthread);
+		}
+
+		if ((client_sock = client_init(&conf)) != -1) {
+			pthread_create(&client_pthread, NULL, &client_accept_start,
+			    (void *)(intptr_t)client_sock);
+			pthread_detach(client_pthread);
+		}
+
+		pthread_create(&listener_pthread, NULL, &listener_start, &conf);
 	
-	pthread_create(&keepalive_pthread, NULL, &keepalive_start, &conf);
+		pthread_create(&keepalive_pthread, NULL, &keepalive_start, &conf);
+		pthread_detach(keepalive_pthread);
+	}
 	
 	if (test == 1) {
 		pthread_create(&tester_pthread, NULL, &tester_start, &conf);
 		pthread_detach(tester_pthread);
 	}
-	pthread_detach(keepalive_pthread);
 	pthread_join(listener_pthread, NULL);
 	
-	
 	return EXIT_SUCCESS;
 
 }
@@ -113,7 +206,7 @@ parse_config_dict(prop_dictionary_t dict)
 	prop_object_iterator_t iter;
 	prop_array_t array;
 	
-	const char *ipaddress, *local_name;
+	const char *ipaddress, *local_name, *wire, *engine, *transport, *group;
 	const char *node_name, *node_ip, *node_mask;
 	uint32_t port;
 	size_t bits;
@@ -127,6 +220,120 @@ parse_config_dict(prop_dictionary_t dict)
 	prop_dictionary_get_uint32(dict, DLMDICT_LOCAL_PORT,
 	    &port);
 
+	conf.lock_shards = DLMD_LOCK_SHARDS;
+	prop_dictionary_get_uint32(dict, DLMDICT_LOCK_SHARDS,
+	    &conf.lock_shards);
+
+	conf.engine = DLMD_ENGINE_LAMPORT;
+	if (prop_dictionary_get_cstring_nocopy(dict, DLMDICT_ENGINE, &engine)) {
+		if (strcmp(engine, "master") == 0)
+			conf.engine = DLMD_ENGINE_MASTER;
+		else if (strcmp(engine, "ricart") == 0)
+			conf.engine = DLMD_ENGINE_RICART;
+		else if (strcmp(engine, "lamport") != 0)
+			warnx("Unknown locking engine %s, using lamport\n", engine);
+	}
+
+	conf.token_resources = prop_dictionary_get(dict, DLMDICT_TOKEN_RESOURCES);
+
+	conf.token_threshold = DLMD_TOKEN_THRESHOLD;
+	prop_dictionary_get_uint32(dict, DLMDICT_TOKEN_THRESHOLD,
+	    &conf.token_threshold);
+
+	conf.coalesce_usec = DLMD_COALESCE_USEC;
+	prop_dictionary_get_uint32(dict, DLMDICT_COALESCE_USEC, &conf.coalesce_usec);
+
+	conf.transport = DLMD_TRANSPORT_UDP;
+	if (prop_dictionary_get_cstring_nocopy(dict, DLMDICT_TRANSPORT, &transport)) {
+		if (strcmp(transport, "tcp") == 0)
+			conf.transport = DLMD_TRANSPORT_TCP;
+		else if (strcmp(transport, "udp") != 0)
+			warnx("Unknown transport %s, using udp\n", transport);
+	}
+
+	conf.reliable = true;
+	prop_dictionary_get_bool(dict, DLMDICT_RELIABLE, &conf.reliable);
+
+	conf.mcast_group.s_addr = INADDR_ANY;
+	if (prop_dictionary_get_cstring_nocopy(dict, DLMDICT_MCAST_GROUP, &group) &&
+	    group[0] != '\0') {
+		if (inet_pton(AF_INET, group, &conf.mcast_group) != 1 ||
+		    !IN_MULTICAST(ntohl(conf.mcast_group.s_addr))) {
+			warnx("Invalid multicast group %s, not using multicast\n",
+			    group);
+			conf.mcast_group.s_addr = INADDR_ANY;
+		} else if (conf.transport == DLMD_TRANSPORT_TCP) {
+			warnx("Multicast is not used with tcp transport\n");
+			conf.mcast_group.s_addr = INADDR_ANY;
+		} else if (conf.reliable) {
+			/*
+			 * Group datagrams would pass reliable ones to the
+			 * same node and could be lost, set reliable to false
+			 * to use multicast.
+			 */
+			warnx("Multicast is not used with reliable delivery\n");
+			conf.mcast_group.s_addr = INADDR_ANY;
+		}
+	}
+
+	conf.mcast_ttl = DLMD_MCAST_TTL;
+	prop_dictionary_get_uint32(dict, DLMDICT_MCAST_TTL, &conf.mcast_ttl);
+
+	conf.loss_percent = 0;
+	prop_dictionary_get_uint32(dict, DLMDICT_LOSS_PERCENT, &conf.loss_percent);
+	if (conf.loss_percent > 100)
+		conf.loss_percent = 100;
+	if (conf.loss_percent != 0)
+		warnx("Dropping %u%% of reliable datagrams\n", conf.loss_percent);
+
+	conf.client_socket = DLMD_CLIENT_SOCKET;
+	prop_dictionary_get_cstring_nocopy(dict, DLMDICT_CLIENT_SOCKET,
+	    &conf.client_socket);
+
+	conf.client_threads = DLMD_CLIENT_THREADS;
+	prop_dictionary_get_uint32(dict, DLMDICT_CLIENT_THREADS,
+	    &conf.client_threads);
+	if (conf.client_threads == 0)
+		conf.client_threads = 1;
+
+	conf.client_shm = true;
+	prop_dictionary_get_bool(dict, DLMDICT_CLIENT_SHM, &conf.client_shm);
+
+	conf.event_loop = true;
+	prop_dictionary_get_bool(dict, DLMDICT_EVENT_LOOP, &conf.event_loop);
+
+	conf.async_send = true;
+	prop_dictionary_get_bool(dict, DLMDICT_ASYNC_SEND, &conf.async_send);
+
+	conf.listener_threads = 1;
+	prop_dictionary_get_uint32(dict, DLMDICT_LISTENER_THREADS,
+	    &conf.listener_threads);
+	if (conf.listener_threads == 0 ||
+	    conf.listener_threads > DLMD_LISTENER_MAX) {
+		warnx("Listener threads %u out of range, using 1\n",
+		    conf.listener_threads);
+		conf.listener_threads = 1;
+	}
+
+	conf.batch_size = DLMD_BATCH_SIZE;
+	prop_dictionary_get_uint32(dict, DLMDICT_BATCH_SIZE, &conf.batch_size);
+	if (conf.batch_size == 0 || conf.batch_size > DLMD_BATCH_MAX) {
+		warnx("Batch size %u out of range, using %d\n", conf.batch_size,
+		    DLMD_BATCH_SIZE);
+		conf.batch_size = DLMD_BATCH_SIZE;
+	}
+
+	/* Talk binary to nodes which support it, plist to others */
+	conf.wire_format = DLMD_WIRE_AUTO;
+	if (prop_dictionary_get_cstring_nocopy(dict, DLMDICT_WIRE_FORMAT, &wire)) {
+		if (strcmp(wire, "plist") == 0)
+			conf.wire_format = DLMD_WIRE_PLIST;
+		else if (strcmp(wire, "binary") == 0)
+			conf.wire_format = DLMD_WIRE_BINARY;
+		else if (strcmp(wire, "auto") != 0)
+			warnx("Unknown wire format %s, using auto\n", wire);
+	}
+
 	bits = inet_net_pton(AF_INET, ipaddress, &conf.address.sin_addr,
 	    sizeof(conf.address.sin_addr));
 
@@ -171,6 +378,36 @@ parse_config_dict(prop_dictionary_t dict)
 	return 0;
 }
 
+/*
+ * Print daemon statistics on SIGINFO (^T).
+ */
+static void *
+stats_start(void *arg)
+{
+	sigset_t sigset;
+	int sig;
+
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINFO);
+
+	while (1) {
+		if (sigwait(&sigset, &sig) != 0)
+			continue;
+
+		dlmd_lock_stats(conf.token_threshold);
+		dlmd_node_stats();
+		listener_stats();
+		dlmd_msg_sender_stats();
+		dlmd_event_stats();
+		client_stats();
+		dlmd_rel_stats();
+		dlmd_stream_stats();
+		dlmd_mcast_stats();
+	}
+
+	return NULL;
+}
+
 static void
 usage(void)
 {
@@ -2,6 +2,7 @@
 #define _DLMD_H_
 
 #include <sys/queue.h>
+#include <sys/atomic.h>
 
 #include <assert.h>
 #include <pthread.h>
@@ -18,8 +19,19 @@
   [3] Node ID -> ip address is used as Node id (lower is better) because I need totaly ordered
       Lamport timestamps.
 */
-#define MAX_NAME_LEN 128
+/*
+ * Resource names up to MAX_NAME_LEN - 1 characters go only over stream
+ * transport, plist message with such name doesn't fit to datagram.
+ * Messages keep names up to DLMD_DGRAM_NAME_LEN in place and allocate
+ * longer ones, locks and resources allocate their name.
+ * DLMD_WIRE_MAX_LEN has to fit to DLMD_BUNDLE_MAX.
+ */
+#define MAX_NAME_LEN 1024
+#define DLMD_DGRAM_NAME_LEN 128	/* name limit with udp transport */
+#define DLMD_NODE_NAME_LEN 128
 #define DLMD_MAX_CONN 16
+#define DLMD_CACHE_LINE 64
+#define DLMD_LVB_LEN 32		/* lock value block size, LKM_LVB_LEN in lock.h */
 
 #ifdef DLMD_DEBUG
 #define DPRINTF(arg) printf arg
@@ -46,6 +58,24 @@
 #define DLMDICT_NODE_NAME     "name"
 #define DLMDICT_NODE_ADDRESS  "address"
 #define DLMDICT_NODE_NETMASK  "netmask"
+#define DLMDICT_WIRE_FORMAT   "wire_format" /* plist, binary or auto */
+#define DLMDICT_LOCK_SHARDS   "lock_shards" /* number of lock table shards */
+#define DLMDICT_ENGINE        "engine"      /* lamport, master or ricart */
+#define DLMDICT_TOKEN_RESOURCES "token_resources" /* resources in token mode */
+#define DLMDICT_TOKEN_THRESHOLD "token_threshold" /* contention to report */
+#define DLMDICT_BATCH_SIZE    "batch_size"  /* datagrams per recvmmsg/sendmmsg */
+#define DLMDICT_COALESCE_USEC "coalesce_usec" /* bundle flush deadline, 0 off */
+#define DLMDICT_RELIABLE      "reliable"    /* acknowledge and retransmit */
+#define DLMDICT_LOSS_PERCENT  "loss_percent" /* drop sent datagrams, testing only */
+#define DLMDICT_TRANSPORT     "transport"   /* udp or tcp */
+#define DLMDICT_MCAST_GROUP   "multicast_group" /* broadcast group, none when empty */
+#define DLMDICT_MCAST_TTL     "multicast_ttl"
+#define DLMDICT_LISTENER_THREADS "listener_threads" /* message worker threads */
+#define DLMDICT_ASYNC_SEND    "async_send"  /* encode and send in sender thread */
+#define DLMDICT_EVENT_LOOP    "event_loop"  /* kqueue loop instead of I/O threads */
+#define DLMDICT_CLIENT_SOCKET "client_socket" /* unix socket for clients, none when empty */
+#define DLMDICT_CLIENT_THREADS "client_threads" /* threads for client conversions */
+#define DLMDICT_CLIENT_SHM     "client_shm"  /* clients can use shared memory rings */
 
 /*
  * Message directives.
@@ -57,10 +87,132 @@
 #define MSG_LOCK_TYPE           "flags" /* msg_type entry */
 #define MSG_LOCK_FLAG           "flags" /* type of wanted lock */
 #define MSG_UNLOCK_TYPE         "unlock"
+#define MSG_CONVERT_TYPE        "convert"
+#define MSG_MASTER_REQUEST_TYPE "master_request"
+#define MSG_GRANT_TYPE          "grant"
+#define MSG_MASTER_RELEASE_TYPE "master_release"
+#define MSG_TOKEN_REQUEST_TYPE  "token_request"
+#define MSG_TOKEN_TYPE          "token"
 #define MSG_NODE_NAME           "node_name"
 #define MSG_RESOURCE            "resource"
 #define MSG_EVENT               "event" /* Lamport's logical clock. */
 #define MSG_ID                  "id"    /* Node id for total ordering of Lamport timestamps */
+#define MSG_WIRE                "wire"  /* Highest binary wire version sender understands */
+#define MSG_REF                 "ref"   /* event of request message reply/unlock refers to */
+#define MSG_LOCK_OPTS           "lock_flags" /* LKM_* lock flags and DLMD_MSG_F_* */
+#define MSG_LVB                 "lvb"   /* lock value block */
+#define MSG_LVB_SEQ             "lvb_seq" /* lock value block version */
+#define MSG_QUEUE               "queue" /* node ids waiting for token */
+
+/*
+ * Message type codes, shared by plist and binary wire format.
+ */
+#define DLMD_MSG_KEEPALIVE      1
+#define DLMD_MSG_REQUEST        2
+#define DLMD_MSG_REPLY          3
+#define DLMD_MSG_LOCK           4
+#define DLMD_MSG_UNLOCK         5
+#define DLMD_MSG_CONVERT        6
+#define DLMD_MSG_MASTER_REQUEST 7 /* request sent to resource master */
+#define DLMD_MSG_GRANT          8 /* master has granted request */
+#define DLMD_MSG_MASTER_RELEASE 9 /* unlock sent to resource master */
+#define DLMD_MSG_TOKEN_REQUEST  10 /* request for token of resource */
+#define DLMD_MSG_TOKEN          11 /* token with its queue */
+
+/*
+ * Binary wire format. XML plist messages are several hundred bytes long and
+ * internalizing them costs more than lock logic itself. Binary message is
+ * fixed size header followed by resource name (without NUL).
+ *
+ *  0      1        2     3     4         8        16    24      26         28
+ *  +------+--------+-----+-----+---------+--------+-----+-------+----------+------
+ *  |magic |version |type |mode | node_id | event  | ref | flags | name_len | name
+ *  +------+--------+-----+-----+---------+--------+-----+-------+----------+------
+ *
+ * ref is event of request message which reply or unlock message refers to,
+ * (resource, node_id, ref) identifies lock in whole cluster. flags carry
+ * LKM_* flags of request, when DLMD_MSG_F_LVB is set name is followed by
+ * 8 byte value block version and DLMD_LVB_LEN bytes of lock value block.
+ * With DLMD_MSG_F_QUEUE 2 byte count of queued node ids and ids follow.
+ * All integers are big endian. Plist messages always start with '<' so
+ * receiver can distinguish both formats by first byte.
+ *
+ * Since wire version 3 several binary messages for one node can be packed
+ * to bundle datagram:
+ *
+ *  0      1        2       4           6
+ *  +------+--------+-------+-----------+---------+-----------+---------
+ *  |magic |version | count | msg_len   | message | msg_len   | message
+ *  +------+--------+-------+-----------+---------+-----------+---------
+ *
+ * Format of single message didn't change, it is still sent with version 2
+ * so older nodes can parse it.
+ *
+ * Since wire version 4 binary messages and bundles are sent to nodes which
+ * understand it in reliable datagram (see reliable.c):
+ *
+ *  0      1        2       4         8       12    16          20    24     28
+ *  +------+--------+-------+---------+-------+-----+-----------+-----+------+-----
+ *  |magic |version | flags | node_id | epoch | seq | ack_epoch | ack | sack | data
+ *  +------+--------+-------+---------+-------+-----+-----------+-----+------+-----
+ *
+ * epoch is chosen randomly for every destination at start of sender and
+ * again when sender drops datagrams to dead node, so receiver knows when
+ * sequence numbers start again. ack is next sequence number expected from
+ * stream with ack_epoch and bit i of sack acknowledges ack + 1 + i. Pure
+ * acknowledgement doesn't have DLMD_REL_F_DATA flag and data.
+ */
+#define DLMD_WIRE_MAGIC         0xD1
+#define DLMD_WIRE_VERSION       4 /* highest version I understand */
+#define DLMD_WIRE_MSG_VERSION   2 /* version of single message format */
+#define DLMD_WIRE_BUNDLE_VERSION 3
+#define DLMD_WIRE_BUNDLE_MAGIC  0xD2
+#define DLMD_WIRE_BUNDLE_HDR_LEN 4
+#define DLMD_BUNDLE_MAX         1400 /* bundle fits to ethernet MTU */
+#define DLMD_WIRE_REL_VERSION   4
+#define DLMD_WIRE_REL_MAGIC     0xD3
+#define DLMD_WIRE_REL_HDR_LEN   28
+#define DLMD_WIRE_HDR_LEN       28
+#define DLMD_WIRE_LVB_LEN       (8 + DLMD_LVB_LEN)
+#define DLMD_WIRE_QUEUE_LEN(n) (2 + 4 * (n))
+#define DLMD_WIRE_MAX_LEN       (DLMD_WIRE_HDR_LEN + MAX_NAME_LEN + \
+    DLMD_WIRE_LVB_LEN + DLMD_WIRE_QUEUE_LEN(DLMD_TOKEN_QUEUE_MAX))
+
+#define DLMD_MSG_F_LVB          0x01 /* message carries lock value block */
+#define DLMD_MSG_F_DENIED       0x02 /* LKM_NOQUEUE request refused */
+#define DLMD_MSG_F_QUEUE        0x04 /* message carries token queue */
+
+#define DLMD_REL_F_DATA         0x01 /* reliable datagram carries data */
+
+#define DLMD_TOKEN_QUEUE_MAX    32 /* maximum nodes waiting for token */
+
+#define DLMD_WIRE_PLIST         0 /* always send plist messages */
+#define DLMD_WIRE_BINARY        1 /* always send binary messages */
+#define DLMD_WIRE_AUTO          2 /* binary to nodes which have advertised it */
+
+/*
+ * Decoded message, filled from plist or binary message. node_name is empty
+ * for binary messages; sender is identified by node_id only. resource
+ * points to resource_buf or to allocated name when it doesn't fit there,
+ * message has to be copied with dlmd_msg_copy and finished with
+ * dlmd_msg_fini.
+ */
+typedef struct dlmd_msg {
+	uint32_t type;                  /* DLMD_MSG_* */
+	uint32_t node_id;               /* sender ip address */
+	uint64_t event;                 /* Lamport logical timestamp */
+	uint64_t ref;                   /* event of referenced request */
+	uint32_t mode;                  /* lock mode LKM_*MODE */
+	uint32_t flags;                 /* lock flags */
+	uint32_t wire;                  /* advertised binary wire version */
+	uint64_t lvb_seq;               /* lock value block version */
+	char lvb[DLMD_LVB_LEN];         /* lock value block */
+	uint32_t queue_len;             /* token queue length */
+	uint32_t queue[DLMD_TOKEN_QUEUE_MAX]; /* token queue, node ids */
+	char node_name[DLMD_NODE_NAME_LEN];
+	char *resource;
+	char resource_buf[DLMD_DGRAM_NAME_LEN];
+} dlmd_msg_t;
 
 
 /*
@@ -70,8 +222,53 @@ typedef struct dlmd_conf {
 	prop_dictionary_t dict;
 	struct sockaddr_in address;
 	int socket;
+	int wire_format;	/* DLMD_WIRE_* */
+	uint32_t lock_shards;	/* number of lock table shards */
+	uint32_t engine;	/* DLMD_ENGINE_* */
+	prop_array_t token_resources;	/* resource names in token mode */
+	uint32_t token_threshold;	/* contention reported as token candidate */
+	uint32_t batch_size;		/* datagrams per recvmmsg/sendmmsg */
+	uint32_t coalesce_usec;		/* bundle flush deadline, 0 disables bundles */
+	bool reliable;			/* send binary messages reliably */
+	uint32_t loss_percent;		/* injected loss of reliable datagrams */
+	uint32_t transport;		/* DLMD_TRANSPORT_* */
+	struct in_addr mcast_group;	/* INADDR_ANY when multicast is off */
+	uint32_t mcast_ttl;
+	uint32_t listener_threads;	/* workers applying received messages */
+	bool async_send;		/* messages are sent by sender thread */
+	bool event_loop;		/* I/O is done by event loop thread */
+	const char *client_socket;	/* path of client socket */
+	uint32_t client_threads;	/* client conversions waiting at once */
+	bool client_shm;		/* accept shared memory rings from clients */
 } dlmd_conf_t;
 
+#define DLMD_LISTENER_MAX    64 /* maximum listener_threads */
+
+#define DLMD_TRANSPORT_UDP   0 /* datagram to every node */
+#define DLMD_TRANSPORT_TCP   1 /* frames over connection to every node */
+
+#define DLMD_COALESCE_USEC   50 /* default bundle flush deadline */
+
+#define DLMD_BATCH_SIZE      16 /* default batch size */
+#define DLMD_BATCH_MAX       64 /* maximum batch size */
+
+/*
+ * Locking engines. All nodes in cluster have to use the same one.
+ *
+ * LAMPORT - requests and unlocks are broadcast to all nodes and all nodes
+ *           reply, 3(N-1) messages per lock.
+ * MASTER  - every resource is mastered by one node chosen by resource hash,
+ *           requests and unlocks are sent to master only and master grants
+ *           them. Locks mastered by local node don't need any message.
+ * RICART  - Ricart-Agrawala, requests are broadcast like in lamport engine,
+ *           but node defers its reply while it holds or waits with older
+ *           conflicting lock. Deferred replies are sent at unlock, so there
+ *           is no unlock message, 2(N-1) messages per lock.
+ */
+#define DLMD_ENGINE_LAMPORT  0
+#define DLMD_ENGINE_MASTER   1
+#define DLMD_ENGINE_RICART   2
+
 /*****************************************************************************
  * Dlmd structures there are 2 major lists in dlmd. 
  * 1) The first list manages list of active nodes know to every cluster node.
@@ -81,8 +278,16 @@ typedef struct dlmd_conf {
  *
  *****************************************************************************/
 
-uint64_t event_counter; /* Lamport's Logical clock event counter */
-pthread_mutex_t event_mtx; /* event_counter guard */
+/*
+ * Lamport's Logical clock event counter. It is touched by every thread for
+ * every message, so it is updated with atomic operations only and it lives
+ * on its own cache line not to false share with other globals.
+ */
+typedef struct dlmd_clock {
+	volatile uint64_t event_counter;
+} __aligned(DLMD_CACHE_LINE) dlmd_clock_t;
+
+extern dlmd_clock_t dlmd_clock;
 
 
 /*
@@ -96,50 +301,167 @@ pthread_mutex_t event_mtx; /* event_counter guard */
  *     shared storage and wait for others to come up.
  */
 typedef struct dlmd_node {
-	char node_name[MAX_NAME_LEN];
+	char node_name[DLMD_NODE_NAME_LEN];
 	/* Flag is to MAX_ALIVE_MSG_LOST after alive message receive and
 	   decremented after sending ALIVE message to node. When flag is < 0
 	   I consider this node as disabled */
 	uint32_t alive_flag;
 	/* node type */
 	uint32_t type;
+	/* binary wire version this node understands, 0 is plist only */
+	uint32_t wire_version;
 	int node_socket;
 	struct sockaddr_in node_address;
+	/*
+	 * Serializes sending to node, it is held from taking bundle out of
+	 * out_buf until it is sent, so messages leave in order they were
+	 * queued. Taken before node_mtx.
+	 */
+	pthread_mutex_t send_mtx;
+	/* outgoing bundle, guarded by node_mtx */
+	char out_buf[DLMD_BUNDLE_MAX];
+	size_t out_len;
+	uint32_t out_cnt;
+	/* reliable delivery state, NULL for local node */
+	struct dlmd_rel *rel;
+	/* stream connection to node, -1 when not connected */
+	int stream_fd;
+	int stream_connecting;		/* connect of stream_fd in progress */
+	time_t stream_retry;		/* last connect attempt */
+	pthread_mutex_t stream_mtx;	/* guards stream fields */
+	pthread_cond_t stream_cv;	/* writer thread waits for frames */
+	struct dlmd_event *stream_wev;	/* event loop waits for writable stream */
+	size_t stream_out_len;		/* queued frame bytes */
+	char *stream_out;		/* DLMD_STREAM_OUT_MAX, allocated at connect */
 	/* list of nodes */
 	pthread_mutex_t node_mtx;
 	pthread_cond_t node_cv;
 	SLIST_ENTRY(dlmd_node) next;
-	SLIST_ENTRY(dlmd_node) lock_next;
 } dlmd_node_t;
 
 SLIST_HEAD(dlmd_node_head, dlmd_node);
 
+/*
+ * Bounded lock free queue of messages between processing stages, see
+ * queue.c. Many producers, one consumer.
+ */
+struct dlmd_queue_cell {
+	volatile uint32_t seq;
+	dlmd_node_t *node;		/* destination, NULL for broadcast */
+	dlmd_msg_t msg;
+};
+
+typedef struct dlmd_queue {
+	struct dlmd_queue_cell *cells;
+	uint32_t mask;			/* number of cells - 1 */
+	/* producers and consumer don't share cache lines */
+	volatile uint32_t tail __aligned(DLMD_CACHE_LINE);
+	volatile uint32_t head __aligned(DLMD_CACHE_LINE);
+	volatile int sleeping;		/* consumer waits on doorbell */
+	volatile uint32_t waiting;	/* producers wait for free cell */
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+	pthread_cond_t full_cv;
+	/* statistics */
+	uint64_t puts;
+	uint64_t full;			/* producer had to wait */
+	uint32_t max_depth;
+} dlmd_queue_t;
+
 dlmd_node_t *local_node;
 
+struct dlmd_resource;
+
 /*
  * Lock structure for every lock in dlmd. This will become heart of dlm.
  * I use Lamport mutual eclusion algorith for managing of access to shared 
  * resources defined with dlmd_lock_t.
  *
- * If there are more than one requesters for the same lock I have to check 
- * mode, because CR and CW modes can be allowed concurently, even if their
- * event number are different.
+ * Every lock is one request of one node. Cluster wide it is identified by
+ * resource name, node_id and event_cnt of request message. Locks with
+ * compatible modes can be granted concurently, even if their event numbers
+ * are different.
  */
 typedef struct dlmd_lock {
-	struct dlmd_node_head nodes; 	/* backlink for lock owners */
+	dlmd_node_t *node;		/* lock owner */
+	struct dlmd_resource *res;	/* resource this lock is queued on */
 	uint64_t lock_id;               /* Lock id -> used for dlm lib */
 	uint64_t event_cnt;             /* Lamport logical timestamp for this lock */
 	uint32_t node_id;               /* node-id so I can totaly order all locks in a cluster */
-	uint32_t flags;                 /* Lock Type */
-	uint32_t type;
+	uint32_t mode;                  /* Lock mode LKM_*MODE */
+	uint32_t flags;                 /* Lock flags LKM_* */
+	uint32_t type;			/* DLMD_LOCK_LOCAL/REMOTE */
+	uint32_t state;			/* DLMD_LOCK_WAITING/GRANTED/ACTIVE */
 	uint32_t node_count;		/* Set to node_count after list insertion */
-	char name[MAX_NAME_LEN];
+	uint32_t hash;			/* cached dlmd_lock_hash(name) */
+	uint32_t convert_mode;		/* requested mode of pending conversion */
+	uint64_t convert_event;		/* Lamport timestamp of conversion */
+	int convert_status;		/* result of finished conversion */
+	int lvb_dirty;			/* holder has written lock value block */
+	uint32_t cache;			/* DLMD_LOCK_CACHED/BLOCKED/DROPPING */
+	uint64_t ref;			/* lock id at requester, master engine */
+	dlmd_node_t *master;		/* remote resource master, master engine */
+	int status;			/* EAGAIN when some node refused request */
+	int async;			/* completion not reported yet, async request */
+	void (*ast)(int, int, void *);	/* completion callback of async request */
+	void *ast_arg;
+	int ast_fd;			/* signaled at completion or -1 */
 	pthread_mutex_t lock_mtx;
 	pthread_cond_t  lock_cv;		
-	TAILQ_ENTRY(dlmd_lock) next;
+	TAILQ_ENTRY(dlmd_lock) next;		/* resource grant or wait queue */
+	TAILQ_ENTRY(dlmd_lock) conv_next;	/* resource convert queue */
+	LIST_ENTRY(dlmd_lock) id_next;		/* lock id hash chain */
+	char name[];			/* allocated with lock */
 } dlmd_lock_t;
 
 TAILQ_HEAD(dlmd_lock_head, dlmd_lock);
+LIST_HEAD(dlmd_lock_bucket, dlmd_lock);
+
+/*
+ * Every resource has its own Lamport request queues ordered by
+ * (event_cnt, node_id), so locks on unrelated resources doesn't wait
+ * for each other. Granted group contains locks which are compatible with
+ * each other and with all older requests, wait queue the rest. Granted
+ * locks which want to change their mode to stronger one sit also on convert
+ * queue, conversions are always granted before new requests.
+ * Resource exists only while there are requests for it.
+ */
+#define DLMD_LOCK_MODES 6
+
+/*
+ * Remote request which I don't reply to until my conflicting lock is
+ * released, ricart engine.
+ */
+typedef struct dlmd_defer {
+	dlmd_node_t *node;		/* requester */
+	uint64_t event;			/* Lamport timestamp of request */
+	uint32_t node_id;
+	uint32_t mode;
+	uint32_t flags;			/* LKM_* flags of request */
+	TAILQ_ENTRY(dlmd_defer) next;
+} dlmd_defer_t;
+
+TAILQ_HEAD(dlmd_defer_head, dlmd_defer);
+
+typedef struct dlmd_resource {
+	uint32_t hash;			/* cached dlmd_lock_hash(name) */
+	struct dlmd_lock_head grant_queue;	/* granted group */
+	struct dlmd_lock_head wait_queue;	/* waiting requests, head is the oldest one */
+	struct dlmd_lock_head convert_queue;	/* granted locks waiting for conversion */
+	uint32_t grant_cnt[DLMD_LOCK_MODES];	/* granted locks per mode */
+	uint64_t lvb_seq;			/* lock value block version, 0 is invalid */
+	char lvb[DLMD_LVB_LEN];			/* lock value block */
+	struct dlmd_defer_head deferred;	/* deferred replies, ricart engine */
+	uint32_t token;				/* DLMD_TOKEN_* */
+	dlmd_node_t *owner;			/* probable token holder */
+	uint32_t token_qlen;
+	uint32_t token_queue[DLMD_TOKEN_QUEUE_MAX];	/* nodes waiting for token */
+	uint64_t contended;			/* requests which had to wait */
+	LIST_ENTRY(dlmd_resource) hash_next;
+	char name[];				/* allocated with resource */
+} dlmd_resource_t;
+
+LIST_HEAD(dlmd_resource_bucket, dlmd_resource);
 
 
 /* node.c */
@@ -151,40 +473,166 @@ int dlmd_node_broadcast_msg(const char *, size_t);
 int dlmd_node_unicast_msg(dlmd_node_t *, const char *, size_t);
 int dlmd_node_alive_decrement();
 int dlmd_node_alive_count();
+uint32_t dlmd_node_wire_version();
+dlmd_node_t * dlmd_node_master(uint32_t, int);
 dlmd_node_t * dlmd_node_find(uint32_t, const char *);
 void dlmd_node_busy(dlmd_node_t *);
 void dlmd_node_unbusy(dlmd_node_t *);
 void dlmd_node_init();
+void dlmd_node_stats();
+void * dlmd_node_flush_start(void *);
 
 /* listener.c */
 void * listener_start(void *);
+void listener_event(int, void *);
+void listener_init(dlmd_conf_t *);
+int listener_buf_parse(const char *, size_t);
+void listener_stats();
+
+/* reliable.c */
+#define DLMD_REL_WINDOW      32 /* unacknowledged datagrams tracked by sack */
+#define DLMD_REL_TICK_USEC   5000 /* retransmit timer and delayed ack period */
+#define DLMD_REL_RTO_MIN     20000 /* usec */
+#define DLMD_REL_RTO_MAX     2000000 /* usec */
+#define DLMD_REL_RTO_INIT    200000 /* usec, before first RTT sample */
+struct dlmd_rel * dlmd_rel_alloc(dlmd_node_t *);
+int dlmd_rel_send(struct dlmd_rel *, const char *, size_t);
+int dlmd_rel_input(const char *, size_t, int (*)(const char *, size_t));
+void * dlmd_rel_timer_start(void *);
+void dlmd_rel_event(int, void *);
+void dlmd_rel_stats();
+
+/* stream.c */
+#define DLMD_STREAM_FRAME_MAX   65536
+#define DLMD_STREAM_OUT_MAX     (4 * (4 + DLMD_STREAM_FRAME_MAX))
+#define DLMD_STREAM_BACKLOG     16
+int dlmd_stream_send(dlmd_node_t *, const char *, size_t);
+int dlmd_stream_listen(dlmd_conf_t *);
+void * dlmd_stream_accept_start(void *);
+void dlmd_stream_event_accept(int, void *);
+void dlmd_stream_stats();
+
+/* mcast.c */
+#define DLMD_MCAST_TTL       1 /* default, stay on local network */
+#define DLMD_MCAST_BUF_SIZE  1500
+int dlmd_mcast_init(dlmd_conf_t *);
+int dlmd_mcast_send(const char *, size_t);
+void * dlmd_mcast_listener_start(void *);
+void dlmd_mcast_event(int, void *);
+void dlmd_mcast_stats();
 
 /* keepalive.c */
+#define KEEP_ALIVE_INT 300	/* seconds between keepalives */
+int keepalive_init(dlmd_conf_t *);
+void keepalive_event(int, void *);
 void * keepalive_start(void *);
 
+/* client.c */
+#define DLMD_CLIENT_THREADS  16
+#define DLMD_CLIENT_BACKLOG  16
+#define DLMD_CLIENT_OUT_MAX  16384 /* client not reading replies is dropped */
+int client_init(dlmd_conf_t *);
+void * client_accept_start(void *);
+void client_event_accept(int, void *);
+void client_stats();
+
+/* event.c */
+#define DLMD_EVENT_BATCH     64 /* events returned by one kevent call */
+struct dlmd_event;
+typedef void (*dlmd_event_fn_t)(int, void *);
+void dlmd_event_init();
+struct dlmd_event * dlmd_event_add_fd(int, dlmd_event_fn_t, void *);
+struct dlmd_event * dlmd_event_add_write(int, dlmd_event_fn_t, void *);
+struct dlmd_event * dlmd_event_add_timer(uint32_t, dlmd_event_fn_t, void *);
+void dlmd_event_del(struct dlmd_event *);
+void * dlmd_event_loop_start(void *);
+void dlmd_event_stats();
+
 /* request.c */
 #define DLMD_LOCK_LOCAL      (1 << 0)
 #define DLMD_LOCK_REMOTE     (1 << 1)
-#define DLMD_LOCK_CR   	     (1 << 2)
 
-void dlmd_lock_init();
-dlmd_lock_t * dlmd_lock_add(const char *, int, uint64_t, uint32_t, int);
-dlmd_lock_t * dlmd_lock_find(const char *, uint64_t, int);
+#define DLMD_LOCK_WAITING    0 /* queued on resource wait queue */
+#define DLMD_LOCK_GRANTED    1 /* member of resource granted group */
+#define DLMD_LOCK_ACTIVE     2 /* granted local lock with all replies, owner is in CS */
+#define DLMD_LOCK_DENIED     3 /* LKM_NOQUEUE request refused by master */
+
+/* Resource token mode */
+#define DLMD_TOKEN_MODE      (1 << 0) /* resource is in token mode */
+#define DLMD_TOKEN_HELD      (1 << 1) /* I have token */
+#define DLMD_TOKEN_WANTED    (1 << 2) /* I have requested token */
+#define DLMD_TOKEN_THRESHOLD 1000     /* default contention of token candidate */
+
+/* Cached LKM_CACHE locks */
+#define DLMD_LOCK_CACHED     (1 << 0) /* unlocked by user, kept by node */
+#define DLMD_LOCK_BLOCKED    (1 << 1) /* other request waits, release on unlock */
+#define DLMD_LOCK_DROPPING   (1 << 2) /* being released, can't be reused */
+
+/* Number of buckets in name and lock id hash tables, must be power of 2 */
+#define DLMD_LOCK_HASH_SIZE  (1 << 14)
+#define DLMD_LOCK_HASH_MASK  (DLMD_LOCK_HASH_SIZE - 1)
+#define DLMD_LOCK_SHARDS     16 /* default number of lock table shards */
+
+void dlmd_lock_init(uint32_t, uint32_t);
+void dlmd_lock_stats(uint32_t);
+uint32_t dlmd_lock_hash(const char *);
+int dlmd_lock_mode_valid(uint32_t);
+int dlmd_lock_compat(uint32_t, uint32_t);
+int dlmd_lock_mode_weaker(uint32_t, uint32_t);
+dlmd_lock_t * dlmd_lock_add(const char *, uint32_t, uint64_t, uint32_t, int);
 dlmd_lock_t * dlmd_lock_insert_request(dlmd_lock_t *);
-int dlmd_lock_release(uint64_t, int, dlmd_node_t *);
+int dlmd_lock_release(uint64_t);
+int dlmd_lock_release_ref(const char *, uint32_t, uint64_t);
+int dlmd_lock_reply(const char *, uint64_t, int);
+void dlmd_lock_token_add(const char *);
+int dlmd_lock_token_request(const char *, uint32_t);
+int dlmd_lock_token_grant(const dlmd_msg_t *);
+int dlmd_lock_defer(const char *, dlmd_node_t *, uint64_t, uint32_t, uint32_t, uint32_t);
+int dlmd_lock_granted(uint64_t, int);
+int dlmd_lock_convert(uint64_t, uint32_t);
+int dlmd_lock_convert_ref(const char *, uint32_t, uint64_t, uint32_t, uint64_t);
 void dlmd_lock_wait(dlmd_lock_t *);
-void dlmd_lock_signal(dlmd_lock_t *);
-
-/* XXX better place request.c ? */
-__inline uint64_t dlmd_event_cnt_get();
-__inline uint64_t dlmd_event_cnt_cas(uint64_t);
-__inline uint64_t dlmd_event_cnt_inc();
+int dlmd_lock_timedwait(dlmd_lock_t *, const struct timespec *);
+int dlmd_lock_cancel(uint64_t);
+int dlmd_lock_trywait(dlmd_lock_t *);
+int dlmd_lock_probe(const char *, uint32_t);
+int dlmd_lock_value_get(uint64_t, void *);
+int dlmd_lock_value_set(uint64_t, const void *);
+int dlmd_lock_lvb_read(const char *, void *, uint64_t *);
+void dlmd_lock_lvb_update(const char *, const void *, uint64_t);
+uint64_t dlmd_lock_cache_get(const char *, uint32_t, uint32_t);
+void dlmd_lock_set_bast(void (*)(const char *, int, int, void *), void *);
+void dlmd_lock_async_done(uint64_t, int, void (*)(int, int, void *), void *, int);
+int dlmd_lock_wait_any(const int *, int, int, int *);
 
 /* msg.c */
 char * keepalive_msg_init(const char *);
-char * request_msg_init(const char *, const char *, uint64_t, uint32_t, uint32_t);
-char * reply_msg_init(const char *, const char *, uint64_t, uint32_t);
-char * unlock_msg_init(const char *, const char *, uint64_t, uint32_t);
+void dlmd_msg_init(dlmd_msg_t *, uint32_t, const char *);
+void dlmd_msg_copy(dlmd_msg_t *, const dlmd_msg_t *);
+void dlmd_msg_fini(dlmd_msg_t *);
+ssize_t dlmd_msg_encode(const dlmd_msg_t *, char *, size_t);
+int dlmd_msg_decode(const char *, size_t, dlmd_msg_t *);
+int dlmd_msg_internalize(const char *, dlmd_msg_t *);
+char * dlmd_msg_externalize(const dlmd_msg_t *);
+int dlmd_msg_parse(const char *, size_t, dlmd_msg_t *);
+size_t dlmd_msg_name_max();
+int dlmd_msg_broadcast(const dlmd_msg_t *);
+int dlmd_msg_unicast(dlmd_node_t *, const dlmd_msg_t *);
+int dlmd_msg_send(dlmd_node_t *, const dlmd_msg_t *);
+void dlmd_msg_sender_init();
+void * dlmd_msg_sender_start(void *);
+void dlmd_msg_sender_stats();
+
+/* queue.c */
+#define DLMD_SEND_QUEUE_LEN  4096 /* must be power of 2 */
+#define DLMD_WORKER_QUEUE_LEN 256 /* must be power of 2 */
+void dlmd_queue_init(dlmd_queue_t *, uint32_t);
+void dlmd_queue_put(dlmd_queue_t *, dlmd_node_t *, const dlmd_msg_t *);
+dlmd_msg_t * dlmd_queue_peek(dlmd_queue_t *, dlmd_node_t **);
+void dlmd_queue_release(dlmd_queue_t *);
+void dlmd_queue_wait(dlmd_queue_t *);
+uint32_t dlmd_queue_depth(dlmd_queue_t *);
+void dlmd_queue_stats(dlmd_queue_t *, const char *);
 
 /* tester.c */
 void * tester_start(void *);
@@ -206,49 +654,45 @@ void * tester_start(void *);
  *
  */
 
-/* Return current value of event_counter. */
+/*
+ * Return current value of event_counter. Barrier after load keeps later
+ * loads from being done before it.
+ */
 static __inline uint64_t
 dlmd_event_cnt_get() {
+#ifdef _LP64
 	uint64_t cnt;
-	pthread_mutex_lock(&event_mtx);
-	assert(!event_counter < 0);
-	cnt = event_counter;
-	pthread_mutex_unlock(&event_mtx);
+
+	cnt = dlmd_clock.event_counter;
+	membar_consumer();
+
 	return cnt;
+#else
+	return atomic_add_64_nv(&dlmd_clock.event_counter, 0);
+#endif
 }
 
-/* Compare and swap event_counter and value from received request, return maximal value + 1. */
+/*
+ * Compare and swap event_counter and value from received request, return
+ * maximal value + 1. If other thread moves clock between my read and cas,
+ * I have to compute maximum again.
+ */
 static __inline uint64_t
 dlmd_event_cnt_cas(uint64_t request_cnt) {
-	uint64_t cnt;
-	pthread_mutex_lock(&event_mtx);
-	assert(event_counter >= 0);
-	assert(request_cnt >= 0);
-
-	if (event_counter < request_cnt)
-		event_counter = request_cnt;
+	uint64_t cnt, ncnt;
 
-	event_counter++;
-	
-	cnt = event_counter;
-	
-	pthread_mutex_unlock(&event_mtx);
+	do {
+		cnt = dlmd_event_cnt_get();
+		ncnt = (cnt < request_cnt ? request_cnt : cnt) + 1;
+	} while (atomic_cas_64(&dlmd_clock.event_counter, cnt, ncnt) != cnt);
 
-	return cnt;
+	return ncnt;
 }
 
 /* Increase event_counter and return it's value */
 static __inline uint64_t
 dlmd_event_cnt_inc() {
-	uint64_t cnt;
-	pthread_mutex_lock(&event_mtx);
-	assert(event_counter >= 0);
-	
-	cnt = (++event_counter);
-
-	pthread_mutex_unlock(&event_mtx);
-
-	return cnt;
+	return atomic_inc_64_nv(&dlmd_clock.event_counter);
 }
 
 #endif /* _DLMD_H_ */
@@ -0,0 +1,179 @@
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <prop/proplib.h>
+
+#include "dlmd.h"
+
+/*
+ * Event loop. With conf.event_loop one thread waits in kevent for all dlmd
+ * descriptors and timers instead of thread blocked in recvmmsg, thread
+ * sleeping between keepalives, thread sleeping between retransmit ticks and
+ * thread for every stream connection. Every registered event has callback
+ * which is called from loop thread, callbacks must not block.
+ *
+ * Message workers, sender and bundle flush thread stay separate threads,
+ * they are processing stages not waiting for I/O.
+ */
+
+struct dlmd_event {
+	uintptr_t ident;
+	int filter;
+	dlmd_event_fn_t fn;		/* NULL after dlmd_event_del */
+	void *arg;
+	SLIST_ENTRY(dlmd_event) next;
+};
+
+static int event_kq = -1;
+static uint32_t event_timer_id;
+
+/* Deleted events, freed after batch which can still return them */
+static SLIST_HEAD(, dlmd_event) event_dead = SLIST_HEAD_INITIALIZER(event_dead);
+
+static uint64_t event_loops;
+static uint64_t event_calls;
+
+static struct dlmd_event * dlmd_event_add(uintptr_t, int, uint32_t, int64_t,
+    dlmd_event_fn_t, void *);
+
+/*
+ * Create kqueue of event loop.
+ */
+void
+dlmd_event_init()
+{
+	if ((event_kq = kqueue()) == -1)
+		err(EXIT_FAILURE, "Creating kqueue failed");
+}
+
+static struct dlmd_event *
+dlmd_event_add(uintptr_t ident, int filter, uint32_t flags, int64_t data,
+    dlmd_event_fn_t fn, void *arg)
+{
+	struct dlmd_event *ev;
+	struct kevent kev;
+
+	if ((ev = malloc(sizeof(struct dlmd_event))) == NULL)
+		return NULL;
+
+	ev->ident = ident;
+	ev->filter = filter;
+	ev->fn = fn;
+	ev->arg = arg;
+
+	EV_SET(&kev, ident, filter, EV_ADD | flags, 0, data, ev);
+
+	if (kevent(event_kq, &kev, 1, NULL, 0, NULL) == -1) {
+		free(ev);
+		return NULL;
+	}
+
+	return ev;
+}
+
+/*
+ * Call fn when fd is readable.
+ */
+struct dlmd_event *
+dlmd_event_add_fd(int fd, dlmd_event_fn_t fn, void *arg)
+{
+	return dlmd_event_add(fd, EVFILT_READ, 0, 0, fn, arg);
+}
+
+/*
+ * Call fn when fd is writable.
+ */
+struct dlmd_event *
+dlmd_event_add_write(int fd, dlmd_event_fn_t fn, void *arg)
+{
+	return dlmd_event_add(fd, EVFILT_WRITE, 0, 0, fn, arg);
+}
+
+/*
+ * Call fn every msec milliseconds.
+ */
+struct dlmd_event *
+dlmd_event_add_timer(uint32_t msec, dlmd_event_fn_t fn, void *arg)
+{
+	return dlmd_event_add(atomic_inc_32_nv(&event_timer_id), EVFILT_TIMER,
+	    0, msec, fn, arg);
+}
+
+/*
+ * Remove event, descriptor has to be still open. Must be called from event
+ * loop thread, current batch can still hold the event so it is freed after
+ * the batch and its callback is not called any more.
+ */
+void
+dlmd_event_del(struct dlmd_event *ev)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, ev->ident, ev->filter, EV_DELETE, 0, 0, NULL);
+	kevent(event_kq, &kev, 1, NULL, 0, NULL);
+
+	ev->fn = NULL;
+	SLIST_INSERT_HEAD(&event_dead, ev, next);
+}
+
+/*
+ * Event loop thread.
+ */
+void *
+dlmd_event_loop_start(void *arg)
+{
+	struct kevent kev[DLMD_EVENT_BATCH];
+	struct dlmd_event *ev;
+	int i, n;
+
+	while (1) {
+		if ((n = kevent(event_kq, NULL, 0, kev, DLMD_EVENT_BATCH,
+		    NULL)) == -1) {
+			if (errno != EINTR)
+				DPRINTF(("kevent failed."));
+			continue;
+		}
+
+		event_loops++;
+		event_calls += n;
+
+		for (i = 0; i < n; i++) {
+			ev = (struct dlmd_event *)kev[i].udata;
+			if (ev->fn != NULL)
+				ev->fn(kev[i].ident, ev->arg);
+		}
+
+		while ((ev = SLIST_FIRST(&event_dead)) != NULL) {
+			SLIST_REMOVE_HEAD(&event_dead, next);
+			free(ev);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Print event loop counters.
+ */
+void
+dlmd_event_stats()
+{
+	if (event_kq == -1)
+		return;
+
+	printf("Event loop woke up %"PRIu64" times for %"PRIu64" events\n",
+	    event_loops, event_calls);
+}
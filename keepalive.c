@@ -16,40 +16,58 @@
 
 #include "dlmd.h"
 
-#define KEEP_ALIVE_INT 300
+static char *keepalive_buf;
 
 /*
- * This file will contain all routines used in sender thread.
+ * Prepare keepalive message of local node.
  */
-void *
-keepalive_start(void *arg)
+int
+keepalive_init(dlmd_conf_t *conf)
 {
-	dlmd_conf_t *conf = (dlmd_conf_t *)arg;
 	const char *name;
-	char *buf;
-	
+
 	prop_dictionary_get_cstring_nocopy(conf->dict, DLMDICT_LOCAL_NAME,
 	    &name);
 
-	if ((buf = keepalive_msg_init(name)) == NULL){
+	if ((keepalive_buf = keepalive_msg_init(name)) == NULL){
 		DPRINTF(("Unable to create message buffer."));
-		pthread_exit(NULL);
+		return ENOMEM;
 	}
+
+	return 0;
+}
+
+/*
+ * Broadcast keepalive message to all active cluster nodes, it is called
+ * every KEEP_ALIVE_INT seconds from keepalive thread or event loop timer.
+ */
+void
+keepalive_event(int ident, void *arg)
+{
+	dlmd_node_broadcast_msg(keepalive_buf, strlen(keepalive_buf));
+	/*
+	 * Decrement alive flag after I have sent alive message to them. If I receive
+	 * keepalive message from node I will increment flag. 
+	 */
+	dlmd_node_alive_decrement();
+}
+
+/*
+ * This file will contain all routines used in sender thread.
+ */
+void *
+keepalive_start(void *arg)
+{
+	dlmd_conf_t *conf = (dlmd_conf_t *)arg;
+
+	if (keepalive_init(conf) != 0)
+		pthread_exit(NULL);
 		
 	while (1) {
-		/*
-		 * Broadcast message to all active cluster nodes every 300 seconds.
-		 */
-		dlmd_node_broadcast_msg(buf, strlen(buf));
-		/*
-		 * Decrement alive flag after I have sent alive message to them. If I receive
-		 * keepalive message from node I will increment flag. 
-		 */
-		dlmd_node_alive_decrement();
+		keepalive_event(0, conf);
 		
 		sleep(KEEP_ALIVE_INT);
 	}
 	
 	return NULL;
 }
-
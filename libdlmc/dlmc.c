@@ -0,0 +1,1020 @@
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/atomic.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/endian.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lock.h"
+#include "client.h"
+#include "dlmc.h"
+
+/*
+ * Requests are collected in output buffer and written together when it is
+ * full, when caller waits for reply or calls dlmc_flush, so pipelined
+ * requests cost one write for many of them.
+ */
+#define DLMC_OUT_SIZE	(64 * 1024)
+#define DLMC_IN_SIZE	(64 * 1024)
+
+/*
+ * With shared memory rings I poll completion ring this many times before
+ * I go to sleep on socket, locally granted lock is usually there by then.
+ */
+#define DLMC_SHM_SPIN	10000
+
+struct dlmc {
+	int fd;
+	uint32_t next_id;
+	uint32_t outstanding;		/* requests without reply */
+	struct dlmc_shm *shm;		/* rings or NULL */
+	uint32_t sq_tail;
+	uint32_t cq_head;
+	size_t out_len;
+	size_t in_len;
+	size_t in_off;
+	char out[DLMC_OUT_SIZE];
+	char in[DLMC_IN_SIZE];
+};
+
+/*
+ * Request of lock.h function on default connection waiting for reply.
+ * Granted async request stays on the list until it is unlocked,
+ * lock_wait_any and lock_cancel look it up by lockid.
+ */
+struct dlmc_wait {
+	uint32_t id;			/* request id */
+	int async;
+	int started;			/* async, lockid is known */
+	int done;			/* final reply came */
+	int returned;			/* lock_resource_async is done with me */
+	int gone;			/* freed when lock_resource_async is done */
+	struct dlmc_reply rep;
+	lock_ast_t ast;
+	void *arg;
+	int fd;
+	LIST_ENTRY(dlmc_wait) next;
+};
+
+/*
+ * Connection used by lock.h functions. First async request starts reader
+ * thread which takes all replies from then on, callers wait on
+ * dlmc_default_cv for them.
+ */
+static dlmc_t *dlmc_default;
+static pthread_mutex_t dlmc_default_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dlmc_default_cv = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(, dlmc_wait) dlmc_waits = LIST_HEAD_INITIALIZER(dlmc_waits);
+static int dlmc_reader;			/* reader thread is running */
+static int dlmc_reader_error;		/* connection broke under reader */
+
+static uint32_t dlmc_shm_seq;
+
+static size_t dlmc_encode(char *, int, const char *, size_t, int, int, int,
+    const void *, uint32_t);
+static int dlmc_decode(const char *, size_t, struct dlmc_reply *);
+static int dlmc_send(dlmc_t *, int, const char *, int, int, int,
+    const void *, uint32_t *);
+static int dlmc_recv(dlmc_t *, struct dlmc_reply *);
+static int dlmc_shm_reply(dlmc_t *, struct dlmc_reply *);
+static int dlmc_default_open();
+static int dlmc_reader_init();
+static void * dlmc_reader_start(void *);
+static int dlmc_wait_reply(uint32_t, struct dlmc_reply *);
+static void dlmc_wait_free(struct dlmc_wait *);
+static int dlmc_call(int, const char *, int, int, int, const void *,
+    struct dlmc_reply *);
+
+/*
+ * Connect to dlmd client socket, NULL path is default one.
+ */
+dlmc_t *
+dlmc_open(const char *path)
+{
+	struct sockaddr_un sun;
+	dlmc_t *dc;
+
+	if (path == NULL && (path = getenv("DLMD_SOCKET")) == NULL)
+		path = DLMD_CLIENT_SOCKET;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_LOCAL;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	if ((dc = malloc(sizeof(dlmc_t))) == NULL)
+		return NULL;
+
+	dc->next_id = 1;
+	dc->outstanding = 0;
+	dc->shm = NULL;
+	dc->out_len = dc->in_len = dc->in_off = 0;
+
+	if ((dc->fd = socket(AF_LOCAL, SOCK_STREAM, 0)) == -1) {
+		free(dc);
+		return NULL;
+	}
+
+	if (connect(dc->fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		close(dc->fd);
+		free(dc);
+		return NULL;
+	}
+
+	return dc;
+}
+
+/*
+ * Close connection, dlmd releases all locks taken through it.
+ */
+void
+dlmc_close(dlmc_t *dc)
+{
+	if (dc->shm != NULL)
+		munmap(dc->shm, sizeof(struct dlmc_shm));
+
+	close(dc->fd);
+	free(dc);
+}
+
+/*
+ * Descriptor of connection, it is readable when reply arrives.
+ */
+int
+dlmc_fd(dlmc_t *dc)
+{
+	return dc->fd;
+}
+
+/*
+ * Write all buffered requests.
+ */
+int
+dlmc_flush(dlmc_t *dc)
+{
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < dc->out_len; off += n) {
+		if ((n = write(dc->fd, dc->out + off, dc->out_len - off)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return errno;
+		}
+	}
+
+	dc->out_len = 0;
+
+	return 0;
+}
+
+/*
+ * Write request to buf, returns its length.
+ */
+static size_t
+dlmc_encode(char *buf, int op, const char *name, size_t name_len, int mode,
+    int flags, int lockid, const void *lvb, uint32_t id)
+{
+	size_t len;
+
+	len = DLMC_REQ_HDR_LEN + name_len + (lvb != NULL ? DLMC_LVB_LEN : 0);
+
+	be32enc(buf, len);
+	buf[4] = op;
+	buf[5] = DLMC_VERSION;
+	be16enc(buf + 6, name_len);
+	be32enc(buf + 8, id);
+	be32enc(buf + 12, mode);
+	be32enc(buf + 16, flags);
+	be32enc(buf + 20, lockid);
+	if (name_len != 0)
+		memcpy(buf + DLMC_REQ_HDR_LEN, name, name_len);
+	if (lvb != NULL)
+		memcpy(buf + DLMC_REQ_HDR_LEN + name_len, lvb, DLMC_LVB_LEN);
+
+	return len;
+}
+
+/*
+ * Append request to output buffer or submission ring.
+ */
+static int
+dlmc_send(dlmc_t *dc, int op, const char *name, int mode, int flags,
+    int lockid, const void *lvb, uint32_t *id)
+{
+	struct dlmc_ring *sq;
+	size_t name_len, len;
+	int error;
+
+	name_len = (name != NULL) ? strlen(name) : 0;
+	if (name_len > DLMC_NAME_MAX)
+		return ENAMETOOLONG;
+
+	/* Id 0 is never used */
+	if (dc->next_id == 0)
+		dc->next_id++;
+
+	if (dc->shm != NULL) {
+		/* Reply must fit to completion ring */
+		if (dc->outstanding >= DLMC_RING_SLOTS)
+			return ENOBUFS;
+
+		*id = dc->next_id++;
+		dc->outstanding++;
+
+		sq = &dc->shm->sq;
+		dlmc_encode(sq->slot[dc->sq_tail % DLMC_RING_SLOTS], op, name,
+		    name_len, mode, flags, lockid, lvb, *id);
+
+		membar_producer();
+		sq->tail = ++dc->sq_tail;
+		membar_sync();
+
+		/* dlmd sleeps, ring doorbell */
+		if (sq->wakeup && atomic_cas_32(&sq->wakeup, 1, 0) == 1 &&
+		    write(dc->fd, "", 1) == -1)
+			return errno;
+
+		return 0;
+	}
+
+	len = DLMC_REQ_HDR_LEN + name_len + (lvb != NULL ? DLMC_LVB_LEN : 0);
+
+	if (dc->out_len + len > sizeof(dc->out) && (error = dlmc_flush(dc)) != 0)
+		return error;
+
+	*id = dc->next_id++;
+	dc->outstanding++;
+
+	dc->out_len += dlmc_encode(dc->out + dc->out_len, op, name, name_len,
+	    mode, flags, lockid, lvb, *id);
+
+	return 0;
+}
+
+int
+dlmc_lock_send(dlmc_t *dc, const char *resource, int mode, int flags,
+    int lockid, uint32_t *id)
+{
+	return dlmc_send(dc, DLMC_OP_LOCK, resource, mode, flags, lockid, NULL, id);
+}
+
+int
+dlmc_lock_timeout_send(dlmc_t *dc, const char *resource, int mode, int flags,
+    int msec, uint32_t *id)
+{
+	/* Timeout takes lockid field */
+	if (msec < 0 || (flags & LKM_CONVERT))
+		return EINVAL;
+
+	return dlmc_send(dc, DLMC_OP_LOCK, resource, mode,
+	    flags | DLMC_F_TIMEOUT, msec, NULL, id);
+}
+
+int
+dlmc_cancel_send(dlmc_t *dc, uint32_t lock_id, uint32_t *id)
+{
+	return dlmc_send(dc, DLMC_OP_CANCEL, NULL, 0, 0, lock_id, NULL, id);
+}
+
+int
+dlmc_unlock_send(dlmc_t *dc, int lockid, uint32_t *id)
+{
+	return dlmc_send(dc, DLMC_OP_UNLOCK, NULL, 0, 0, lockid, NULL, id);
+}
+
+int
+dlmc_value_get_send(dlmc_t *dc, int lockid, uint32_t *id)
+{
+	return dlmc_send(dc, DLMC_OP_VALUE_GET, NULL, 0, 0, lockid, NULL, id);
+}
+
+int
+dlmc_value_set_send(dlmc_t *dc, int lockid, const void *buf, uint32_t *id)
+{
+	return dlmc_send(dc, DLMC_OP_VALUE_SET, NULL, 0, 0, lockid, buf, id);
+}
+
+/*
+ * Read reply from buf.
+ */
+static int
+dlmc_decode(const char *buf, size_t len, struct dlmc_reply *rep)
+{
+	if (len < DLMC_REP_HDR_LEN)
+		return EPROTO;
+
+	rep->op = (uint8_t)buf[4];
+	rep->id = be32dec(buf + 8);
+	rep->status = be32dec(buf + 12);
+	rep->lockid = be32dec(buf + 16);
+	if (len >= DLMC_REP_HDR_LEN + DLMC_LVB_LEN)
+		memcpy(rep->lvb, buf + DLMC_REP_HDR_LEN, DLMC_LVB_LEN);
+
+	return 0;
+}
+
+/*
+ * Wait for next reply. Buffered requests are written first.
+ */
+int
+dlmc_reply(dlmc_t *dc, struct dlmc_reply *rep)
+{
+	int error;
+
+	if (dc->shm == NULL && (error = dlmc_flush(dc)) != 0)
+		return error;
+
+	if ((error = dlmc_recv(dc, rep)) != 0)
+		return error;
+
+	dc->outstanding--;
+
+	return 0;
+}
+
+/*
+ * Read next reply from socket or completion ring.
+ */
+static int
+dlmc_recv(dlmc_t *dc, struct dlmc_reply *rep)
+{
+	const char *p;
+	size_t len;
+	ssize_t n;
+	int error;
+
+	if (dc->shm != NULL)
+		return dlmc_shm_reply(dc, rep);
+
+	while (1) {
+		p = dc->in + dc->in_off;
+
+		if (dc->in_len - dc->in_off >= DLMC_REP_HDR_LEN &&
+		    dc->in_len - dc->in_off >= (len = be32dec(p)))
+			break;
+
+		/* Move partial reply to the start of buffer */
+		memmove(dc->in, p, dc->in_len - dc->in_off);
+		dc->in_len -= dc->in_off;
+		dc->in_off = 0;
+
+		if ((n = read(dc->fd, dc->in + dc->in_len,
+		    sizeof(dc->in) - dc->in_len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		if (n == 0)
+			return ECONNRESET;
+
+		dc->in_len += n;
+	}
+
+	if ((error = dlmc_decode(p, len, rep)) != 0)
+		return error;
+
+	dc->in_off += len;
+
+	return 0;
+}
+
+/*
+ * Take reply from completion ring, spin for a while and then sleep until
+ * dlmd rings.
+ */
+static int
+dlmc_shm_reply(dlmc_t *dc, struct dlmc_reply *rep)
+{
+	struct dlmc_ring *cq;
+	const char *p;
+	uint32_t spin;
+	ssize_t n;
+	int error;
+
+	cq = &dc->shm->cq;
+
+	for (spin = 0; cq->tail == dc->cq_head; spin++) {
+		if (spin < DLMC_SHM_SPIN)
+			continue;
+
+		cq->wakeup = 1;
+		membar_sync();
+
+		/* Reply came before dlmd saw wakeup */
+		if (cq->tail != dc->cq_head) {
+			atomic_cas_32(&cq->wakeup, 1, 0);
+			break;
+		}
+
+		/* Doorbell bytes carry nothing */
+		if ((n = read(dc->fd, dc->in, sizeof(dc->in))) == -1 &&
+		    errno != EINTR)
+			return errno;
+
+		if (n == 0)
+			return ECONNRESET;
+	}
+
+	membar_consumer();
+
+	p = cq->slot[dc->cq_head % DLMC_RING_SLOTS];
+	if ((error = dlmc_decode(p, MIN(be32dec(p), DLMC_RING_SLOT), rep)) != 0)
+		return error;
+
+	membar_sync();
+	cq->head = ++dc->cq_head;
+
+	return 0;
+}
+
+/*
+ * Move connection to shared memory rings. There must be no outstanding
+ * requests.
+ */
+int
+dlmc_shm(dlmc_t *dc)
+{
+	char buf[DLMC_REQ_HDR_LEN], name[32];
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct dlmc_reply rep;
+	struct cmsghdr *cmsg;
+	struct dlmc_shm *shm;
+	struct msghdr msg;
+	struct iovec iov;
+	uint32_t id;
+	int fd, error;
+
+	if (dc->shm != NULL)
+		return 0;
+
+	if (dc->outstanding != 0)
+		return EBUSY;
+
+	/* Object is only needed until descriptor is passed */
+	snprintf(name, sizeof(name), "/dlmc.%d.%u", (int)getpid(),
+	    atomic_inc_32_nv(&dlmc_shm_seq));
+
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1)
+		return errno;
+
+	shm_unlink(name);
+
+	if (ftruncate(fd, sizeof(struct dlmc_shm)) == -1 ||
+	    (shm = mmap(NULL, sizeof(struct dlmc_shm), PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		error = errno;
+		close(fd);
+		return error;
+	}
+
+	if (dc->next_id == 0)
+		dc->next_id++;
+	id = dc->next_id++;
+
+	iov.iov_base = buf;
+	iov.iov_len = dlmc_encode(buf, DLMC_OP_SHM_ATTACH, NULL, 0, 0, 0, 0,
+	    NULL, id);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	if ((error = dlmc_flush(dc)) == 0 && sendmsg(dc->fd, &msg, 0) == -1)
+		error = errno;
+
+	close(fd);
+
+	if (error == 0) {
+		dc->outstanding++;
+		if ((error = dlmc_reply(dc, &rep)) == 0)
+			error = rep.status;
+	}
+
+	if (error != 0) {
+		munmap(shm, sizeof(struct dlmc_shm));
+		return error;
+	}
+
+	dc->shm = shm;
+	dc->sq_tail = shm->sq.tail;
+	dc->cq_head = shm->cq.head;
+
+	return 0;
+}
+
+/*
+ * Open default connection unless it is open. Must be called with
+ * dlmc_default_mtx held.
+ */
+static int
+dlmc_default_open()
+{
+	if (dlmc_default != NULL)
+		return 0;
+
+	if ((dlmc_default = dlmc_open(NULL)) == NULL)
+		return errno;
+
+	/* Socket is used when dlmd does not take rings */
+	dlmc_shm(dlmc_default);
+
+	return 0;
+}
+
+/*
+ * Start reader thread of default connection. Must be called with
+ * dlmc_default_mtx held, so nobody else reads replies now.
+ */
+static int
+dlmc_reader_init()
+{
+	pthread_t thread;
+
+	if (dlmc_reader)
+		return 0;
+
+	if (pthread_create(&thread, NULL, &dlmc_reader_start, NULL) != 0)
+		return EAGAIN;
+
+	pthread_detach(thread);
+	dlmc_reader = 1;
+
+	return 0;
+}
+
+/*
+ * Reader thread of default connection. It finishes async requests and
+ * hands other replies to threads waiting for them.
+ */
+static void *
+dlmc_reader_start(void *arg)
+{
+	struct dlmc_reply rep;
+	struct dlmc_wait *w, *tmp;
+	lock_ast_t ast;
+	uint64_t one;
+	int error, fd;
+
+	while ((error = dlmc_recv(dlmc_default, &rep)) == 0) {
+		pthread_mutex_lock(&dlmc_default_mtx);
+
+		dlmc_default->outstanding--;
+
+		LIST_FOREACH(w, &dlmc_waits, next) {
+			if (w->id == rep.id && !w->done)
+				break;
+		}
+
+		/* EINPROGRESS which came after final reply */
+		if (w == NULL) {
+			pthread_mutex_unlock(&dlmc_default_mtx);
+			continue;
+		}
+
+		if (w->async && rep.op == DLMC_OP_LOCK &&
+		    rep.status == EINPROGRESS) {
+			w->started = 1;
+			w->rep.lockid = rep.lockid;
+			pthread_cond_broadcast(&dlmc_default_cv);
+			pthread_mutex_unlock(&dlmc_default_mtx);
+			continue;
+		}
+
+		w->rep = rep;
+		w->done = 1;
+		pthread_cond_broadcast(&dlmc_default_cv);
+
+		if (!w->async) {
+			LIST_REMOVE(w, next);
+			pthread_mutex_unlock(&dlmc_default_mtx);
+			continue;
+		}
+
+		/* Request was not queued, no EINPROGRESS reply comes */
+		if (!w->started && rep.status != 0) {
+			dlmc_default->outstanding--;
+			pthread_mutex_unlock(&dlmc_default_mtx);
+			continue;
+		}
+
+		w->started = 1;
+		ast = w->ast;
+		arg = w->arg;
+		fd = w->fd;
+
+		/* Request is gone in dlmd too, lock_wait_any sees ENOENT */
+		if (rep.status != 0) {
+			LIST_REMOVE(w, next);
+			dlmc_wait_free(w);
+		}
+
+		pthread_mutex_unlock(&dlmc_default_mtx);
+
+		if (ast != NULL)
+			ast(rep.lockid, rep.status, arg);
+
+		if (fd != -1) {
+			one = 1;
+			write(fd, &one, sizeof(one));
+		}
+	}
+
+	/* Fail everybody who waits */
+	pthread_mutex_lock(&dlmc_default_mtx);
+
+	dlmc_reader_error = error;
+
+	LIST_FOREACH_SAFE(w, &dlmc_waits, next, tmp) {
+		if (w->done)
+			continue;
+
+		w->done = 1;
+		w->rep.status = error;
+
+		if (!w->async)
+			LIST_REMOVE(w, next);
+	}
+
+	pthread_cond_broadcast(&dlmc_default_cv);
+	pthread_mutex_unlock(&dlmc_default_mtx);
+
+	return NULL;
+}
+
+/*
+ * Wait for reply to request id taken by reader thread. Must be called with
+ * dlmc_default_mtx held.
+ */
+static int
+dlmc_wait_reply(uint32_t id, struct dlmc_reply *rep)
+{
+	struct dlmc_wait w;
+	int error;
+
+	if (dlmc_reader_error != 0)
+		return dlmc_reader_error;
+
+	memset(&w, 0, sizeof(w));
+	w.id = id;
+	w.fd = -1;
+
+	LIST_INSERT_HEAD(&dlmc_waits, &w, next);
+
+	if ((error = dlmc_flush(dlmc_default)) != 0) {
+		LIST_REMOVE(&w, next);
+		return error;
+	}
+
+	while (!w.done)
+		pthread_cond_wait(&dlmc_default_cv, &dlmc_default_mtx);
+
+	*rep = w.rep;
+
+	return 0;
+}
+
+/*
+ * Free async request taken off the list, lock_resource_async can still
+ * look at it. Must be called with dlmc_default_mtx held.
+ */
+static void
+dlmc_wait_free(struct dlmc_wait *w)
+{
+	if (w->returned)
+		free(w);
+	else
+		w->gone = 1;
+}
+
+/*
+ * Send request on default connection and wait for its reply. Until reader
+ * thread runs caller reads replies itself with dlmc_default_mtx held.
+ */
+static int
+dlmc_call(int op, const char *name, int mode, int flags, int lockid,
+    const void *lvb, struct dlmc_reply *rep)
+{
+	uint32_t id;
+	int error;
+
+	pthread_mutex_lock(&dlmc_default_mtx);
+
+	if ((error = dlmc_default_open()) != 0) {
+		pthread_mutex_unlock(&dlmc_default_mtx);
+		return error;
+	}
+
+	if ((error = dlmc_send(dlmc_default, op, name, mode, flags, lockid,
+	    lvb, &id)) == 0) {
+		if (dlmc_reader)
+			error = dlmc_wait_reply(id, rep);
+		else {
+			do {
+				error = dlmc_reply(dlmc_default, rep);
+			} while (error == 0 && rep->id != id);
+		}
+	}
+
+	pthread_mutex_unlock(&dlmc_default_mtx);
+
+	return (error != 0) ? error : rep->status;
+}
+
+/*
+ * lock.h API. Until first async request, lock requests on default
+ * connection are serialized and caller waiting for lock blocks other
+ * threads of process.
+ */
+int
+lock_resource(const char *resource, int mode, int flags, int *lockid)
+{
+	struct dlmc_reply rep;
+	int error;
+
+	error = dlmc_call(DLMC_OP_LOCK, resource, mode, flags,
+	    (flags & LKM_CONVERT) ? *lockid : 0, NULL, &rep);
+
+	if (error == 0)
+		*lockid = rep.lockid;
+
+	return error;
+}
+
+/*
+ * dlmd replies EINPROGRESS with lockid of queued request first, I wait for
+ * it so lockid can be returned. Callback and fd are served by reader
+ * thread.
+ */
+int
+lock_resource_async(const char *resource, int mode, int flags, lock_ast_t ast,
+    void *arg, int fd, int *lockid)
+{
+	struct dlmc_wait *w;
+	int error;
+
+	/* Same as in dlmd */
+	if (flags & (LKM_CONVERT | LKM_NOQUEUE))
+		return EOPNOTSUPP;
+
+	if ((w = calloc(1, sizeof(struct dlmc_wait))) == NULL)
+		return ENOMEM;
+
+	w->async = 1;
+	w->ast = ast;
+	w->arg = arg;
+	w->fd = fd;
+
+	pthread_mutex_lock(&dlmc_default_mtx);
+
+	if ((error = dlmc_default_open()) != 0 ||
+	    (error = dlmc_reader_init()) != 0) {
+		pthread_mutex_unlock(&dlmc_default_mtx);
+		free(w);
+		return error;
+	}
+
+	/* EINPROGRESS reply needs room in completion ring too */
+	dlmc_default->outstanding++;
+
+	if ((error = dlmc_send(dlmc_default, DLMC_OP_LOCK, resource, mode,
+	    flags | DLMC_F_ASYNC, 0, NULL, &w->id)) != 0) {
+		dlmc_default->outstanding--;
+		pthread_mutex_unlock(&dlmc_default_mtx);
+		free(w);
+		return error;
+	}
+
+	LIST_INSERT_HEAD(&dlmc_waits, w, next);
+
+	if ((error = dlmc_flush(dlmc_default)) == 0) {
+		while (!w->started && !w->done)
+			pthread_cond_wait(&dlmc_default_cv, &dlmc_default_mtx);
+
+		if (!w->started)
+			error = w->rep.status;
+	}
+
+	if (error != 0) {
+		if (!w->gone)
+			LIST_REMOVE(w, next);
+		free(w);
+	} else {
+		*lockid = w->rep.lockid;
+		w->returned = 1;
+		if (w->gone)
+			free(w);
+	}
+
+	pthread_mutex_unlock(&dlmc_default_mtx);
+
+	return error;
+}
+
+int
+lock_wait_any(const int *lockids, int n, int msec, int *index)
+{
+	struct timespec ts;
+	struct dlmc_wait *w;
+	int i, timedout;
+
+	if (n <= 0)
+		return EINVAL;
+
+	if (msec >= 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += msec / 1000;
+		ts.tv_nsec += (msec % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&dlmc_default_mtx);
+
+	for (timedout = 0; !timedout;) {
+		for (i = 0; i < n; i++) {
+			LIST_FOREACH(w, &dlmc_waits, next) {
+				if (w->async && w->started &&
+				    w->rep.lockid == lockids[i])
+					break;
+			}
+
+			if (w == NULL || w->done) {
+				pthread_mutex_unlock(&dlmc_default_mtx);
+				*index = i;
+				return (w == NULL) ? ENOENT : w->rep.status;
+			}
+		}
+
+		/* After timeout requests are checked once more */
+		if (msec < 0)
+			pthread_cond_wait(&dlmc_default_cv, &dlmc_default_mtx);
+		else
+			timedout = (pthread_cond_timedwait(&dlmc_default_cv,
+			    &dlmc_default_mtx, &ts) == ETIMEDOUT);
+	}
+
+	pthread_mutex_unlock(&dlmc_default_mtx);
+
+	return ETIMEDOUT;
+}
+
+/*
+ * Deadline is sent as timeout, dlmd and I share the clock.
+ */
+int
+lock_resource_deadline(const char *resource, int mode, int flags,
+    const struct timespec *deadline, int *lockid)
+{
+	struct timespec now;
+	int64_t msec;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	msec = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000 +
+	    (deadline->tv_nsec - now.tv_nsec) / 1000000;
+	if (msec < 0)
+		msec = 0;
+	if (msec > INT_MAX)
+		msec = INT_MAX;
+
+	return lock_resource_timeout(resource, mode, flags, msec, lockid);
+}
+
+int
+lock_resource_timeout(const char *resource, int mode, int flags, int msec,
+    int *lockid)
+{
+	struct dlmc_reply rep;
+	int error;
+
+	if (msec < 0)
+		return EINVAL;
+
+	/* Deadline does not apply to conversions, lockid field is taken */
+	if (flags & LKM_CONVERT)
+		return lock_resource(resource, mode, flags, lockid);
+
+	error = dlmc_call(DLMC_OP_LOCK, resource, mode, flags | DLMC_F_TIMEOUT,
+	    msec, NULL, &rep);
+
+	if (error == 0)
+		*lockid = rep.lockid;
+
+	return error;
+}
+
+/*
+ * Cancel is sent with request id of async request.
+ */
+int
+lock_cancel(int lockid)
+{
+	struct dlmc_reply rep;
+	struct dlmc_wait *w;
+	uint32_t id;
+
+	pthread_mutex_lock(&dlmc_default_mtx);
+
+	LIST_FOREACH(w, &dlmc_waits, next) {
+		if (w->async && w->started && w->rep.lockid == lockid)
+			break;
+	}
+
+	if (w == NULL || w->done) {
+		pthread_mutex_unlock(&dlmc_default_mtx);
+		return (w == NULL) ? ENOENT : EBUSY;
+	}
+
+	id = w->id;
+
+	pthread_mutex_unlock(&dlmc_default_mtx);
+
+	return dlmc_call(DLMC_OP_CANCEL, NULL, 0, 0, id, NULL, &rep);
+}
+
+int
+unlock_resource(int lockid)
+{
+	struct dlmc_reply rep;
+	struct dlmc_wait *w;
+	int error;
+
+	if ((error = dlmc_call(DLMC_OP_UNLOCK, NULL, 0, 0, lockid, NULL,
+	    &rep)) != 0)
+		return error;
+
+	/* Forget granted async request */
+	pthread_mutex_lock(&dlmc_default_mtx);
+
+	LIST_FOREACH(w, &dlmc_waits, next) {
+		if (w->async && w->done && w->rep.lockid == lockid) {
+			LIST_REMOVE(w, next);
+			dlmc_wait_free(w);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&dlmc_default_mtx);
+
+	return 0;
+}
+
+int
+lock_value_get(int lockid, void *buf)
+{
+	struct dlmc_reply rep;
+	int error;
+
+	if ((error = dlmc_call(DLMC_OP_VALUE_GET, NULL, 0, 0, lockid, NULL,
+	    &rep)) == 0)
+		memcpy(buf, rep.lvb, LKM_LVB_LEN);
+
+	return error;
+}
+
+int
+lock_value_set(int lockid, const void *buf)
+{
+	struct dlmc_reply rep;
+
+	return dlmc_call(DLMC_OP_VALUE_SET, NULL, 0, 0, lockid, buf, &rep);
+}
+
+/*
+ * Blocking callbacks are not delivered to clients, see client.c in dlmd.
+ */
+void
+lock_set_blocking_callback(lock_bast_t bast, void *arg)
+{
+}
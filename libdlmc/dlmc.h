@@ -0,0 +1,50 @@
+#ifndef _DLMC_H_
+#define _DLMC_H_
+
+#include <stdint.h>
+
+/*
+ * Client library of dlmd. lock.h functions talk to dlmd through its client
+ * socket (DLMD_SOCKET environment variable or /var/run/dlmd.sock) and wait
+ * for each reply.
+ *
+ * Pipelining interface below sends requests without waiting, reply is
+ * matched to request by id returned from *_send function. One connection
+ * must not be used by more threads at once. dlmc_lock_timeout_send gives
+ * up after msec milliseconds with ETIMEDOUT, dlmc_cancel_send withdraws
+ * pending lock request with given id, its reply then has ECANCELED.
+ *
+ * First lock_resource_async starts thread which reads replies of lock.h
+ * functions and calls callbacks, lock.h calls don't block each other then.
+ *
+ * dlmc_shm moves connection to shared memory rings, then request does not
+ * need syscall unless dlmd sleeps and reply is waited for by spinning
+ * first. At most DLMC_RING_SLOTS (256) requests can be outstanding, *_send
+ * returns ENOBUFS above it. lock.h functions use rings when dlmd allows.
+ */
+
+typedef struct dlmc dlmc_t;
+
+struct dlmc_reply {
+	uint32_t id;		/* id of request */
+	int op;			/* DLMC_OP_* */
+	int status;		/* errno value */
+	int lockid;
+	char lvb[32];		/* LKM_LVB_LEN, DLMC_OP_VALUE_GET only */
+};
+
+dlmc_t *dlmc_open(const char *);
+void dlmc_close(dlmc_t *);
+int dlmc_fd(dlmc_t *);
+int dlmc_shm(dlmc_t *);
+
+int dlmc_lock_send(dlmc_t *, const char *, int, int, int, uint32_t *);
+int dlmc_lock_timeout_send(dlmc_t *, const char *, int, int, int, uint32_t *);
+int dlmc_cancel_send(dlmc_t *, uint32_t, uint32_t *);
+int dlmc_unlock_send(dlmc_t *, int, uint32_t *);
+int dlmc_value_get_send(dlmc_t *, int, uint32_t *);
+int dlmc_value_set_send(dlmc_t *, int, const void *, uint32_t *);
+int dlmc_flush(dlmc_t *);
+int dlmc_reply(dlmc_t *, struct dlmc_reply *);
+
+#endif
@@ -2,6 +2,7 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/endian.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -16,7 +17,9 @@
 #include <prop/proplib.h>
 
 #include "dlmd.h"
+#include "lock.h"
 
+extern dlmd_conf_t conf;
 extern dlmd_node_t *local_node;
 
 struct dlmd_listn_conf {
@@ -29,86 +32,255 @@ struct dlmd_listn_conf {
  * This file will contain all routines used in listener thread.
  */
 
-#define MAX_BUF_SIZE 1024
+#define MAX_BUF_SIZE 1500	/* bundles are up to DLMD_BUNDLE_MAX long */
 
-static int listener_buf_parse(const char *, size_t);
+/* Achieved recvmmsg batch sizes */
+static uint64_t recv_calls;
+static uint64_t recv_msgs;
+static uint32_t recv_max;
+
+/*
+ * Worker threads apply received messages. Message is routed to worker by
+ * resource hash, so all messages for one resource are applied by one worker
+ * in order in which they were received and Lamport invariants hold. Every
+ * worker has its own queue of decoded messages.
+ */
+struct listener_worker {
+	dlmd_queue_t queue;
+	uint64_t handled;
+};
+
+static struct listener_worker *workers;
+static uint32_t nworkers;
+
+static int listener_dgram_parse(const char *, size_t);
+static int listener_recv(int, int);
+static int listener_msg_parse(const char *, size_t);
+static int listener_msg_dispatch(dlmd_msg_t *);
+static void listener_msg_queue(dlmd_msg_t *);
+static void * listener_worker_start(void *);
+static dlmd_node_t * listener_msg_node(dlmd_msg_t *);
 /* message parsing routines */
-static int listener_keepalive_msg(prop_dictionary_t);
-static int listener_request_msg(prop_dictionary_t);
-static int listener_reply_msg(prop_dictionary_t);
-static int listener_lock_msg(prop_dictionary_t);
-static int listener_unlock_msg(prop_dictionary_t);
+static int listener_keepalive_msg(dlmd_msg_t *);
+static int listener_request_msg(dlmd_msg_t *);
+static int listener_reply_msg(dlmd_msg_t *);
+static int listener_lock_msg(dlmd_msg_t *);
+static int listener_unlock_msg(dlmd_msg_t *);
+static int listener_convert_msg(dlmd_msg_t *);
+static int listener_master_request_msg(dlmd_msg_t *);
+static int listener_grant_msg(dlmd_msg_t *);
+static int listener_master_release_msg(dlmd_msg_t *);
+static int listener_token_request_msg(dlmd_msg_t *);
+static int listener_token_msg(dlmd_msg_t *);
 
 struct msg_function {
-	const char *cmd;
-	int  (*fn)(prop_dictionary_t);
+	uint32_t type;
+	int  (*fn)(dlmd_msg_t *);
 };
 
 struct msg_function msg_fn[] = {
-	{MSG_KEEPALIVE_TYPE, listener_keepalive_msg},
-	{MSG_LOCK_REQUEST_TYPE, listener_request_msg},
-	{MSG_LOCK_REPLY_TYPE, listener_reply_msg},
-	{MSG_LOCK_TYPE, listener_lock_msg},
-	{MSG_UNLOCK_TYPE, listener_unlock_msg},	
-	{NULL, NULL}
+	{DLMD_MSG_KEEPALIVE, listener_keepalive_msg},
+	{DLMD_MSG_REQUEST, listener_request_msg},
+	{DLMD_MSG_REPLY, listener_reply_msg},
+	{DLMD_MSG_LOCK, listener_lock_msg},
+	{DLMD_MSG_UNLOCK, listener_unlock_msg},
+	{DLMD_MSG_CONVERT, listener_convert_msg},
+	{DLMD_MSG_MASTER_REQUEST, listener_master_request_msg},
+	{DLMD_MSG_GRANT, listener_grant_msg},
+	{DLMD_MSG_MASTER_RELEASE, listener_master_release_msg},
+	{DLMD_MSG_TOKEN_REQUEST, listener_token_request_msg},
+	{DLMD_MSG_TOKEN, listener_token_msg},
+	{0, NULL}
 };
 
 
+/*
+ * Receive datagrams in batches of up to conf->batch_size with one
+ * recvmmsg call, it blocks only until the first datagram arrives.
+ */
 void *
 listener_start(void *arg)
 {
-	char buf[MAX_BUF_SIZE];
 	dlmd_conf_t *conf = (dlmd_conf_t *)arg;
-	struct dlmd_listn_conf listn;
+
+	while(1)
+		listener_recv(conf->socket, MSG_WAITFORONE);
 	
-	while(1) {
-		if((recvfrom(conf->socket, buf, MAX_BUF_SIZE, 0, (struct sockaddr *)&listn.listn_addr,
-			    &listn.listn_addr_len)) == -1)
-			DPRINTF(("recvfrom failed."));
-		
-		/*DPRINTF(("DLMD received packet from IP: %s, port %d\n", inet_ntoa(listn.listn_addr.sin_addr),
-			  ntohs(listn.listn_addr.sin_port)));*/
+	return NULL;
+}
+
+/*
+ * Event loop callback, socket is readable.
+ */
+void
+listener_event(int sock, void *arg)
+{
+	listener_recv(sock, MSG_DONTWAIT);
+}
+
+/*
+ * Receive one batch of datagrams and parse them.
+ */
+static int
+listener_recv(int sock, int flags)
+{
+	static char buf[DLMD_BATCH_MAX][MAX_BUF_SIZE];
+	struct dlmd_listn_conf listn[DLMD_BATCH_MAX];
+	struct mmsghdr msgs[DLMD_BATCH_MAX];
+	struct iovec iov[DLMD_BATCH_MAX];
+	ssize_t len;
+	uint32_t i, n;
+	int r;
+	
+	for (i = 0; i < conf.batch_size; i++) {
+		/* Keep space for extra NUL needed by plist parser */
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = MAX_BUF_SIZE - 1;
+
+		memset(&msgs[i], 0, sizeof(struct mmsghdr));
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &listn[i].listn_addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(listn[i].listn_addr);
+	}
+
+	if ((r = recvmmsg(sock, msgs, conf.batch_size, flags, NULL)) == -1) {
+		if (errno != EAGAIN)
+			DPRINTF(("recvmmsg failed."));
+		return -1;
+	}
+
+	n = r;
+
+	recv_calls++;
+	recv_msgs += n;
+	if (n > recv_max)
+		recv_max = n;
+
+	for (i = 0; i < n; i++) {
+		len = msgs[i].msg_len;
 
 		/* Extra insurance. */
-		buf[MAX_BUF_SIZE - 1] = '\0';
-			
-		listener_buf_parse(buf, MAX_BUF_SIZE);
+		buf[i][len] = '\0';
+		
+		listener_buf_parse(buf[i], len);
+	}
+
+	return n;
+}
 
-		memset(buf, '\0', MAX_BUF_SIZE); 
+/*
+ * Print achieved receive batch sizes.
+ */
+void
+listener_stats()
+{
+	uint32_t i;
+	char name[16];
+
+	printf("Received %"PRIu64" datagrams in %"PRIu64" recvmmsg calls, "
+	    "max batch %u\n", recv_msgs, recv_calls, recv_max);
+
+	for (i = 0; i < nworkers; i++) {
+		snprintf(name, sizeof(name), "worker%u", i);
+		dlmd_queue_stats(&workers[i].queue, name);
+		printf("Worker %u handled %"PRIu64" messages\n", i,
+		    workers[i].handled);
 	}
-	
-	return NULL;
 }
 
-static int
+/*
+ * Parse received datagram or stream frame, reliable datagram is passed to
+ * dlmd_rel_input which calls me back with its data in order.
+ */
+int
 listener_buf_parse(const char *buf, size_t buf_len)
 {
-	prop_dictionary_t dict;
-	const char *msg_type, *name;
-	int r, i;
-	size_t len, slen;
-	
-	r = -1;
-	
-	if ((dict = prop_dictionary_internalize(buf)) == NULL)
+	if (buf_len > 0 && (uint8_t)buf[0] == DLMD_WIRE_REL_MAGIC)
+		return dlmd_rel_input(buf, buf_len, listener_dgram_parse);
+
+	return listener_dgram_parse(buf, buf_len);
+}
+
+/*
+ * Parse datagram data, bundle is split to messages here.
+ */
+static int
+listener_dgram_parse(const char *buf, size_t buf_len)
+{
+	const uint8_t *p;
+	uint32_t cnt, i;
+	size_t len, off;
+
+	p = (const uint8_t *)buf;
+
+	if (buf_len < DLMD_WIRE_BUNDLE_HDR_LEN || p[0] != DLMD_WIRE_BUNDLE_MAGIC)
+		return listener_msg_parse(buf, buf_len);
+
+	if (p[1] < DLMD_WIRE_BUNDLE_VERSION || p[1] > DLMD_WIRE_VERSION)
 		return -1;
 
-	prop_dictionary_get_cstring_nocopy(dict, MSG_TYPE, &msg_type);
-	prop_dictionary_get_cstring_nocopy(dict, MSG_NODE_NAME, &name);
+	cnt = be16dec(p + 2);
+	off = DLMD_WIRE_BUNDLE_HDR_LEN;
+
+	for (i = 0; i < cnt && off + 2 <= buf_len; i++) {
+		len = be16dec(p + off);
+		off += 2;
+
+		if (off + len > buf_len)
+			return -1;
+
+		listener_msg_parse(buf + off, len);
+		off += len;
+	}
 
-	DPRINTF(("Received %s message from %s node.\n", msg_type, name));
-	DPRINTF	(("Message is %s\n", buf));
+	return 0;
+}
 
-	len = strlen(msg_type);
+static int
+listener_msg_parse(const char *buf, size_t buf_len)
+{
+	dlmd_msg_t msg;
+	int r;
 	
-	for(i = 0; msg_fn[i].cmd != NULL; i++){
-		slen = strlen(msg_fn[i].cmd);
+	if (dlmd_msg_parse(buf, buf_len, &msg) != 0)
+		return -1;
+
+	r = 0;
+
+	/* Multicast loops my own broadcasts back to me */
+	if (msg.node_name[0] != '\0' ?
+	    strcmp(msg.node_name, local_node->node_name) == 0 :
+	    msg.node_id == local_node->node_address.sin_addr.s_addr) {
+		dlmd_msg_fini(&msg);
+		return 0;
+	}
+
+	DPRINTF(("Received %d message from %s node.\n", msg.type, msg.node_name));
+
+	if (nworkers > 1)
+		listener_msg_queue(&msg);
+	else
+		r = listener_msg_dispatch(&msg);
+
+	dlmd_msg_fini(&msg);
+
+	return r;
+}
+
+/*
+ * Apply message with its handler.
+ */
+static int
+listener_msg_dispatch(dlmd_msg_t *msg)
+{
+	int r, i;
 
-		if (len != slen)
-			continue;
+	r = -1;
 
-		if ((strncmp(msg_type, msg_fn[i].cmd, slen)) == 0) {
-			r = msg_fn[i].fn(dict);
+	for(i = 0; msg_fn[i].fn != NULL; i++){
+		if (msg->type == msg_fn[i].type) {
+			r = msg_fn[i].fn(msg);
 			break;
 		}
 	}
@@ -116,16 +288,97 @@ listener_buf_parse(const char *buf, size_t buf_len)
 	return r;
 }
 
-static int
-listener_keepalive_msg(prop_dictionary_t dict)
+/*
+ * Queue message to worker which owns its resource. Stream and multicast
+ * threads queue messages too.
+ */
+static void
+listener_msg_queue(dlmd_msg_t *msg)
+{
+	struct listener_worker *w;
+
+	w = &workers[dlmd_lock_hash(msg->resource) % nworkers];
+
+	dlmd_queue_put(&w->queue, NULL, msg);
+}
+
+/*
+ * Worker thread, it is the only consumer of its queue.
+ */
+static void *
+listener_worker_start(void *arg)
+{
+	struct listener_worker *w = arg;
+	dlmd_msg_t *msg;
+
+	while (1) {
+		dlmd_queue_wait(&w->queue);
+
+		while ((msg = dlmd_queue_peek(&w->queue, NULL)) != NULL) {
+			listener_msg_dispatch(msg);
+			dlmd_queue_release(&w->queue);
+			w->handled++;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Start conf->listener_threads workers, with one thread messages are
+ * applied by receiving thread itself.
+ */
+void
+listener_init(dlmd_conf_t *conf)
+{
+	pthread_t thread;
+	uint32_t i;
+
+	if (conf->listener_threads <= 1)
+		return;
+
+	if ((workers = calloc(conf->listener_threads,
+	    sizeof(struct listener_worker))) == NULL)
+		err(EXIT_FAILURE, "Allocating listener workers failed");
+
+	for (i = 0; i < conf->listener_threads; i++) {
+		dlmd_queue_init(&workers[i].queue, DLMD_WORKER_QUEUE_LEN);
+
+		pthread_create(&thread, NULL, &listener_worker_start, &workers[i]);
+		pthread_detach(thread);
+	}
+
+	nworkers = conf->listener_threads;
+}
+
+/*
+ * Find message sender, plist messages carry node name binary ones only
+ * node id. Every binary message also tells me that node talks binary.
+ */
+static dlmd_node_t *
+listener_msg_node(dlmd_msg_t *msg)
 {
 	dlmd_node_t *node;
-	const char *name;
 
-	prop_dictionary_get_cstring_nocopy(dict, MSG_NODE_NAME, &name);
+	if (msg->node_name[0] != '\0')
+		node = dlmd_node_find(0, msg->node_name);
+	else
+		node = dlmd_node_find(ntohl(msg->node_id), NULL);
+
+	if (node != NULL && msg->node_name[0] == '\0' &&
+	    node->wire_version < msg->wire)
+		node->wire_version = msg->wire;
+
+	return node;
+}
+
+static int
+listener_keepalive_msg(dlmd_msg_t *msg)
+{
+	dlmd_node_t *node;
 
 	/* Get locked node */
-	if ((node = dlmd_node_find(0, name)) == NULL)
+	if ((node = listener_msg_node(msg)) == NULL)
 	    return -1;
 
 /*	DPRINTF(("GET node %s setting alive_flag = %d\n", name, node->alive_flag));
@@ -140,59 +393,71 @@ listener_keepalive_msg(prop_dictionary_t dict)
 	/* Set alive flag to default value */
 	node->alive_flag = MAX_ALIVE_CHECKS;
 
+	/* Old nodes doesn't send MSG_WIRE and understand plist only */
+	node->wire_version = msg->wire;
+
 	dlmd_node_unbusy(node);
 	
 	return 0;
 }
 
 static int
-listener_request_msg(prop_dictionary_t dict)
+listener_request_msg(dlmd_msg_t *msg)
 {
 	dlmd_node_t *node;
 	dlmd_lock_t *lock;
-	const char *name, *resource;
+	dlmd_msg_t reply;
 	uint64_t event;
-	uint32_t mode;
-	uint32_t id;
-	char *buf;
-	
-	prop_dictionary_get_cstring_nocopy(dict, MSG_NODE_NAME, &name);
-	prop_dictionary_get_cstring_nocopy(dict, MSG_RESOURCE, &resource);
-
-	prop_dictionary_get_uint64(dict, MSG_EVENT, &event);
-	prop_dictionary_get_uint32(dict, MSG_LOCK_TYPE, &mode);
-	prop_dictionary_get_uint32(dict, MSG_ID, &id);
+	int r;
 			
 	/* Get locked node */
-	if ((node = dlmd_node_find(0, name)) == NULL)
+	if ((node = listener_msg_node(msg)) == NULL)
 	    return -1;
+
+	if (!dlmd_lock_mode_valid(msg->mode))
+		return -1;
 	
-	DPRINTF(("Get locking request message lock %s - %d - %s\n", resource, mode, node->node_name));
-	DUMP_DICT(dict, buf);
-	
-	lock = dlmd_lock_add(resource, mode, event, id, DLMD_LOCK_REMOTE);
+	DPRINTF(("Get locking request message lock %s - %d - %s\n", msg->resource, msg->mode, node->node_name));
 
 	/* compare received Lamport logical timestamp with local one,
 	   if received is > then I have to swap them. I also have to
 	   increment event_counter before return. */
-	event = dlmd_event_cnt_cas(event);
-
-	/* Insert node into the lock node queue */
-	SLIST_INSERT_HEAD(&lock->nodes, node, lock_next);
-
-	/* insert lock into the queue */
-	lock = dlmd_lock_insert_request(lock);
+	event = dlmd_event_cnt_cas(msg->event);
+
+	dlmd_msg_init(&reply, DLMD_MSG_REPLY, msg->resource);
+	reply.event = event;
+	reply.ref = msg->event;
+	reply.mode = msg->mode;
+
+	if (conf.engine == DLMD_ENGINE_RICART) {
+		/* Ricart engine doesn't queue remote requests, it only delays reply */
+		r = dlmd_lock_defer(msg->resource, node, msg->event,
+		    node->node_address.sin_addr.s_addr, msg->mode, msg->flags);
+		if (r == EINPROGRESS) {
+			dlmd_msg_fini(&reply);
+			return 0;
+		}
+		if (r == EAGAIN)
+			reply.flags = DLMD_MSG_F_DENIED;
+	} else {
+		lock = dlmd_lock_add(msg->resource, msg->mode, msg->event,
+		    node->node_address.sin_addr.s_addr, DLMD_LOCK_REMOTE);
+		lock->node = node;
+		lock->flags = msg->flags & LKM_VALBLK;
+
+		/* insert lock into the queue */
+		dlmd_lock_insert_request(lock);
+	}
 
-	buf = reply_msg_init(local_node->node_name, resource, event, lock->flags);
-	//printf("%s \n", buf);
+	/* Requester will get the newest value block from all replies */
+	if ((msg->flags & LKM_VALBLK) &&
+	    dlmd_lock_lvb_read(msg->resource, reply.lvb, &reply.lvb_seq) == 0)
+		reply.flags |= DLMD_MSG_F_LVB;
 	
-	DPRINTF(("Sending reply message to node %s for resource %s with timestamp %"PRIu64"\n", name, resource, event));
+	DPRINTF(("Sending reply message to node %s for resource %s with timestamp %"PRIu64"\n", node->node_name, msg->resource, event));
 	/* Send reply message back to requester */
-	/* XXX I can't sent reply back if I have request in my queue
-	   for the same resource before this entry */
-	dlmd_node_unicast_msg(node, buf, strlen(buf));
-
-	free(buf);
+	dlmd_msg_unicast(node, &reply);
+	dlmd_msg_fini(&reply);
 	
 	return 0;
 }
@@ -201,66 +466,192 @@ listener_request_msg(prop_dictionary_t dict)
  * Listen for a reply message.
  */
 static int
-listener_reply_msg(prop_dictionary_t dict)
+listener_reply_msg(dlmd_msg_t *msg)
 {
-	dlmd_lock_t *lock;
-	const char *name, *resource;
-	uint64_t event;
-	uint32_t flags, type;
-
-	prop_dictionary_get_cstring_nocopy(dict, MSG_NODE_NAME, &name);
-	prop_dictionary_get_cstring_nocopy(dict, MSG_RESOURCE, &resource);
-	prop_dictionary_get_uint64(dict, MSG_EVENT, &event);
-	prop_dictionary_get_uint32(dict, MSG_LOCK_TYPE, &flags);
-
-	type = DLMD_LOCK_LOCAL;
+	DPRINTF(("Get reply message from %s for %s timestamp %"PRIu64"\n", msg->node_name, msg->resource, msg->event));
 
-	DPRINTF(("Get reply message from %s for %s timestamp %"PRIu64"\n", name, resource, event));
+	/* Reply carries senders clock, merge it with mine */
+	dlmd_event_cnt_cas(msg->event);
 
-	/* Do I need to change event_counter after receiving reply msg ?*/
-	dlmd_event_cnt_inc();
+	if (msg->flags & DLMD_MSG_F_LVB)
+		dlmd_lock_lvb_update(msg->resource, msg->lvb, msg->lvb_seq);
 
-	/* XXX LKM_CRMODE == 2 */
-	if (flags == 2)
-		type |= DLMD_LOCK_CR;
-	
-	if ((lock = dlmd_lock_find(resource, 0, type)) != NULL)
-		dlmd_lock_signal(lock);
-	else 
-		assert("Received reply message for non existing lock\n");
+	if (dlmd_lock_reply(msg->resource, msg->ref,
+	    (msg->flags & DLMD_MSG_F_DENIED) ? EAGAIN : 0) != 0)
+		DPRINTF(("Received reply message for non existing lock %s\n", msg->resource));
 	
 	return 0;
 }
 
 static int
-listener_lock_msg(prop_dictionary_t dict)
+listener_lock_msg(dlmd_msg_t *msg)
 {
 	return 0;
 }
 
 static int
-listener_unlock_msg(prop_dictionary_t dict)
+listener_unlock_msg(dlmd_msg_t *msg)
 {
-	dlmd_lock_t *lock;
 	dlmd_node_t *node;
-	const char *name, *resource;
-	uint64_t event;
-
-	prop_dictionary_get_cstring_nocopy(dict, MSG_NODE_NAME, &name);
-	prop_dictionary_get_cstring_nocopy(dict, MSG_RESOURCE, &resource);
-	prop_dictionary_get_uint64(dict, MSG_EVENT, &event);
 
 	/* Get locked node */
-	if ((node = dlmd_node_find(0, name)) == NULL)
+	if ((node = listener_msg_node(msg)) == NULL)
 	    return -1;
 
-	DPRINTF(("Get unlock message from %s for %s timestamp %"PRIu64"\n", name, resource, event));
+	DPRINTF(("Get unlock message from %s for %s timestamp %"PRIu64"\n", node->node_name, msg->resource, msg->event));
 	
-	/* Do I need to change event_counter after receiving reply msg ?*/
-	dlmd_event_cnt_inc();
+	dlmd_event_cnt_cas(msg->event);
+
+	/* Store value block before next holder can be granted */
+	if (msg->flags & DLMD_MSG_F_LVB)
+		dlmd_lock_lvb_update(msg->resource, msg->lvb, msg->lvb_seq);
 	
-	if ((lock = dlmd_lock_find(resource, 0, DLMD_LOCK_REMOTE)) != NULL)
-		dlmd_lock_release(lock->lock_id, DLMD_LOCK_REMOTE, node);
+	dlmd_lock_release_ref(msg->resource, node->node_address.sin_addr.s_addr,
+	    msg->ref);
 		
 	return 0;
 }
+
+/*
+ * Conversion of remote lock, upgrades are acknowledged with reply message
+ * like new requests.
+ */
+static int
+listener_convert_msg(dlmd_msg_t *msg)
+{
+	dlmd_node_t *node;
+	dlmd_msg_t reply;
+	uint64_t event;
+
+	if ((node = listener_msg_node(msg)) == NULL)
+	    return -1;
+
+	if (!dlmd_lock_mode_valid(msg->mode))
+		return -1;
+
+	DPRINTF(("Get convert message from %s for %s to mode %d\n", node->node_name, msg->resource, msg->mode));
+
+	event = dlmd_event_cnt_cas(msg->event);
+
+	if (dlmd_lock_convert_ref(msg->resource, node->node_address.sin_addr.s_addr,
+	    msg->ref, msg->mode, msg->event) == 0)
+		return 0;
+
+	dlmd_msg_init(&reply, DLMD_MSG_REPLY, msg->resource);
+	reply.event = event;
+	reply.ref = msg->ref;
+	reply.mode = msg->mode;
+
+	dlmd_msg_unicast(node, &reply);
+	dlmd_msg_fini(&reply);
+
+	return 0;
+}
+
+/*
+ * Request for resource I'm master of. Requests are ordered by my clock, so
+ * master grants them in order of arrival.
+ */
+static int
+listener_master_request_msg(dlmd_msg_t *msg)
+{
+	dlmd_node_t *node;
+	dlmd_lock_t *lock;
+	dlmd_msg_t reply;
+
+	if ((node = listener_msg_node(msg)) == NULL)
+	    return -1;
+
+	if (!dlmd_lock_mode_valid(msg->mode))
+		return -1;
+
+	DPRINTF(("Get master request from %s for %s mode %d\n", node->node_name, msg->resource, msg->mode));
+
+	dlmd_event_cnt_cas(msg->event);
+
+	/* Non blocking request is refused without queueing */
+	if ((msg->flags & LKM_NOQUEUE) &&
+	    dlmd_lock_probe(msg->resource, msg->mode) != 0) {
+		dlmd_msg_init(&reply, DLMD_MSG_GRANT, msg->resource);
+		reply.event = dlmd_event_cnt_inc();
+		reply.ref = msg->ref;
+		reply.mode = msg->mode;
+		reply.flags = DLMD_MSG_F_DENIED;
+
+		dlmd_msg_unicast(node, &reply);
+		dlmd_msg_fini(&reply);
+		return 0;
+	}
+
+	lock = dlmd_lock_add(msg->resource, msg->mode, dlmd_event_cnt_inc(),
+	    node->node_address.sin_addr.s_addr, DLMD_LOCK_REMOTE);
+	lock->node = node;
+	lock->ref = msg->ref;
+
+	/* Grant is sent from lock table when lock is granted */
+	dlmd_lock_insert_request(lock);
+
+	return 0;
+}
+
+/*
+ * Master has granted my request.
+ */
+static int
+listener_grant_msg(dlmd_msg_t *msg)
+{
+	DPRINTF(("Get grant message from %s for %s\n", msg->node_name, msg->resource));
+
+	dlmd_event_cnt_cas(msg->event);
+
+	if (dlmd_lock_granted(msg->ref,
+	    (msg->flags & DLMD_MSG_F_DENIED) ? EAGAIN : 0) != 0)
+		DPRINTF(("Received grant message for non existing lock %s\n", msg->resource));
+
+	return 0;
+}
+
+/*
+ * Requester has released lock I'm master of.
+ */
+static int
+listener_master_release_msg(dlmd_msg_t *msg)
+{
+	dlmd_node_t *node;
+
+	if ((node = listener_msg_node(msg)) == NULL)
+	    return -1;
+
+	DPRINTF(("Get master release from %s for %s\n", node->node_name, msg->resource));
+
+	dlmd_event_cnt_cas(msg->event);
+
+	dlmd_lock_release_ref(msg->resource, node->node_address.sin_addr.s_addr,
+	    msg->ref);
+
+	return 0;
+}
+
+/*
+ * Somebody wants token, ref carries id of requesting node because request
+ * can be forwarded by other nodes.
+ */
+static int
+listener_token_request_msg(dlmd_msg_t *msg)
+{
+	DPRINTF(("Get token request for %s from %s\n", msg->resource, msg->node_name));
+
+	dlmd_event_cnt_cas(msg->event);
+
+	return dlmd_lock_token_request(msg->resource, (uint32_t)msg->ref);
+}
+
+static int
+listener_token_msg(dlmd_msg_t *msg)
+{
+	DPRINTF(("Get token for %s from %s\n", msg->resource, msg->node_name));
+
+	dlmd_event_cnt_cas(msg->event);
+
+	return dlmd_lock_token_grant(msg);
+}
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <prop/proplib.h>
@@ -18,27 +19,88 @@
 #include "dlmd.h"
 #include "lock.h"
 
+static int lock_resource_wait(const char *, int, int, const struct timespec *,
+    int *);
+
 /*
  * Lock resource with name and request lock with mode. This function locks
  * a named (NUL-terminated) resource and returns thelockid if successful.
  */
 int lock_resource(const char *resource, int mode, int flags, int *lockid)
+{
+	return lock_resource_wait(resource, mode, flags, NULL, lockid);
+}
+
+/* Lock resource, give up at absolute deadline */
+int
+lock_resource_deadline(const char *resource, int mode, int flags,
+    const struct timespec *deadline, int *lockid)
+{
+	return lock_resource_wait(resource, mode, flags, deadline, lockid);
+}
+
+/* Lock resource, give up after msec milliseconds */
+int
+lock_resource_timeout(const char *resource, int mode, int flags, int msec,
+    int *lockid)
+{
+	struct timespec ts;
+
+	if (msec < 0)
+		return EINVAL;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += msec / 1000;
+	ts.tv_nsec += (msec % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	return lock_resource_wait(resource, mode, flags, &ts, lockid);
+}
+
+/*
+ * Common part of lock_resource calls, NULL deadline waits forever.
+ */
+static int
+lock_resource_wait(const char *resource, int mode, int flags,
+    const struct timespec *deadline, int *lockid)
 {
 	dlmd_lock_t *lock;
-	uint64_t event;
+	uint64_t event, lock_id;
 	uint32_t type;
 	
-	DPRINTF(("Locking %s resource with mode %d - event %"PRIu64"\n", resource, mode, event_counter));
+	DPRINTF(("Locking %s resource with mode %d - event %"PRIu64"\n", resource, mode, dlmd_event_cnt_get()));
+
+	if (!dlmd_lock_mode_valid(mode))
+		return EINVAL;
+
+	if (strlen(resource) >= dlmd_msg_name_max())
+		return ENAMETOOLONG;
+
+	/* Convert lock *lockid held by caller to new mode */
+	if (flags & LKM_CONVERT)
+		return dlmd_lock_convert(*lockid, mode);
+
+	/* Node still holds this lock from my last unlock */
+	if ((flags & LKM_CACHE) &&
+	    (lock_id = dlmd_lock_cache_get(resource, mode, flags)) != 0) {
+		*lockid = lock_id;
+		return 0;
+	}
+
+	/* Don't bother other nodes if I already know resource is busy */
+	if ((flags & LKM_NOQUEUE) && dlmd_lock_probe(resource, mode) != 0)
+		return EAGAIN;
 
 	/* increment event counter and return new value */
 	event = dlmd_event_cnt_inc();
 	type = DLMD_LOCK_LOCAL;
 
-	if (mode == LKM_CRMODE)
-		type |= DLMD_LOCK_CR;
-
 	/* get lock structure */
 	lock = dlmd_lock_add(resource, mode, event, 0, type);
+	lock->flags = flags;
 	
 	/* Insert lock into the queue */
 	lock = dlmd_lock_insert_request(lock);
@@ -48,7 +110,14 @@ int lock_resource(const char *resource, int mode, int flags, int *lockid)
 	
 	DPRINTF(("Waiting for a lock\n"));
 
-	dlmd_lock_wait(lock);
+	if (flags & LKM_NOQUEUE) {
+		if (dlmd_lock_trywait(lock) != 0)
+			return EAGAIN;
+	} else if (deadline != NULL) {
+		if (dlmd_lock_timedwait(lock, deadline) != 0)
+			return ETIMEDOUT;
+	} else
+		dlmd_lock_wait(lock);
 
 	DPRINTF(("Entering critical section !!\n"));
 	
@@ -59,6 +128,67 @@ int lock_resource(const char *resource, int mode, int flags, int *lockid)
 	return 0;
 }
 
+/*
+ * Queue lock request and return without waiting, completion is reported
+ * to ast, fd and lock_wait_any.
+ */
+int
+lock_resource_async(const char *resource, int mode, int flags, lock_ast_t ast,
+    void *arg, int fd, int *lockid)
+{
+	dlmd_lock_t *lock;
+	uint64_t event, lock_id;
+
+	DPRINTF(("Locking %s resource with mode %d asynchronously\n", resource, mode));
+
+	if (!dlmd_lock_mode_valid(mode))
+		return EINVAL;
+
+	if (strlen(resource) >= dlmd_msg_name_max())
+		return ENAMETOOLONG;
+
+	/* XXX These need waiting thread, use lock_resource for them */
+	if (flags & (LKM_CONVERT | LKM_NOQUEUE))
+		return EOPNOTSUPP;
+
+	if ((flags & LKM_CACHE) &&
+	    (lock_id = dlmd_lock_cache_get(resource, mode, flags)) != 0) {
+		*lockid = lock_id;
+		dlmd_lock_async_done(lock_id, 0, ast, arg, fd);
+		return 0;
+	}
+
+	event = dlmd_event_cnt_inc();
+
+	lock = dlmd_lock_add(resource, mode, event, 0, DLMD_LOCK_LOCAL);
+	lock->flags = flags;
+	lock->async = 1;
+	lock->ast = ast;
+	lock->ast_arg = arg;
+	lock->ast_fd = fd;
+
+	/* Completion can be reported before I get here */
+	*lockid = lock->lock_id;
+
+	dlmd_lock_insert_request(lock);
+
+	return 0;
+}
+
+/* Cancel async request which is not granted yet */
+int
+lock_cancel(int lockid)
+{
+	return dlmd_lock_cancel(lockid);
+}
+
+/* Wait for any of async requests */
+int
+lock_wait_any(const int *lockids, int n, int msec, int *index)
+{
+	return dlmd_lock_wait_any(lockids, n, msec, index);
+}
+
 /* Unlock resource with lockid */
 int 
 unlock_resource(int lockid)
@@ -66,8 +196,27 @@ unlock_resource(int lockid)
 	
 	DPRINTF(("Releasing lock %d\n", lockid));
 	
-	dlmd_lock_release(lockid, DLMD_LOCK_LOCAL, NULL);
-		
-	return 0;
+	return dlmd_lock_release(lockid);
+}
+
+
+/* Read lock value block of resource locked with LKM_VALBLK */
+int
+lock_value_get(int lockid, void *buf)
+{
+	return dlmd_lock_value_get(lockid, buf);
 }
 
+/* Write lock value block, it is passed to next holder with unlock */
+int
+lock_value_set(int lockid, const void *buf)
+{
+	return dlmd_lock_value_set(lockid, buf);
+}
+
+/* Register callback called when cached lock blocks other node */
+void
+lock_set_blocking_callback(lock_bast_t bast, void *arg)
+{
+	dlmd_lock_set_bast(bast, arg);
+}
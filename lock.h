@@ -4,7 +4,15 @@
 /* int lock_resource(const char *resource, int mode, int flags, int *lockid);*/
 
 /*
- * Lock modes
+ * Lock modes, compatibility of modes:
+ *
+ *        NL CR CW PR PW EX
+ *    NL   y  y  y  y  y  y
+ *    CR   y  y  y  y  y  n
+ *    CW   y  y  y  n  n  n
+ *    PR   y  y  n  y  n  n
+ *    PW   y  y  n  n  n  n
+ *    EX   y  n  n  n  n  n
  */ 
 #define LKM_NLMODE (1 << 0)
 #define LKM_CRMODE (1 << 1)
@@ -23,17 +31,99 @@
 #define LKM_VALBLK      0x100/* lock value block request */
 #define LKM_NOQUEUE     0x200/* non blocking request */
 #define LKM_CONVERT     0x400/* conversion request */
+#define LKM_CACHE       0x800/* keep lock cached after unlock */
 
 /* int lock_resource(const char *resource, int mode, int flags, int *lockid);*/
 /*
  * Lock resource with name and request lock with mode. This function locks
  * a named (NUL-terminated) resource and returns thelockid if successful.
+ * Returns EINVAL when mode is not exactly one of LKM_*MODE.
+ * Returns ENAMETOOLONG when name has 128 characters or more, with tcp
+ * transport 1024 or more.
+ *
+ * With LKM_CONVERT lock *lockid held by caller is converted to mode in
+ * place. Downgrade never blocks, upgrade waits for conflicting holders and
+ * fails with EDEADLK if it would deadlock with older conversion; lock keeps
+ * its old mode in that case.
+ *
+ * With LKM_NOQUEUE request is not queued, EAGAIN is returned when lock
+ * can't be granted immediately.
+ *
+ * With LKM_CACHE node keeps lock after unlock_resource until request of
+ * other node conflicts with it. Next lock_resource of same resource in
+ * weaker or same mode is then granted without any message. If cached lock
+ * is in use when conflicting request comes, blocking callback is called and
+ * lock is given away at its unlock.
+ *
+ * Resources listed in token_resources of conf.xml are in token mode. Only
+ * node which holds resource token grants locks, other nodes send request
+ * to probable token holder only. It is good for resources locked by all
+ * nodes all the time. All nodes have to list the same resources.
  */
 int lock_resource(const char *, int, int, int *);
 
+/*
+ * lock_resource which gives up at deadline (absolute CLOCK_REALTIME time,
+ * like pthread_cond_timedwait) or after msec milliseconds. Request is then
+ * removed from queues of all nodes with one unlock message and ETIMEDOUT is
+ * returned. Lock granted at the same moment is kept and 0 returned.
+ * Deadline does not apply to LKM_CONVERT and LKM_NOQUEUE requests.
+ */
+struct timespec;
+
+int lock_resource_deadline(const char *, int, int, const struct timespec *,
+    int *);
+int lock_resource_timeout(const char *, int, int, int, int *);
+
+/*
+ * Asynchronous lock_resource. Request is queued and its lockid returned
+ * right away. When lock is granted, callback ast is called with lockid,
+ * status and arg, 1 is added to 64 bit counter in descriptor fd (eventfd
+ * or pipe, -1 for none) and threads in lock_wait_any are woken up. Any of
+ * them can happen before lock_resource_async returns. Callback runs in
+ * dlmd thread and must not block. LKM_CONVERT and LKM_NOQUEUE requests
+ * are not supported, EOPNOTSUPP is returned.
+ */
+typedef void (*lock_ast_t)(int, int, void *);
+
+int lock_resource_async(const char *, int, int, lock_ast_t, void *, int, int *);
+
+/*
+ * Wait at most msec milliseconds (forever when negative) until any of n
+ * async requests in lockids is finished. Index of first finished request is
+ * stored to *index and its status returned, ENOENT for cancelled request
+ * and ETIMEDOUT when none finished.
+ */
+int lock_wait_any(const int *, int, int, int *);
+
+/*
+ * Cancel async request which is not granted yet. It is removed from queues
+ * of all nodes like timed out one and its completion is reported with
+ * ECANCELED. EBUSY is returned when lock is granted already, unlock it.
+ */
+int lock_cancel(int);
+
 /* Unlock resource with lockid */
 int unlock_resource(int);
 
-/* XXX Lock Value Block ?? */
+/*
+ * Lock Value Block. Small piece of data attached to resource, which is
+ * readable by holders of locks requested with LKM_VALBLK. PW and EX
+ * holders can write it, new value is sent to other nodes when lock is
+ * released and next holder reads it from memory.
+ */
+#define LKM_LVB_LEN 32
+
+int lock_value_get(int, void *);
+int lock_value_set(int, const void *);
+
+/*
+ * Blocking callback, called with resource, mode and lockid of LKM_CACHE
+ * lock held by caller which blocks request of other node. Holder should
+ * unlock it soon. Callback runs in dlmd thread and must not block.
+ */
+typedef void (*lock_bast_t)(const char *, int, int, void *);
+
+void lock_set_blocking_callback(lock_bast_t, void *);
 
 #endif
@@ -0,0 +1,170 @@
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <prop/proplib.h>
+
+#include "dlmd.h"
+
+/*
+ * IP multicast for cluster wide broadcasts. When conf.mcast_group is set,
+ * dlmd_node_broadcast_msg sends request, unlock and keepalive messages once
+ * to the group on my port instead of to every node, network sends copies.
+ * Replies and other messages for one node are still unicast.
+ *
+ * Every node joins group on interface with its local address. Several nodes
+ * on one host (127.0.0.x) share group port, so multicast loop has to be on
+ * and I get my own messages back, listener drops them. On some systems
+ * loopback interface needs multicast flag and route for the group.
+ *
+ * Multicast datagrams are not covered by reliable delivery and would not
+ * keep order with reliable unicast to the same node, so dlmd.c turns
+ * multicast off when reliable is set. Lost request or unlock on the group
+ * is lost for good, like any datagram without reliable delivery.
+ */
+
+static int mcast_socket = -1;
+static struct sockaddr_in mcast_addr;
+
+static uint64_t mcast_sent;
+static uint64_t mcast_recv;
+
+static int dlmd_mcast_recv(int, int);
+
+/*
+ * Create multicast receive socket and prepare local node socket for
+ * sending to group. Receive socket is returned.
+ */
+int
+dlmd_mcast_init(dlmd_conf_t *conf)
+{
+	struct ip_mreq mreq;
+	u_char loop, ttl;
+	int one;
+
+	memset(&mcast_addr, 0, sizeof(mcast_addr));
+	mcast_addr.sin_family = AF_INET;
+	mcast_addr.sin_addr = conf->mcast_group;
+	mcast_addr.sin_port = conf->address.sin_port;
+
+	if ((mcast_socket = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		err(EXIT_FAILURE, "Creating multicast socket failed");
+
+	/* Other nodes on this host listen on the same group and port */
+	one = 1;
+	setsockopt(mcast_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef SO_REUSEPORT
+	setsockopt(mcast_socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+#endif
+
+	if (bind(mcast_socket, (struct sockaddr *)&mcast_addr,
+	    sizeof(mcast_addr)) == -1)
+		err(EXIT_FAILURE, "Binding multicast group %s failed",
+		    inet_ntoa(conf->mcast_group));
+
+	mreq.imr_multiaddr = conf->mcast_group;
+	mreq.imr_interface = conf->address.sin_addr;
+
+	if (setsockopt(mcast_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+	    sizeof(mreq)) == -1)
+		err(EXIT_FAILURE, "Joining multicast group %s failed",
+		    inet_ntoa(conf->mcast_group));
+
+	/* Send from interface with my address, it is what others joined on */
+	if (setsockopt(local_node->node_socket, IPPROTO_IP, IP_MULTICAST_IF,
+	    &conf->address.sin_addr, sizeof(struct in_addr)) == -1)
+		err(EXIT_FAILURE, "Setting multicast interface failed");
+
+	loop = 1;
+	setsockopt(local_node->node_socket, IPPROTO_IP, IP_MULTICAST_LOOP,
+	    &loop, sizeof(loop));
+
+	ttl = conf->mcast_ttl;
+	setsockopt(local_node->node_socket, IPPROTO_IP, IP_MULTICAST_TTL,
+	    &ttl, sizeof(ttl));
+
+	return mcast_socket;
+}
+
+/*
+ * Send datagram to multicast group.
+ */
+int
+dlmd_mcast_send(const char *buf, size_t buf_len)
+{
+	if (sendto(local_node->node_socket, buf, buf_len, 0,
+	    (struct sockaddr *)&mcast_addr, sizeof(mcast_addr)) == -1)
+		return errno;
+
+	atomic_inc_64(&mcast_sent);
+
+	return 0;
+}
+
+/*
+ * Multicast listener thread.
+ */
+void *
+dlmd_mcast_listener_start(void *arg)
+{
+	while (1)
+		dlmd_mcast_recv(mcast_socket, 0);
+
+	return NULL;
+}
+
+/*
+ * Event loop callback, multicast socket is readable.
+ */
+void
+dlmd_mcast_event(int sock, void *arg)
+{
+	dlmd_mcast_recv(sock, MSG_DONTWAIT);
+}
+
+/*
+ * Receive one datagram sent to group.
+ */
+static int
+dlmd_mcast_recv(int sock, int flags)
+{
+	static char buf[DLMD_MCAST_BUF_SIZE];
+	ssize_t len;
+
+	/* Keep space for extra NUL needed by plist parser */
+	if ((len = recv(sock, buf, sizeof(buf) - 1, flags)) == -1) {
+		if (errno != EAGAIN)
+			DPRINTF(("multicast recv failed."));
+		return -1;
+	}
+
+	buf[len] = '\0';
+
+	mcast_recv++;
+
+	return listener_buf_parse(buf, len);
+}
+
+/*
+ * Print multicast counters.
+ */
+void
+dlmd_mcast_stats()
+{
+	if (mcast_socket == -1)
+		return;
+
+	printf("Multicast sent %"PRIu64" datagrams, received %"PRIu64
+	    " datagrams\n", mcast_sent, mcast_recv);
+}
@@ -1,6 +1,7 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/endian.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -16,90 +17,498 @@
 
 #include "dlmd.h"
 
+extern dlmd_conf_t conf;
+extern dlmd_node_t *local_node;
+
+/*
+ * Message type code to plist message type string translation.
+ */
+struct msg_type {
+	uint32_t type;
+	const char *name;
+};
+
+static const struct msg_type msg_types[] = {
+	{DLMD_MSG_KEEPALIVE, MSG_KEEPALIVE_TYPE},
+	{DLMD_MSG_REQUEST, MSG_LOCK_REQUEST_TYPE},
+	{DLMD_MSG_REPLY, MSG_LOCK_REPLY_TYPE},
+	{DLMD_MSG_UNLOCK, MSG_UNLOCK_TYPE},
+	{DLMD_MSG_CONVERT, MSG_CONVERT_TYPE},
+	{DLMD_MSG_MASTER_REQUEST, MSG_MASTER_REQUEST_TYPE},
+	{DLMD_MSG_GRANT, MSG_GRANT_TYPE},
+	{DLMD_MSG_MASTER_RELEASE, MSG_MASTER_RELEASE_TYPE},
+	{DLMD_MSG_TOKEN_REQUEST, MSG_TOKEN_REQUEST_TYPE},
+	{DLMD_MSG_TOKEN, MSG_TOKEN_TYPE},
+	{0, NULL}
+};
+
+/* Messages waiting for sender thread */
+static dlmd_queue_t send_queue;
+static int sender_running;
+
+static int dlmd_msg_use_binary(uint32_t);
+static void dlmd_msg_clear(dlmd_msg_t *);
+static void dlmd_msg_set_resource(dlmd_msg_t *, const char *, size_t);
+
 /*
- * Initialize keepalive message buffer.
+ * Initialize keepalive message buffer. Keepalive is always sent as plist,
+ * so nodes which doesn't know binary format can still parse it. MSG_WIRE
+ * advertises binary wire version to other nodes.
  */
 char *
 keepalive_msg_init(const char *name)
 {
-	prop_dictionary_t dict;
-	char *buf;
-	
-	dict = prop_dictionary_create();
+	dlmd_msg_t msg;
 
-	prop_dictionary_set_cstring(dict, MSG_NODE_NAME, name);
+	dlmd_msg_clear(&msg);
 
-	prop_dictionary_set_cstring(dict, MSG_TYPE, MSG_KEEPALIVE_TYPE);
+	msg.type = DLMD_MSG_KEEPALIVE;
+	msg.wire = DLMD_WIRE_VERSION;
+	strlcpy(msg.node_name, name, DLMD_NODE_NAME_LEN);
 
-	buf = prop_dictionary_externalize(dict);
+	return dlmd_msg_externalize(&msg);
+}
 
-	prop_object_release(dict);
+/*
+ * Preset message with type and resource, sender is always local node.
+ */
+void
+dlmd_msg_init(dlmd_msg_t *msg, uint32_t type, const char *resource)
+{
+	dlmd_msg_clear(msg);
 
-	return buf;
+	msg->type = type;
+	msg->node_id = local_node->node_address.sin_addr.s_addr;
+	msg->wire = DLMD_WIRE_VERSION;
+	strlcpy(msg->node_name, local_node->node_name, DLMD_NODE_NAME_LEN);
+
+	if (resource != NULL)
+		dlmd_msg_set_resource(msg, resource,
+		    strnlen(resource, MAX_NAME_LEN - 1));
 }
 
-char *
-request_msg_init(const char *name, const char *resource, uint64_t event,
-    uint32_t flag, uint32_t ip) {
-	prop_dictionary_t dict;
-	char *buf;
-	
-	dict = prop_dictionary_create();
+/*
+ * Copy message, long resource name is copied too.
+ */
+void
+dlmd_msg_copy(dlmd_msg_t *dst, const dlmd_msg_t *src)
+{
+	*dst = *src;
 
-	prop_dictionary_set_cstring(dict, MSG_NODE_NAME, name);
+	dlmd_msg_set_resource(dst, src->resource, strlen(src->resource));
+}
 
-	prop_dictionary_set_cstring(dict, MSG_TYPE, MSG_LOCK_REQUEST_TYPE);
-	prop_dictionary_set_cstring(dict, MSG_RESOURCE, resource);
-	prop_dictionary_set_uint64(dict, MSG_EVENT, event);
-	prop_dictionary_set_uint32(dict, MSG_LOCK_FLAG, flag);
-	prop_dictionary_set_uint32(dict, MSG_ID, ip);
-	
-	buf = prop_dictionary_externalize(dict);
-	prop_object_release(dict);
+/*
+ * Free long resource name of message.
+ */
+void
+dlmd_msg_fini(dlmd_msg_t *msg)
+{
+	if (msg->resource != msg->resource_buf)
+		free(msg->resource);
 
-	return buf;
+	msg->resource = msg->resource_buf;
+	msg->resource_buf[0] = '\0';
 }
 
-char *
-reply_msg_init(const char *name, const char *resource, uint64_t event, uint32_t flag)
+/*
+ * Zero message, resource is empty name in place.
+ */
+static void
+dlmd_msg_clear(dlmd_msg_t *msg)
+{
+	memset(msg, 0, sizeof(dlmd_msg_t));
+
+	msg->resource = msg->resource_buf;
+}
+
+/*
+ * Set resource name of len characters. Most names fit to message, only
+ * long names of stream transport are allocated.
+ */
+static void
+dlmd_msg_set_resource(dlmd_msg_t *msg, const char *name, size_t len)
+{
+	if (len < sizeof(msg->resource_buf))
+		msg->resource = msg->resource_buf;
+	else if ((msg->resource = malloc(len + 1)) == NULL)
+		err(EXIT_FAILURE, "Allocation of resource name failed\n");
+
+	memcpy(msg->resource, name, len);
+	msg->resource[len] = '\0';
+}
+
+/*
+ * Encode message to binary wire format. Nothing is allocated, caller has to
+ * supply buffer at least DLMD_WIRE_MAX_LEN long. Returns encoded length or
+ * -1 if message doesn't fit to buffer.
+ */
+ssize_t
+dlmd_msg_encode(const dlmd_msg_t *msg, char *buf, size_t buf_len)
+{
+	uint8_t *p;
+	size_t nlen;
+	uint32_t i;
+
+	nlen = strnlen(msg->resource, MAX_NAME_LEN);
+
+	if (buf_len < DLMD_WIRE_HDR_LEN + nlen + 
+	    ((msg->flags & DLMD_MSG_F_LVB) ? DLMD_WIRE_LVB_LEN : 0) +
+	    ((msg->flags & DLMD_MSG_F_QUEUE) ? DLMD_WIRE_QUEUE_LEN(msg->queue_len) : 0))
+		return -1;
+
+	p = (uint8_t *)buf;
+
+	p[0] = DLMD_WIRE_MAGIC;
+	p[1] = DLMD_WIRE_MSG_VERSION;
+	p[2] = msg->type;
+	p[3] = msg->mode;
+	be32enc(p + 4, ntohl(msg->node_id));
+	be64enc(p + 8, msg->event);
+	be64enc(p + 16, msg->ref);
+	be16enc(p + 24, msg->flags);
+	be16enc(p + 26, nlen);
+
+	memcpy(p + DLMD_WIRE_HDR_LEN, msg->resource, nlen);
+	p += DLMD_WIRE_HDR_LEN + nlen;
+
+	if (msg->flags & DLMD_MSG_F_LVB) {
+		be64enc(p, msg->lvb_seq);
+		memcpy(p + 8, msg->lvb, DLMD_LVB_LEN);
+		p += DLMD_WIRE_LVB_LEN;
+	}
+
+	if (msg->flags & DLMD_MSG_F_QUEUE) {
+		be16enc(p, msg->queue_len);
+		for (i = 0; i < msg->queue_len; i++)
+			be32enc(p + 2 + 4 * i, ntohl(msg->queue[i]));
+		p += DLMD_WIRE_QUEUE_LEN(msg->queue_len);
+	}
+
+	return p - (uint8_t *)buf;
+}
+
+/*
+ * Decode binary wire message to msg. Returns 0 on success, EINVAL for
+ * malformed message and EPROTONOSUPPORT for unknown wire version. Failed
+ * message doesn't have to be finished.
+ */
+int
+dlmd_msg_decode(const char *buf, size_t buf_len, dlmd_msg_t *msg)
+{
+	const uint8_t *p;
+	size_t nlen, len;
+	uint32_t i;
+
+	p = (const uint8_t *)buf;
+
+	/* Fields not on wire must not keep caller's garbage */
+	dlmd_msg_clear(msg);
+
+	if (buf_len < DLMD_WIRE_HDR_LEN || p[0] != DLMD_WIRE_MAGIC)
+		return EINVAL;
+
+	if (p[1] < DLMD_WIRE_MSG_VERSION || p[1] > DLMD_WIRE_VERSION)
+		return EPROTONOSUPPORT;
+
+	nlen = be16dec(p + 26);
+	if (nlen >= MAX_NAME_LEN || DLMD_WIRE_HDR_LEN + nlen > buf_len)
+		return EINVAL;
+
+	msg->type = p[2];
+	msg->mode = p[3];
+	msg->wire = p[1];
+	msg->node_id = htonl(be32dec(p + 4));
+	msg->event = be64dec(p + 8);
+	msg->ref = be64dec(p + 16);
+	msg->flags = be16dec(p + 24);
+
+	p += DLMD_WIRE_HDR_LEN + nlen;
+
+	len = DLMD_WIRE_HDR_LEN + nlen;
+
+	if (msg->flags & DLMD_MSG_F_LVB) {
+		if (len + DLMD_WIRE_LVB_LEN > buf_len)
+			return EINVAL;
+		msg->lvb_seq = be64dec(p);
+		memcpy(msg->lvb, p + 8, DLMD_LVB_LEN);
+		p += DLMD_WIRE_LVB_LEN;
+		len += DLMD_WIRE_LVB_LEN;
+	}
+
+	if (msg->flags & DLMD_MSG_F_QUEUE) {
+		if (len + 2 > buf_len)
+			return EINVAL;
+		msg->queue_len = be16dec(p);
+		if (msg->queue_len > DLMD_TOKEN_QUEUE_MAX ||
+		    len + DLMD_WIRE_QUEUE_LEN(msg->queue_len) > buf_len)
+			return EINVAL;
+		for (i = 0; i < msg->queue_len; i++)
+			msg->queue[i] = htonl(be32dec(p + 2 + 4 * i));
+	}
+
+	dlmd_msg_set_resource(msg, buf + DLMD_WIRE_HDR_LEN, nlen);
+
+	return 0;
+}
+
+/*
+ * Parse plist message to msg, failed message doesn't have to be finished.
+ */
+int
+dlmd_msg_internalize(const char *buf, dlmd_msg_t *msg)
 {
 	prop_dictionary_t dict;
-	char *buf;
-	
-	dict = prop_dictionary_create();
+	prop_data_t data;
+	const char *str;
+	int i;
 
-	prop_dictionary_set_cstring(dict, MSG_NODE_NAME, name);
+	if ((dict = prop_dictionary_internalize(buf)) == NULL)
+		return EINVAL;
 
-	prop_dictionary_set_cstring(dict, MSG_TYPE, MSG_LOCK_REPLY_TYPE);
-	prop_dictionary_set_cstring(dict, MSG_RESOURCE, resource);
-	prop_dictionary_set_uint64(dict, MSG_EVENT, event);
-	prop_dictionary_set_uint32(dict, MSG_LOCK_TYPE, flag);
-	
-	buf = prop_dictionary_externalize(dict);
+	dlmd_msg_clear(msg);
+
+	if (prop_dictionary_get_cstring_nocopy(dict, MSG_TYPE, &str))
+		for (i = 0; msg_types[i].name != NULL; i++)
+			if (strcmp(str, msg_types[i].name) == 0) {
+				msg->type = msg_types[i].type;
+				break;
+			}
+
+	if (prop_dictionary_get_cstring_nocopy(dict, MSG_NODE_NAME, &str))
+		strlcpy(msg->node_name, str, DLMD_NODE_NAME_LEN);
+
+	prop_dictionary_get_uint64(dict, MSG_EVENT, &msg->event);
+	prop_dictionary_get_uint64(dict, MSG_REF, &msg->ref);
+	prop_dictionary_get_uint32(dict, MSG_LOCK_FLAG, &msg->mode);
+	prop_dictionary_get_uint32(dict, MSG_ID, &msg->node_id);
+	prop_dictionary_get_uint32(dict, MSG_WIRE, &msg->wire);
+	prop_dictionary_get_uint32(dict, MSG_LOCK_OPTS, &msg->flags);
+
+	if (msg->flags & DLMD_MSG_F_LVB) {
+		data = prop_dictionary_get(dict, MSG_LVB);
+		if (data == NULL || prop_data_size(data) != DLMD_LVB_LEN) {
+			prop_object_release(dict);
+			return EINVAL;
+		}
+		memcpy(msg->lvb, prop_data_data_nocopy(data), DLMD_LVB_LEN);
+		prop_dictionary_get_uint64(dict, MSG_LVB_SEQ, &msg->lvb_seq);
+	}
+
+	/* Token queue is kept in network byte order as opaque data */
+	if (msg->flags & DLMD_MSG_F_QUEUE) {
+		data = prop_dictionary_get(dict, MSG_QUEUE);
+		if (data == NULL || prop_data_size(data) % sizeof(uint32_t) != 0 ||
+		    prop_data_size(data) > sizeof(msg->queue)) {
+			prop_object_release(dict);
+			return EINVAL;
+		}
+		msg->queue_len = prop_data_size(data) / sizeof(uint32_t);
+		memcpy(msg->queue, prop_data_data_nocopy(data), prop_data_size(data));
+	}
+
+	if (prop_dictionary_get_cstring_nocopy(dict, MSG_RESOURCE, &str))
+		dlmd_msg_set_resource(msg, str, strnlen(str, MAX_NAME_LEN - 1));
 
 	prop_object_release(dict);
 
-	return buf;
+	return 0;
 }
 
+/*
+ * Create plist message from msg, returned buffer has to be freed by caller.
+ */
 char *
-unlock_msg_init(const char *name, const char *resource, uint64_t event, uint32_t flag)
+dlmd_msg_externalize(const dlmd_msg_t *msg)
 {
 	prop_dictionary_t dict;
 	char *buf;
-	
+	int i;
+
+	for (i = 0; msg_types[i].name != NULL; i++)
+		if (msg_types[i].type == msg->type)
+			break;
+
+	if (msg_types[i].name == NULL)
+		return NULL;
+
 	dict = prop_dictionary_create();
 
-	prop_dictionary_set_cstring(dict, MSG_NODE_NAME, name);
+	prop_dictionary_set_cstring(dict, MSG_NODE_NAME, msg->node_name);
+	prop_dictionary_set_cstring(dict, MSG_TYPE, msg_types[i].name);
+
+	if (msg->type == DLMD_MSG_KEEPALIVE) {
+		prop_dictionary_set_uint32(dict, MSG_WIRE, msg->wire);
+	} else {
+		prop_dictionary_set_cstring(dict, MSG_RESOURCE, msg->resource);
+		prop_dictionary_set_uint64(dict, MSG_EVENT, msg->event);
+		prop_dictionary_set_uint32(dict, MSG_LOCK_FLAG, msg->mode);
+		prop_dictionary_set_uint32(dict, MSG_ID, msg->node_id);
+
+		if (msg->type != DLMD_MSG_REQUEST)
+			prop_dictionary_set_uint64(dict, MSG_REF, msg->ref);
+
+		if (msg->flags != 0)
+			prop_dictionary_set_uint32(dict, MSG_LOCK_OPTS, msg->flags);
+
+		if (msg->flags & DLMD_MSG_F_LVB) {
+			prop_dictionary_set_uint64(dict, MSG_LVB_SEQ, msg->lvb_seq);
+			prop_dictionary_set_data(dict, MSG_LVB, msg->lvb, DLMD_LVB_LEN);
+		}
+
+		if (msg->flags & DLMD_MSG_F_QUEUE)
+			prop_dictionary_set_data(dict, MSG_QUEUE, msg->queue,
+			    msg->queue_len * sizeof(uint32_t));
+	}
 
-	prop_dictionary_set_cstring(dict, MSG_TYPE, MSG_UNLOCK_TYPE);
-	prop_dictionary_set_cstring(dict, MSG_RESOURCE, resource);
-	prop_dictionary_set_uint64(dict, MSG_EVENT, event);
-	prop_dictionary_set_uint32(dict, MSG_LOCK_TYPE, flag);
-	
 	buf = prop_dictionary_externalize(dict);
 
 	prop_object_release(dict);
 
 	return buf;
 }
+
+/*
+ * Parse received buffer in any supported format.
+ */
+int
+dlmd_msg_parse(const char *buf, size_t buf_len, dlmd_msg_t *msg)
+{
+	if (buf_len > 0 && (uint8_t)buf[0] == DLMD_WIRE_MAGIC)
+		return dlmd_msg_decode(buf, buf_len, msg);
+
+	return dlmd_msg_internalize(buf, msg);
+}
+
+/*
+ * Size of longest resource name with NUL I can send, plist message has to
+ * fit to datagram.
+ */
+size_t
+dlmd_msg_name_max()
+{
+	if (conf.transport == DLMD_TRANSPORT_TCP)
+		return MAX_NAME_LEN;
+
+	return DLMD_DGRAM_NAME_LEN;
+}
+
+/*
+ * Check if I can talk to nodes with given wire version in binary format.
+ */
+static int
+dlmd_msg_use_binary(uint32_t wire_version)
+{
+	switch (conf.wire_format) {
+	case DLMD_WIRE_BINARY:
+		return 1;
+	case DLMD_WIRE_AUTO:
+		return wire_version >= DLMD_WIRE_MSG_VERSION;
+	}
+
+	return 0;
+}
+
+/*
+ * Send message to all active nodes. With conf.async_send message is only
+ * queued and sender thread encodes and sends it, so caller doesn't wait
+ * for sendto.
+ */
+int
+dlmd_msg_broadcast(const dlmd_msg_t *msg)
+{
+	if (sender_running) {
+		dlmd_queue_put(&send_queue, NULL, msg);
+		return 0;
+	}
+
+	return dlmd_msg_send(NULL, msg);
+}
+
+/*
+ * Send message to node, queued like broadcast.
+ */
+int
+dlmd_msg_unicast(dlmd_node_t *node, const dlmd_msg_t *msg)
+{
+	if (sender_running) {
+		dlmd_queue_put(&send_queue, node, msg);
+		return 0;
+	}
+
+	return dlmd_msg_send(node, msg);
+}
+
+/*
+ * Encode message and send it to node, NULL node means all active nodes.
+ * Binary format is used only if destination understands it, for broadcast
+ * all of them, so mixed version clusters keep working.
+ */
+int
+dlmd_msg_send(dlmd_node_t *node, const dlmd_msg_t *msg)
+{
+	char buf[DLMD_WIRE_MAX_LEN];
+	char *pbuf;
+	ssize_t len;
+	uint32_t wire;
+	int r;
+
+	wire = (node == NULL) ? dlmd_node_wire_version() : node->wire_version;
+
+	if (dlmd_msg_use_binary(wire) &&
+	    (len = dlmd_msg_encode(msg, buf, sizeof(buf))) > 0)
+		return (node == NULL) ? dlmd_node_broadcast_msg(buf, len) :
+		    dlmd_node_unicast_msg(node, buf, len);
+
+	if ((pbuf = dlmd_msg_externalize(msg)) == NULL)
+		return EINVAL;
+
+	r = (node == NULL) ? dlmd_node_broadcast_msg(pbuf, strlen(pbuf)) :
+	    dlmd_node_unicast_msg(node, pbuf, strlen(pbuf));
+
+	free(pbuf);
+
+	return r;
+}
+
+/*
+ * Prepare send queue, messages are queued since sender thread is started.
+ */
+void
+dlmd_msg_sender_init()
+{
+	dlmd_queue_init(&send_queue, DLMD_SEND_QUEUE_LEN);
+	sender_running = 1;
+}
+
+/*
+ * Sender thread, last stage of message processing. It is the only consumer
+ * of send queue, messages leave in order in which they were queued.
+ */
+void *
+dlmd_msg_sender_start(void *arg)
+{
+	dlmd_node_t *node;
+	dlmd_msg_t *msg;
+
+	while (1) {
+		dlmd_queue_wait(&send_queue);
+
+		while ((msg = dlmd_queue_peek(&send_queue, &node)) != NULL) {
+			dlmd_msg_send(node, msg);
+			dlmd_queue_release(&send_queue);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Print send queue counters.
+ */
+void
+dlmd_msg_sender_stats()
+{
+	if (sender_running)
+		dlmd_queue_stats(&send_queue, "send");
+}
@@ -2,6 +2,7 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/endian.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -11,6 +12,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <prop/proplib.h>
@@ -21,16 +23,38 @@
  * Interface for manipulating with nodes which are known to dlmd.
  */
 
+extern dlmd_conf_t conf;
+
 static struct dlmd_node_head node_list; /* = SLIST_HEAD_INITIALIZER(node_list);*/
 
 static pthread_mutex_t node_list_mutex;
 
+/* Achieved sendmmsg batch sizes of broadcasts */
+static uint64_t bcast_calls;
+static uint64_t bcast_msgs;
+
+/* Bundle flush thread waits for first queued message */
+static pthread_mutex_t flush_mtx;
+static pthread_cond_t flush_cv;
+static int flush_pending;
+
+/* Coalescing statistics */
+static uint64_t bundle_sent;
+static uint64_t bundle_msgs;
+
 static dlmd_node_t* dlmd_node_alloc();
 static void dlmd_node_destroy(dlmd_node_t *);
 static dlmd_node_t* dlmd_node_find_ip(uint32_t);
 static dlmd_node_t* dlmd_node_find_name(const char*);
 
 static void dump_list();
+static int dlmd_node_coalesce(dlmd_node_t *, const char *);
+static void dlmd_node_queue_msg(dlmd_node_t *, const char *, size_t);
+static size_t dlmd_node_bundle(dlmd_node_t *, char *);
+static void dlmd_node_flush();
+static int dlmd_node_reliable(dlmd_node_t *, const char *);
+static void dlmd_node_send(dlmd_node_t *, const char *, size_t);
+static void dlmd_node_send_locked(dlmd_node_t *, const char *, size_t);
 
 static void
 dump_list()
@@ -126,45 +150,328 @@ dlmd_node_find_name(const char *name)
 }
 
 /*
- * Broadcast message to all active nodes in a cluster.
+ * Broadcast message to all active nodes in a cluster. With multicast group
+ * configured, which is only possible without reliable delivery, it is sent
+ * once to the group. Otherwise addresses are copied under node_list_mutex
+ * and datagrams are sent without it, conf.batch_size of them with one
+ * sendmmsg call from local node socket.
  */
 int
 dlmd_node_broadcast_msg(const char *buf, size_t buf_len)
 {
+	struct sockaddr_in addr[DLMD_BATCH_MAX];
+	struct mmsghdr msgs[DLMD_BATCH_MAX];
+	dlmd_node_t *bundle[DLMD_BATCH_MAX];
+	dlmd_node_t *single[DLMD_BATCH_MAX];
+	struct iovec iov;
 	dlmd_node_t *node;
+	uint32_t i, n, nb, nr;
+	int sent;
+
+	if (conf.mcast_group.s_addr != INADDR_ANY)
+		return dlmd_mcast_send(buf, buf_len);
+
+	iov.iov_base = __UNCONST(buf);
+	iov.iov_len = buf_len;
+
+	node = NULL;
+
+	do {
+		n = nb = nr = 0;
+
+		pthread_mutex_lock(&node_list_mutex);
+
+		dump_list();
+
+		/* Continue after last node of previous batch */
+		node = (node == NULL) ? SLIST_FIRST(&node_list) : SLIST_NEXT(node, next);
+		for (; node != NULL; node = SLIST_NEXT(node, next)) {
+			if (node->alive_flag > 0 &&
+			    node->type != DLMD_NODE_TYPE_LOCAL) {
+				if (dlmd_node_coalesce(node, buf))
+					bundle[nb++] = node;
+				else if (conf.transport == DLMD_TRANSPORT_TCP ||
+				    dlmd_node_reliable(node, buf))
+					single[nr++] = node;
+				else
+					addr[n++] = node->node_address;
+			}
+			if (n == conf.batch_size || nb == conf.batch_size ||
+			    nr == conf.batch_size)
+				break;
+		}
+
+		pthread_mutex_unlock(&node_list_mutex);
+
+		for (i = 0; i < nb; i++)
+			dlmd_node_queue_msg(bundle[i], buf, buf_len);
+
+		/* Every node has its own connection or sequence numbers */
+		for (i = 0; i < nr; i++)
+			dlmd_node_send(single[i], buf, buf_len);
+
+		for (i = 0; i < n; i++) {
+			memset(&msgs[i], 0, sizeof(struct mmsghdr));
+			msgs[i].msg_hdr.msg_iov = &iov;
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addr[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		}
+
+		for (i = 0; i < n; i += sent) {
+			if ((sent = sendmmsg(local_node->node_socket, &msgs[i], n - i, 0)) <= 0) {
+				DPRINTF(("sendmmsg failed."));
+				break;
+			}
+			atomic_inc_64(&bcast_calls);
+			atomic_add_64(&bcast_msgs, sent);
+		}
+	} while (node != NULL);
 	
-	pthread_mutex_lock(&node_list_mutex);
-	
-	dump_list();
-	
-	SLIST_FOREACH(node, &node_list, next) {
-		if (node->alive_flag > 0 && 
-			node->type != DLMD_NODE_TYPE_LOCAL)
-			sendto(node->node_socket, buf, buf_len, 0,
-			    (struct sockaddr *)&node->node_address, sizeof(struct sockaddr));
+	return 0;
+}
+
+/*
+ * Print achieved broadcast batch sizes.
+ */
+void
+dlmd_node_stats()
+{
+	printf("Broadcast %"PRIu64" datagrams in %"PRIu64" sendmmsg calls\n",
+	    bcast_msgs, bcast_calls);
+	printf("Coalesced %"PRIu64" messages to %"PRIu64" datagrams\n",
+	    bundle_msgs, bundle_sent);
+}
+
+/*
+ * Binary messages to nodes which understand bundles are coalesced when
+ * coalescing is enabled.
+ */
+static int
+dlmd_node_coalesce(dlmd_node_t *node, const char *buf)
+{
+	return conf.coalesce_usec != 0 && (uint8_t)buf[0] == DLMD_WIRE_MAGIC &&
+	    node->wire_version >= DLMD_WIRE_BUNDLE_VERSION &&
+	    node->type != DLMD_NODE_TYPE_LOCAL;
+}
+
+/*
+ * Binary messages and bundles to nodes which understand reliable datagrams
+ * are sent reliably when it is enabled, over stream too, its frames are
+ * lost when connection breaks. Plist messages, keepalives among them, stay
+ * unreliable; lost keepalive has to look like lost.
+ */
+static int
+dlmd_node_reliable(dlmd_node_t *node, const char *buf)
+{
+	return conf.reliable && node->rel != NULL &&
+	    node->wire_version >= DLMD_WIRE_REL_VERSION &&
+	    ((uint8_t)buf[0] == DLMD_WIRE_MAGIC ||
+	    (uint8_t)buf[0] == DLMD_WIRE_BUNDLE_MAGIC);
+}
+
+/*
+ * Send datagram to node, with stream transport as frame over connection.
+ */
+static void
+dlmd_node_send(dlmd_node_t *node, const char *buf, size_t buf_len)
+{
+	pthread_mutex_lock(&node->send_mtx);
+	dlmd_node_send_locked(node, buf, buf_len);
+	pthread_mutex_unlock(&node->send_mtx);
+}
+
+/*
+ * Send to node with send_mtx held. Reliable sequence number or stream
+ * position is assigned here, so sends to one node have to be serialized
+ * for Lamport FIFO order.
+ */
+static void
+dlmd_node_send_locked(dlmd_node_t *node, const char *buf, size_t buf_len)
+{
+	if (dlmd_node_reliable(node, buf))
+		dlmd_rel_send(node->rel, buf, buf_len);
+	else if (conf.transport == DLMD_TRANSPORT_TCP)
+		dlmd_stream_send(node, buf, buf_len);
+	else
+		sendto(node->node_socket, buf, buf_len, 0,
+		    (struct sockaddr *)&node->node_address, sizeof(struct sockaddr));
+}
+
+/*
+ * Append message to outgoing bundle of node. Full bundle is sent right
+ * away, first message of bundle wakes up flush thread which sends it after
+ * conf.coalesce_usec.
+ */
+static void
+dlmd_node_queue_msg(dlmd_node_t *node, const char *buf, size_t buf_len)
+{
+	char out[DLMD_BUNDLE_MAX];
+	size_t out_len;
+	int first, full;
+
+	out_len = 0;
+
+	pthread_mutex_lock(&node->node_mtx);
+
+	/*
+	 * Full bundle is taken with send_mtx held until it is sent, nobody
+	 * can send bundle with my message before it.
+	 */
+	full = (node->out_len + 2 + buf_len > DLMD_BUNDLE_MAX);
+	if (full) {
+		pthread_mutex_unlock(&node->node_mtx);
+		pthread_mutex_lock(&node->send_mtx);
+		pthread_mutex_lock(&node->node_mtx);
+
+		if (node->out_len + 2 + buf_len > DLMD_BUNDLE_MAX)
+			out_len = dlmd_node_bundle(node, out);
 	}
-		
+
+	/* Space for bundle header is reserved in front of first message */
+	if (node->out_len == 0)
+		node->out_len = DLMD_WIRE_BUNDLE_HDR_LEN;
+
+	be16enc(node->out_buf + node->out_len, buf_len);
+	memcpy(node->out_buf + node->out_len + 2, buf, buf_len);
+	node->out_len += 2 + buf_len;
+
+	first = (++node->out_cnt == 1);
+
+	pthread_mutex_unlock(&node->node_mtx);
+
+	if (full) {
+		if (out_len != 0)
+			dlmd_node_send_locked(node, out, out_len);
+		pthread_mutex_unlock(&node->send_mtx);
+	}
+
+	if (first) {
+		pthread_mutex_lock(&flush_mtx);
+		flush_pending = 1;
+		pthread_cond_signal(&flush_cv);
+		pthread_mutex_unlock(&flush_mtx);
+	}
+}
+
+/*
+ * Take outgoing bundle of node to out and return its length. Single message
+ * is sent without bundle header. Must be called with node_mtx held.
+ */
+static size_t
+dlmd_node_bundle(dlmd_node_t *node, char *out)
+{
+	size_t len;
+
+	if (node->out_cnt == 0)
+		return 0;
+
+	if (node->out_cnt == 1) {
+		len = node->out_len - DLMD_WIRE_BUNDLE_HDR_LEN - 2;
+		memcpy(out, node->out_buf + DLMD_WIRE_BUNDLE_HDR_LEN + 2, len);
+	} else {
+		node->out_buf[0] = DLMD_WIRE_BUNDLE_MAGIC;
+		node->out_buf[1] = DLMD_WIRE_BUNDLE_VERSION;
+		be16enc(node->out_buf + 2, node->out_cnt);
+		len = node->out_len;
+		memcpy(out, node->out_buf, len);
+	}
+
+	atomic_inc_64(&bundle_sent);
+	atomic_add_64(&bundle_msgs, node->out_cnt);
+
+	node->out_len = 0;
+	node->out_cnt = 0;
+
+	return len;
+}
+
+/*
+ * Send outgoing bundles of all nodes. Bundles are sent without
+ * node_list_mutex, sending takes send_mtx of node. Nodes are never removed
+ * from node_list, so I can keep pointer to one.
+ */
+static void
+dlmd_node_flush()
+{
+	char out[DLMD_BUNDLE_MAX];
+	dlmd_node_t *node;
+	size_t len;
+
+	pthread_mutex_lock(&node_list_mutex);
+	node = SLIST_FIRST(&node_list);
 	pthread_mutex_unlock(&node_list_mutex);
-	
-	return 0;
+
+	while (node != NULL) {
+		pthread_mutex_lock(&node->send_mtx);
+
+		pthread_mutex_lock(&node->node_mtx);
+		len = dlmd_node_bundle(node, out);
+		pthread_mutex_unlock(&node->node_mtx);
+
+		if (len != 0)
+			dlmd_node_send_locked(node, out, len);
+
+		pthread_mutex_unlock(&node->send_mtx);
+
+		pthread_mutex_lock(&node_list_mutex);
+		node = SLIST_NEXT(node, next);
+		pthread_mutex_unlock(&node_list_mutex);
+	}
+}
+
+/*
+ * Flush thread, it sleeps until some message is queued, waits
+ * conf.coalesce_usec for more messages and sends all bundles.
+ */
+void *
+dlmd_node_flush_start(void *arg)
+{
+	struct timespec ts;
+
+	ts.tv_sec = conf.coalesce_usec / 1000000;
+	ts.tv_nsec = (conf.coalesce_usec % 1000000) * 1000;
+
+	while (1) {
+		pthread_mutex_lock(&flush_mtx);
+		while (!flush_pending)
+			pthread_cond_wait(&flush_cv, &flush_mtx);
+		flush_pending = 0;
+		pthread_mutex_unlock(&flush_mtx);
+
+		nanosleep(&ts, NULL);
+
+		dlmd_node_flush();
+	}
+
+	return NULL;
 }
 
 /*
- * Unicast message to node in a cluster.
+ * Unicast message to node in a cluster. Message is sent without
+ * node_list_mutex, sending takes send_mtx of node.
  */
 int
 dlmd_node_unicast_msg(dlmd_node_t *node, const char *buf, size_t buf_len)
 {
+	int send;
+
+	if (node->alive_flag > 0 && dlmd_node_coalesce(node, buf)) {
+		dlmd_node_queue_msg(node, buf, buf_len);
+		return 0;
+	}
+
 	pthread_mutex_lock(&node_list_mutex);
 	
 	dump_list();
 	
-	if (node->alive_flag > 0 && 
-		node->type != DLMD_NODE_TYPE_LOCAL)
-	sendto(node->node_socket, buf, buf_len, 0,
-	    (struct sockaddr *)&node->node_address, sizeof(struct sockaddr));
+	send = (node->alive_flag > 0 && 
+		node->type != DLMD_NODE_TYPE_LOCAL);
 			
 	pthread_mutex_unlock(&node_list_mutex);
+
+	if (send)
+		dlmd_node_send(node, buf, buf_len);
 	
 	return 0;
 }
@@ -217,6 +524,80 @@ dlmd_node_alive_count()
 	return cnt;
 }
 
+/*
+ * Return lowest binary wire version understood by all active members of
+ * cluster. Binary broadcast can be used only when all of them know it.
+ */
+uint32_t
+dlmd_node_wire_version()
+{
+	dlmd_node_t *node;
+	uint32_t version;
+
+	version = DLMD_WIRE_VERSION;
+
+	pthread_mutex_lock(&node_list_mutex);
+
+	SLIST_FOREACH(node, &node_list, next) {
+		if (node->alive_flag > 0 &&
+			node->type != DLMD_NODE_TYPE_LOCAL &&
+			node->wire_version < version)
+			version = node->wire_version;
+	}
+	pthread_mutex_unlock(&node_list_mutex);
+
+	return version;
+}
+
+/*
+ * Find master node of resource with hash for master engine. Master is
+ * chosen from alive nodes and me sorted by address, so all nodes with the
+ * same view of cluster agree on it. With alive 0 all configured nodes are
+ * used, that doesn't depend on cluster state at all.
+ * XXX Master is not recovered when membership changes, nodes can disagree
+ *     on master until keepalive settles.
+ */
+dlmd_node_t *
+dlmd_node_master(uint32_t hash, int alive)
+{
+	dlmd_node_t *node, *node2;
+	uint32_t cnt, idx, smaller;
+
+	cnt = 0;
+
+	pthread_mutex_lock(&node_list_mutex);
+
+	SLIST_FOREACH(node, &node_list, next) {
+		if (!alive || node->alive_flag > 0 || node->type == DLMD_NODE_TYPE_LOCAL)
+			cnt++;
+	}
+
+	idx = hash % cnt;
+
+	/* Clusters are small, quadratic search for idx-th address is fine */
+	SLIST_FOREACH(node, &node_list, next) {
+		if (alive && node->alive_flag <= 0 && node->type != DLMD_NODE_TYPE_LOCAL)
+			continue;
+
+		smaller = 0;
+		SLIST_FOREACH(node2, &node_list, next) {
+			if (alive && node2->alive_flag <= 0 &&
+			    node2->type != DLMD_NODE_TYPE_LOCAL)
+				continue;
+			if (ntohl(node2->node_address.sin_addr.s_addr) <
+			    ntohl(node->node_address.sin_addr.s_addr))
+				smaller++;
+		}
+
+		if (smaller == idx)
+			break;
+	}
+
+	pthread_mutex_unlock(&node_list_mutex);
+
+	return node;
+}
+
 /*
  * Add node entry to global list.
  */
@@ -229,7 +610,7 @@ dlmd_node_add(const char *name, const char *ip, const char *netmask, uint32_t po
 	
 	node = dlmd_node_alloc();
 	
-	strlcpy(node->node_name, name, MAX_NAME_LEN);
+	strlcpy(node->node_name, name, DLMD_NODE_NAME_LEN);
 
 	bits = inet_net_pton(AF_INET, ip, &node->node_address.sin_addr,
 	    sizeof(node->node_address.sin_addr));
@@ -249,8 +630,15 @@ dlmd_node_add(const char *name, const char *ip, const char *netmask, uint32_t po
 
 	if (type == DLMD_NODE_TYPE_LOCAL)
 		local_node = node;
+	else
+		node->rel = dlmd_rel_alloc(node);
 	
 	pthread_mutex_init(&node->node_mtx ,NULL);
+	pthread_mutex_init(&node->send_mtx, NULL);
+	pthread_mutex_init(&node->stream_mtx, NULL);
+	pthread_cond_init(&node->stream_cv, NULL);
+	node->stream_fd = -1;
+	node->stream_connecting = 0;
 	/*       pthread_cond_init();*/
 	
 	pthread_mutex_lock(&node_list_mutex);
@@ -290,4 +678,6 @@ void
 dlmd_node_init() {
 	SLIST_INIT(&node_list);
 	pthread_mutex_init(&node_list_mutex, NULL);
+	pthread_mutex_init(&flush_mtx, NULL);
+	pthread_cond_init(&flush_cv, NULL);
 }
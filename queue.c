@@ -0,0 +1,229 @@
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <prop/proplib.h>
+
+#include "dlmd.h"
+
+/*
+ * Bounded lock free message queue connecting stages of message processing.
+ * Any number of threads can put messages to it, one thread takes them.
+ * Every cell has sequence number which tells producers and consumer whose
+ * turn it is (D. Vyukov's bounded queue): cell at position pos is free for
+ * producer when seq == pos and it holds message for consumer when
+ * seq == pos + 1. Producers reserve position with CAS on tail.
+ *
+ * Consumer sleeps on doorbell when queue is empty, producer takes doorbell
+ * mutex only when consumer sleeps. Producer which finds queue full sleeps
+ * on full_cv until consumer frees the cell, consumer takes the mutex only
+ * when some producer waits. Stage after queue is slow and stages before it
+ * have to slow down too.
+ */
+
+#define DLMD_QUEUE_EMPTY(q)						\
+	((q)->cells[(q)->head & (q)->mask].seq != (q)->head + 1)
+
+static void dlmd_queue_wait_cell(dlmd_queue_t *, struct dlmd_queue_cell *,
+    uint32_t);
+
+/*
+ * Initialize queue with len cells, len must be power of 2.
+ */
+void
+dlmd_queue_init(dlmd_queue_t *q, uint32_t len)
+{
+	uint32_t i;
+
+	assert(powerof2(len));
+
+	memset(q, 0, sizeof(dlmd_queue_t));
+
+	if ((q->cells = calloc(len, sizeof(struct dlmd_queue_cell))) == NULL)
+		err(EXIT_FAILURE, "Allocating message queue failed");
+
+	for (i = 0; i < len; i++)
+		q->cells[i].seq = i;
+
+	q->mask = len - 1;
+
+	pthread_mutex_init(&q->mtx, NULL);
+	pthread_cond_init(&q->cv, NULL);
+	pthread_cond_init(&q->full_cv, NULL);
+}
+
+/*
+ * Put copy of message for node to queue, caller still owns msg.
+ */
+void
+dlmd_queue_put(dlmd_queue_t *q, dlmd_node_t *node, const dlmd_msg_t *msg)
+{
+	struct dlmd_queue_cell *cell;
+	uint32_t pos, seq, prev, depth;
+	int full;
+
+	full = 0;
+	pos = q->tail;
+
+	while (1) {
+		cell = &q->cells[pos & q->mask];
+		seq = cell->seq;
+		membar_consumer();
+
+		if (seq == pos) {
+			if ((prev = atomic_cas_32(&q->tail, pos, pos + 1)) == pos)
+				break;
+			pos = prev;
+		} else if ((int32_t)(seq - pos) < 0) {
+			/* Consumer didn't free the cell yet */
+			if (!full++)
+				atomic_inc_64(&q->full);
+			dlmd_queue_wait_cell(q, cell, pos);
+			pos = q->tail;
+		} else
+			pos = q->tail;
+	}
+
+	cell->node = node;
+	dlmd_msg_copy(&cell->msg, msg);
+
+	membar_producer();
+	cell->seq = pos + 1;
+
+	atomic_inc_64(&q->puts);
+
+	/* Only approximate, it is statistics */
+	depth = pos + 1 - q->head;
+	if (depth > q->max_depth)
+		q->max_depth = depth;
+
+	/* Pairs with barrier in dlmd_queue_wait */
+	membar_sync();
+	if (q->sleeping) {
+		pthread_mutex_lock(&q->mtx);
+		pthread_cond_signal(&q->cv);
+		pthread_mutex_unlock(&q->mtx);
+	}
+}
+
+/*
+ * Sleep until consumer frees cell for position pos. Waiting counter is
+ * raised before cell is checked and consumer checks it after freeing the
+ * cell, so one of us sees the other and wakeup is not lost.
+ */
+static void
+dlmd_queue_wait_cell(dlmd_queue_t *q, struct dlmd_queue_cell *cell,
+    uint32_t pos)
+{
+	pthread_mutex_lock(&q->mtx);
+
+	atomic_inc_32(&q->waiting);
+	membar_sync();
+
+	while ((int32_t)(cell->seq - pos) < 0)
+		pthread_cond_wait(&q->full_cv, &q->mtx);
+
+	atomic_dec_32(&q->waiting);
+
+	pthread_mutex_unlock(&q->mtx);
+}
+
+/*
+ * Return first queued message without removing it, NULL when queue is
+ * empty. Consumer only.
+ */
+dlmd_msg_t *
+dlmd_queue_peek(dlmd_queue_t *q, dlmd_node_t **node)
+{
+	struct dlmd_queue_cell *cell;
+
+	if (DLMD_QUEUE_EMPTY(q))
+		return NULL;
+
+	membar_consumer();
+
+	cell = &q->cells[q->head & q->mask];
+
+	if (node != NULL)
+		*node = cell->node;
+
+	return &cell->msg;
+}
+
+/*
+ * Free first queued message after consumer is done with it.
+ */
+void
+dlmd_queue_release(dlmd_queue_t *q)
+{
+	struct dlmd_queue_cell *cell;
+
+	cell = &q->cells[q->head & q->mask];
+
+	dlmd_msg_fini(&cell->msg);
+
+	/* Message has to be read before producer can overwrite it */
+	membar_sync();
+	cell->seq = q->head + q->mask + 1;
+
+	q->head++;
+
+	/* Pairs with barrier in dlmd_queue_wait_cell */
+	membar_sync();
+	if (q->waiting) {
+		pthread_mutex_lock(&q->mtx);
+		pthread_cond_broadcast(&q->full_cv);
+		pthread_mutex_unlock(&q->mtx);
+	}
+}
+
+/*
+ * Wait until queue is not empty. Consumer only.
+ */
+void
+dlmd_queue_wait(dlmd_queue_t *q)
+{
+	if (!DLMD_QUEUE_EMPTY(q))
+		return;
+
+	pthread_mutex_lock(&q->mtx);
+
+	q->sleeping = 1;
+	membar_sync();
+
+	while (DLMD_QUEUE_EMPTY(q))
+		pthread_cond_wait(&q->cv, &q->mtx);
+
+	q->sleeping = 0;
+
+	pthread_mutex_unlock(&q->mtx);
+}
+
+/*
+ * Number of queued messages, only approximate when stages are running.
+ */
+uint32_t
+dlmd_queue_depth(dlmd_queue_t *q)
+{
+	return q->tail - q->head;
+}
+
+/*
+ * Print queue counters.
+ */
+void
+dlmd_queue_stats(dlmd_queue_t *q, const char *name)
+{
+	printf("Queue %s depth %u, max %u, %"PRIu64" messages, full %"PRIu64
+	    " times\n", name, dlmd_queue_depth(q), q->max_depth, q->puts,
+	    q->full);
+}
@@ -0,0 +1,571 @@
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/endian.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <prop/proplib.h>
+
+#include "dlmd.h"
+
+/*
+ * Reliable delivery of binary messages and bundles to other nodes. Every
+ * datagram sent to node gets sequence number of per node stream and stays
+ * in transmit queue until node acknowledges it. Receiver acknowledges next
+ * expected sequence number and up to DLMD_REL_WINDOW - 1 datagrams after it
+ * which it already has (sack), so only really lost datagrams are sent
+ * again. Datagrams received out of order are kept until the gap is filled,
+ * therefore messages are delivered in order in which they were sent. That is
+ * what Lamport algorithm expects from channels anyway.
+ *
+ * Receiver keeps only DLMD_REL_WINDOW datagrams from next expected one, so
+ * sender has at most that many unacknowledged datagrams in flight, the rest
+ * waits in hold queue until acknowledgements open the window.
+ *
+ * With stream transport the same datagrams go as frames over connection
+ * to node, frames lost with broken connection are sent again.
+ *
+ * Acknowledgements are sent with data going to node or by timer thread
+ * every DLMD_REL_TICK_USEC. Retransmit timeout is computed from measured
+ * round trip time like in TCP (RFC 6298).
+ */
+
+extern dlmd_conf_t conf;
+
+struct dlmd_rel_pkt {
+	uint32_t seq;
+	uint64_t sent;		/* usec of last transmission */
+	uint32_t retries;
+	size_t len;		/* with header */
+	TAILQ_ENTRY(dlmd_rel_pkt) next;
+	char buf[DLMD_WIRE_REL_HDR_LEN + DLMD_BUNDLE_MAX];
+};
+
+TAILQ_HEAD(dlmd_rel_pkt_head, dlmd_rel_pkt);
+
+struct dlmd_rel {
+	pthread_mutex_t mtx;
+	dlmd_node_t *node;
+	/* transmit side */
+	uint32_t tx_epoch;		/* epoch of my stream to node */
+	uint32_t tx_seq;		/* next sequence number */
+	struct dlmd_rel_pkt_head tx_queue; /* sent and not acknowledged */
+	struct dlmd_rel_pkt_head hold_queue; /* waiting for window */
+	uint32_t held;			/* datagrams in hold_queue */
+	uint64_t srtt;			/* usec */
+	uint64_t rttvar;
+	uint64_t rto;
+	/* receive side */
+	uint32_t rx_epoch;		/* epoch of node stream, 0 nothing received */
+	uint32_t rx_next;		/* next expected sequence number */
+	char *rx_buf[DLMD_REL_WINDOW];	/* received after gap, by seq % window */
+	size_t rx_len[DLMD_REL_WINDOW];
+	int ack_pending;
+	/* statistics */
+	uint64_t sent;
+	uint64_t retransmits;
+	uint64_t duplicates;
+	uint64_t lost;			/* dropped by loss injection */
+	SLIST_ENTRY(dlmd_rel) next;
+};
+
+static SLIST_HEAD(, dlmd_rel) rel_list = SLIST_HEAD_INITIALIZER(rel_list);
+static pthread_mutex_t rel_list_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t dlmd_rel_now();
+static void dlmd_rel_tx_reset(struct dlmd_rel *);
+static void dlmd_rel_hdr(struct dlmd_rel *, char *, uint32_t, uint32_t);
+static void dlmd_rel_xmit(struct dlmd_rel *, const char *, size_t);
+static void dlmd_rel_ack(struct dlmd_rel *, uint32_t, uint32_t);
+static void dlmd_rel_push(struct dlmd_rel *);
+static void dlmd_rel_rtt(struct dlmd_rel *, uint64_t);
+static void dlmd_rel_rx_reset(struct dlmd_rel *, uint32_t, uint32_t);
+static void dlmd_rel_timer(struct dlmd_rel *, uint64_t);
+
+static uint64_t
+dlmd_rel_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Allocate reliable delivery state for remote node.
+ */
+struct dlmd_rel *
+dlmd_rel_alloc(dlmd_node_t *node)
+{
+	struct dlmd_rel *rel;
+
+	if ((rel = malloc(sizeof(struct dlmd_rel))) == NULL)
+		err(EXIT_FAILURE, "Allocating reliable state failed");
+
+	memset(rel, 0, sizeof(struct dlmd_rel));
+
+	pthread_mutex_init(&rel->mtx, NULL);
+	TAILQ_INIT(&rel->tx_queue);
+	TAILQ_INIT(&rel->hold_queue);
+	rel->node = node;
+	rel->rto = DLMD_REL_RTO_INIT;
+	dlmd_rel_tx_reset(rel);
+
+	pthread_mutex_lock(&rel_list_mtx);
+	SLIST_INSERT_HEAD(&rel_list, rel, next);
+	pthread_mutex_unlock(&rel_list_mtx);
+
+	return rel;
+}
+
+/*
+ * Start new stream to node. Receiver sees new epoch and waits for sequence
+ * numbers from beginning again, whatever it waited for in old stream is
+ * gone. Must be called with rel->mtx held or before rel is published.
+ */
+static void
+dlmd_rel_tx_reset(struct dlmd_rel *rel)
+{
+	uint32_t epoch;
+
+	/* Epoch 0 is reserved for nothing received */
+	do {
+		epoch = arc4random();
+	} while (epoch == 0 || epoch == rel->tx_epoch);
+
+	rel->tx_epoch = epoch;
+	rel->tx_seq = 1;
+}
+
+/*
+ * Fill reliable header with acknowledgement of everything I have received.
+ * Must be called with rel->mtx held.
+ */
+static void
+dlmd_rel_hdr(struct dlmd_rel *rel, char *buf, uint32_t flags, uint32_t seq)
+{
+	uint32_t sack, i;
+
+	sack = 0;
+	for (i = 0; i < DLMD_REL_WINDOW - 1; i++)
+		if (rel->rx_buf[(rel->rx_next + 1 + i) % DLMD_REL_WINDOW] != NULL)
+			sack |= 1U << i;
+
+	buf[0] = DLMD_WIRE_REL_MAGIC;
+	buf[1] = DLMD_WIRE_REL_VERSION;
+	be16enc(buf + 2, flags);
+	be32enc(buf + 4, ntohl(local_node->node_address.sin_addr.s_addr));
+	be32enc(buf + 8, rel->tx_epoch);
+	be32enc(buf + 12, seq);
+	be32enc(buf + 16, rel->rx_epoch);
+	be32enc(buf + 20, rel->rx_next);
+	be32enc(buf + 24, sack);
+
+	rel->ack_pending = 0;
+}
+
+/*
+ * Send datagram to node, with stream transport as frame. conf.loss_percent
+ * of them is dropped to test retransmission. Must be called with rel->mtx
+ * held, so datagrams leave in order of their sequence numbers.
+ */
+static void
+dlmd_rel_xmit(struct dlmd_rel *rel, const char *buf, size_t len)
+{
+	dlmd_node_t *node;
+
+	node = rel->node;
+
+	if (conf.loss_percent != 0 &&
+	    arc4random_uniform(100) < conf.loss_percent) {
+		rel->lost++;
+		return;
+	}
+
+	if (conf.transport == DLMD_TRANSPORT_TCP)
+		dlmd_stream_send(node, buf, len);
+	else
+		sendto(node->node_socket, buf, len, 0,
+		    (struct sockaddr *)&node->node_address,
+		    sizeof(struct sockaddr));
+}
+
+/*
+ * Send binary message or bundle to node reliably.
+ */
+int
+dlmd_rel_send(struct dlmd_rel *rel, const char *buf, size_t buf_len)
+{
+	struct dlmd_rel_pkt *pkt;
+
+	if (buf_len > DLMD_BUNDLE_MAX)
+		return EMSGSIZE;
+
+	if ((pkt = malloc(sizeof(struct dlmd_rel_pkt))) == NULL)
+		return ENOMEM;
+
+	memcpy(pkt->buf + DLMD_WIRE_REL_HDR_LEN, buf, buf_len);
+	pkt->len = DLMD_WIRE_REL_HDR_LEN + buf_len;
+	pkt->retries = 0;
+
+	pthread_mutex_lock(&rel->mtx);
+
+	pkt->seq = rel->tx_seq++;
+	TAILQ_INSERT_TAIL(&rel->hold_queue, pkt, next);
+	rel->held++;
+
+	dlmd_rel_push(rel);
+
+	pthread_mutex_unlock(&rel->mtx);
+
+	return 0;
+}
+
+/*
+ * Transmit held datagrams which fit to window after oldest unacknowledged
+ * one. Must be called with rel->mtx held.
+ */
+static void
+dlmd_rel_push(struct dlmd_rel *rel)
+{
+	struct dlmd_rel_pkt *pkt, *una;
+
+	while ((pkt = TAILQ_FIRST(&rel->hold_queue)) != NULL) {
+		if ((una = TAILQ_FIRST(&rel->tx_queue)) != NULL &&
+		    pkt->seq - una->seq >= DLMD_REL_WINDOW)
+			break;
+
+		TAILQ_REMOVE(&rel->hold_queue, pkt, next);
+		rel->held--;
+
+		pkt->sent = dlmd_rel_now();
+		dlmd_rel_hdr(rel, pkt->buf, DLMD_REL_F_DATA, pkt->seq);
+		TAILQ_INSERT_TAIL(&rel->tx_queue, pkt, next);
+		rel->sent++;
+
+		dlmd_rel_xmit(rel, pkt->buf, pkt->len);
+	}
+}
+
+/*
+ * Update round trip time estimate with new sample, Karn's algorithm is
+ * used so samples are taken from datagrams sent only once.
+ */
+static void
+dlmd_rel_rtt(struct dlmd_rel *rel, uint64_t rtt)
+{
+	uint64_t delta;
+
+	if (rel->srtt == 0) {
+		rel->srtt = rtt;
+		rel->rttvar = rtt / 2;
+	} else {
+		delta = (rel->srtt > rtt) ? rel->srtt - rtt : rtt - rel->srtt;
+		rel->rttvar = (3 * rel->rttvar + delta) / 4;
+		rel->srtt = (7 * rel->srtt + rtt) / 8;
+	}
+
+	rel->rto = rel->srtt + 4 * rel->rttvar;
+	if (rel->rto < DLMD_REL_RTO_MIN)
+		rel->rto = DLMD_REL_RTO_MIN;
+	if (rel->rto > DLMD_REL_RTO_MAX)
+		rel->rto = DLMD_REL_RTO_MAX;
+}
+
+/*
+ * Remove datagrams acknowledged by node from transmit queue. Must be called
+ * with rel->mtx held.
+ */
+static void
+dlmd_rel_ack(struct dlmd_rel *rel, uint32_t ack, uint32_t sack)
+{
+	struct dlmd_rel_pkt *pkt, *tmp;
+	uint32_t off;
+	uint64_t now;
+
+	now = dlmd_rel_now();
+
+	TAILQ_FOREACH_SAFE(pkt, &rel->tx_queue, next, tmp) {
+		off = pkt->seq - ack;
+
+		/* off is 0 for ack itself, node still waits for it */
+		if ((int32_t)off >= 0 &&
+		    (off == 0 || off >= DLMD_REL_WINDOW || !(sack & (1U << (off - 1)))))
+			continue;
+
+		if (pkt->retries == 0)
+			dlmd_rel_rtt(rel, now - pkt->sent);
+
+		TAILQ_REMOVE(&rel->tx_queue, pkt, next);
+		free(pkt);
+	}
+}
+
+/*
+ * Node started new stream, probably it was restarted or I have just
+ * started. Datagrams lost at beginning of stream are waited for, otherwise
+ * I can't know what was lost before first datagram I see and stream starts
+ * with it.
+ */
+static void
+dlmd_rel_rx_reset(struct dlmd_rel *rel, uint32_t epoch, uint32_t seq)
+{
+	int i;
+
+	DPRINTF(("Node %s started new stream %u at %u\n", rel->node->node_name,
+		epoch, seq));
+
+	for (i = 0; i < DLMD_REL_WINDOW; i++) {
+		free(rel->rx_buf[i]);
+		rel->rx_buf[i] = NULL;
+	}
+
+	rel->rx_epoch = epoch;
+	rel->rx_next = (seq <= DLMD_REL_WINDOW) ? 1 : seq;
+}
+
+/*
+ * Parse received reliable datagram. Acknowledgements are applied to my
+ * transmit queue and data which can be delivered in order is passed to
+ * deliver, after gap is filled buffered datagrams are delivered too.
+ */
+int
+dlmd_rel_input(const char *buf, size_t buf_len,
+    int (*deliver)(const char *, size_t))
+{
+	char out[DLMD_WIRE_REL_HDR_LEN];
+	char *data[DLMD_REL_WINDOW];
+	size_t data_len[DLMD_REL_WINDOW];
+	dlmd_node_t *node;
+	struct dlmd_rel *rel;
+	uint32_t flags, node_id, epoch, seq, ack_epoch, ack, sack, off, slot;
+	int i, n, ack_now;
+
+	if (buf_len < DLMD_WIRE_REL_HDR_LEN ||
+	    (uint8_t)buf[1] < DLMD_WIRE_REL_VERSION)
+		return -1;
+
+	flags = be16dec(buf + 2);
+	node_id = htonl(be32dec(buf + 4));
+	epoch = be32dec(buf + 8);
+	seq = be32dec(buf + 12);
+	ack_epoch = be32dec(buf + 16);
+	ack = be32dec(buf + 20);
+	sack = be32dec(buf + 24);
+
+	if ((node = dlmd_node_find(ntohl(node_id), NULL)) == NULL ||
+	    (rel = node->rel) == NULL)
+		return -1;
+
+	/* Sender talks reliable datagrams, so it knows bundles too */
+	if (node->wire_version < DLMD_WIRE_REL_VERSION)
+		node->wire_version = DLMD_WIRE_REL_VERSION;
+
+	n = 0;
+	ack_now = 0;
+
+	pthread_mutex_lock(&rel->mtx);
+
+	if (ack_epoch == rel->tx_epoch) {
+		dlmd_rel_ack(rel, ack, sack);
+		dlmd_rel_push(rel);
+	}
+
+	if (flags & DLMD_REL_F_DATA) {
+		if (epoch != rel->rx_epoch)
+			dlmd_rel_rx_reset(rel, epoch, seq);
+
+		off = seq - rel->rx_next;
+		rel->ack_pending = 1;
+
+		if ((int32_t)off < 0) {
+			/* My acknowledgement was lost, tell node again */
+			rel->duplicates++;
+			ack_now = 1;
+		} else if (off >= DLMD_REL_WINDOW) {
+			/* Too far ahead, node will send it again */
+			ack_now = 1;
+		} else if (off == 0) {
+			data[n] = __UNCONST(buf + DLMD_WIRE_REL_HDR_LEN);
+			data_len[n++] = buf_len - DLMD_WIRE_REL_HDR_LEN;
+			rel->rx_next++;
+
+			/* Gap is filled, take datagrams buffered behind it */
+			slot = rel->rx_next % DLMD_REL_WINDOW;
+			while (rel->rx_buf[slot] != NULL) {
+				data[n] = rel->rx_buf[slot];
+				data_len[n++] = rel->rx_len[slot];
+				rel->rx_buf[slot] = NULL;
+				slot = ++rel->rx_next % DLMD_REL_WINDOW;
+			}
+		} else if (rel->rx_buf[seq % DLMD_REL_WINDOW] != NULL) {
+			rel->duplicates++;
+			ack_now = 1;
+		} else {
+			slot = seq % DLMD_REL_WINDOW;
+			if ((rel->rx_buf[slot] = malloc(buf_len -
+			    DLMD_WIRE_REL_HDR_LEN + 1)) != NULL) {
+				rel->rx_len[slot] = buf_len - DLMD_WIRE_REL_HDR_LEN;
+				memcpy(rel->rx_buf[slot], buf + DLMD_WIRE_REL_HDR_LEN,
+				    rel->rx_len[slot]);
+				/* Plist parser needs NUL */
+				rel->rx_buf[slot][rel->rx_len[slot]] = '\0';
+			}
+			/* Sack tells node about the gap right away */
+			ack_now = 1;
+		}
+	}
+
+	if (ack_now) {
+		dlmd_rel_hdr(rel, out, 0, 0);
+		dlmd_rel_xmit(rel, out, DLMD_WIRE_REL_HDR_LEN);
+	}
+
+	pthread_mutex_unlock(&rel->mtx);
+
+	dlmd_node_unbusy(node);
+
+	/* Deliver without rel->mtx, handlers send messages to node */
+	for (i = 0; i < n; i++) {
+		deliver(data[i], data_len[i]);
+		if (i != 0)
+			free(data[i]);
+	}
+
+	return 0;
+}
+
+/*
+ * Retransmit datagrams which weren't acknowledged within retransmit
+ * timeout and send delayed acknowledgement.
+ */
+static void
+dlmd_rel_timer(struct dlmd_rel *rel, uint64_t now)
+{
+	char out[DLMD_WIRE_REL_HDR_LEN];
+	struct dlmd_rel_pkt *pkt, *tmp;
+	int expired;
+
+	expired = 0;
+
+	pthread_mutex_lock(&rel->mtx);
+
+	/*
+	 * Nobody listens to dead node, keepalive tells me when it is back.
+	 * Node would wait for dropped datagrams forever, new stream starts.
+	 */
+	if (rel->node->alive_flag <= 0 && (!TAILQ_EMPTY(&rel->tx_queue) ||
+	    !TAILQ_EMPTY(&rel->hold_queue))) {
+		DPRINTF(("Node %s is dead, dropping its unacknowledged datagrams\n",
+			rel->node->node_name));
+		TAILQ_FOREACH_SAFE(pkt, &rel->tx_queue, next, tmp) {
+			TAILQ_REMOVE(&rel->tx_queue, pkt, next);
+			free(pkt);
+		}
+		TAILQ_FOREACH_SAFE(pkt, &rel->hold_queue, next, tmp) {
+			TAILQ_REMOVE(&rel->hold_queue, pkt, next);
+			free(pkt);
+		}
+		rel->held = 0;
+		dlmd_rel_tx_reset(rel);
+	}
+
+	TAILQ_FOREACH(pkt, &rel->tx_queue, next) {
+		if (now - pkt->sent < rel->rto)
+			continue;
+
+		dlmd_rel_hdr(rel, pkt->buf, DLMD_REL_F_DATA, pkt->seq);
+		dlmd_rel_xmit(rel, pkt->buf, pkt->len);
+
+		pkt->sent = now;
+		pkt->retries++;
+		rel->retransmits++;
+		expired = 1;
+	}
+
+	/* Back off, network is congested or node is slow */
+	if (expired) {
+		rel->rto *= 2;
+		if (rel->rto > DLMD_REL_RTO_MAX)
+			rel->rto = DLMD_REL_RTO_MAX;
+	}
+
+	if (rel->ack_pending) {
+		dlmd_rel_hdr(rel, out, 0, 0);
+		dlmd_rel_xmit(rel, out, DLMD_WIRE_REL_HDR_LEN);
+	}
+
+	pthread_mutex_unlock(&rel->mtx);
+}
+
+/*
+ * Timer thread, every DLMD_REL_TICK_USEC it checks retransmit timeouts and
+ * sends delayed acknowledgements of all nodes. It runs even when
+ * conf.reliable is off, other nodes may still send reliable datagrams to me.
+ */
+void *
+dlmd_rel_timer_start(void *arg)
+{
+	struct timespec ts;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = DLMD_REL_TICK_USEC * 1000;
+
+	while (1) {
+		nanosleep(&ts, NULL);
+
+		dlmd_rel_event(0, arg);
+	}
+
+	return NULL;
+}
+
+/*
+ * One timer tick, called from timer thread or event loop timer.
+ */
+void
+dlmd_rel_event(int ident, void *arg)
+{
+	struct dlmd_rel *rel;
+
+	/* Nodes are never removed, so list doesn't change under me */
+	SLIST_FOREACH(rel, &rel_list, next)
+		dlmd_rel_timer(rel, dlmd_rel_now());
+}
+
+/*
+ * Print retransmit counters and round trip times.
+ */
+void
+dlmd_rel_stats()
+{
+	struct dlmd_rel *rel;
+
+	pthread_mutex_lock(&rel_list_mtx);
+
+	SLIST_FOREACH(rel, &rel_list, next) {
+		pthread_mutex_lock(&rel->mtx);
+		printf("Node %s sent %"PRIu64" retransmits %"PRIu64
+		    " duplicates %"PRIu64" lost %"PRIu64" held %u srtt %"PRIu64
+		    "us rttvar %"PRIu64"us rto %"PRIu64"us\n",
+		    rel->node->node_name, rel->sent, rel->retransmits,
+		    rel->duplicates, rel->lost, rel->held, rel->srtt, rel->rttvar,
+		    rel->rto);
+		pthread_mutex_unlock(&rel->mtx);
+	}
+
+	pthread_mutex_unlock(&rel_list_mtx);
+}
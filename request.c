@@ -11,6 +11,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <prop/proplib.h>
@@ -24,354 +26,2241 @@
 
 extern dlmd_node_t *local_node;
 
-struct dlmd_lock_head lock_list;
-pthread_mutex_t lock_list_mtx;
+/*
+ * Lock table is partitioned to shards by resource hash. Every shard has its
+ * own mutex which guards resources hashed to it, their request queues and
+ * locks on them, so operations on different resources doesn't fight for one
+ * global mutex. Resources are hashed by name and locks by lock id inside of
+ * shard, so I don't need to walk all outstanding locks for every message.
+ *
+ * Lock id carries shard index in its low bits, so I can find lock shard
+ * from lock id alone. It is returned as int by lock.h, so counter in upper
+ * bits wraps before lock id gets past INT_MAX.
+ *
+ * XXX Lock which lives through whole wrap of counter shares its id with new
+ *     one.
+ */
+
+/*
+ * Message to other node generated by lock table, grant of remote request
+ * in master engine or deferred reply in ricart engine. It is queued on
+ * shard while mutex is held and sent after mutex is released.
+ */
+struct dlmd_lock_notify {
+	dlmd_node_t *node;
+	dlmd_msg_t msg;
+	STAILQ_ENTRY(dlmd_lock_notify) next;
+};
+
+STAILQ_HEAD(dlmd_lock_notify_head, dlmd_lock_notify);
+
+/*
+ * Finished asynchronous request. Its callback is called and descriptor
+ * signaled after shard mutex is released, like notify messages.
+ */
+struct dlmd_lock_done {
+	uint64_t lock_id;
+	int status;
+	void (*ast)(int, int, void *);
+	void *ast_arg;
+	int ast_fd;
+	STAILQ_ENTRY(dlmd_lock_done) next;
+};
+
+STAILQ_HEAD(dlmd_lock_done_head, dlmd_lock_done);
+
+typedef struct dlmd_lock_shard {
+	pthread_mutex_t mtx;
+	struct dlmd_resource_bucket *res_hash;
+	struct dlmd_lock_bucket *id_hash;
+	struct dlmd_lock_notify_head notify;	/* messages to send at exit */
+	struct dlmd_lock_done_head done;	/* async completions at exit */
+	uint64_t acquired;		/* mutex acquisitions */
+	uint64_t contended;		/* acquisitions which had to sleep */
+} __aligned(DLMD_CACHE_LINE) dlmd_lock_shard_t;
+
+static dlmd_lock_shard_t *lock_shards;
+static uint32_t shard_bits;	/* log2 of number of shards */
+static uint32_t shard_mask;
+static uint64_t lck_id_mask;	/* counter bits of lock id */
+static uint32_t bucket_mask;	/* buckets per shard - 1 */
+static uint32_t lock_engine;	/* DLMD_ENGINE_* */
+static uint64_t token_sent;	/* tokens passed to other nodes */
+static uint64_t token_recv;	/* tokens received from other nodes */
+
+#define DLMD_LOCK_REF(lock) ((lock)->ref != 0 ? (lock)->ref : (lock)->event_cnt)
+
+uint64_t lck_id;
+
+/*
+ * Blocking callback, it tells user to unlock cached lock which blocks
+ * request of other node.
+ */
+static void (*lock_bast)(const char *, int, int, void *);
+static void *lock_bast_arg;
+
+/*
+ * Threads in dlmd_lock_wait_any sleep here, every async completion wakes
+ * them all.
+ */
+static pthread_mutex_t async_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cv = PTHREAD_COND_INITIALIZER;
+static uint64_t async_done;
+
+/*
+ * Cached locks found in conflict with new request, they are released or
+ * their owners notified after shard mutex is dropped.
+ */
+struct dlmd_lock_drop {
+	uint64_t lock_id;
+	uint32_t mode;
+	int idle;
+	SLIST_ENTRY(dlmd_lock_drop) next;
+	char name[];
+};
+
+SLIST_HEAD(dlmd_lock_drop_head, dlmd_lock_drop);
+
+static dlmd_lock_shard_t* dlmd_lock_shard(uint32_t);
+static dlmd_lock_shard_t* dlmd_lock_shard_id(uint64_t);
+static void dlmd_lock_shard_enter(dlmd_lock_shard_t *);
+static void dlmd_lock_shard_exit(dlmd_lock_shard_t *);
+static dlmd_msg_t* dlmd_lock_notify_queue(dlmd_lock_shard_t *, dlmd_node_t *, uint32_t, const char *);
+static void dlmd_lock_done_queue(dlmd_lock_shard_t *, dlmd_lock_t *, int);
+static void dlmd_lock_master_request(dlmd_lock_t *);
+static dlmd_lock_t* dlmd_lock_alloc(const char *);
+static dlmd_lock_t* dlmd_lock_find_id(dlmd_lock_shard_t *, uint64_t);
+static dlmd_lock_t* dlmd_lock_find_ref(dlmd_lock_shard_t *, const char *, uint32_t, uint64_t);
+static void dlmd_lock_destroy(dlmd_lock_t *);
+static int dlmd_lock_cmp(dlmd_lock_t *, dlmd_lock_t *);
+static void dlmd_lock_queue_insert(struct dlmd_lock_head *, dlmd_lock_t *);
+static void dlmd_lock_activate(dlmd_lock_t *);
+static void dlmd_lock_unlink(dlmd_lock_t *);
+static int dlmd_lock_release_held(dlmd_lock_shard_t *, dlmd_lock_t *, int);
+static dlmd_resource_t* dlmd_resource_find(dlmd_lock_shard_t *, const char *, uint32_t);
+static dlmd_resource_t* dlmd_resource_get(dlmd_lock_shard_t *, const char *, uint32_t);
+static void dlmd_resource_put(dlmd_resource_t *);
+static int dlmd_resource_compat(dlmd_resource_t *, uint32_t);
+static void dlmd_resource_grant(dlmd_resource_t *);
+static void dlmd_resource_ungrant(dlmd_resource_t *, dlmd_lock_t *);
+static int dlmd_resource_convert_compat(dlmd_resource_t *, dlmd_lock_t *);
+static void dlmd_lock_convert_insert(dlmd_resource_t *, dlmd_lock_t *);
+static void dlmd_lock_convert_done(dlmd_resource_t *, dlmd_lock_t *, int);
+static int dlmd_lock_convert_deadlock(dlmd_resource_t *, dlmd_lock_t *);
+static void dlmd_lock_convert_check(dlmd_lock_t *);
+static void dlmd_resource_uncache(dlmd_resource_t *, uint32_t, struct dlmd_lock_drop_head *);
+static int dlmd_resource_defer_check(dlmd_resource_t *, uint64_t, uint32_t, uint32_t);
+static void dlmd_resource_undefer(dlmd_lock_shard_t *, dlmd_resource_t *);
+static void dlmd_resource_token_init(dlmd_resource_t *);
+static int dlmd_resource_token_queue(dlmd_resource_t *, uint32_t);
+static void dlmd_resource_token_yield(dlmd_resource_t *);
+static void dlmd_resource_token_pass(dlmd_lock_shard_t *, dlmd_resource_t *);
+static void dlmd_resource_token_take(dlmd_lock_shard_t *, dlmd_resource_t *);
+static void dlmd_lock_drop(struct dlmd_lock_drop_head *);
+static void dump_lock(dlmd_lock_t *);
+static void dump_list();
+
+static void
+dump_lock(dlmd_lock_t *lock)
+{
+	printf("Lock name %s %p\n", lock->name, lock);
+	printf("Lock mode %d, flags %d, type %d, state %d\n", lock->mode, lock->flags,
+	    lock->type, lock->state);
+	printf("Lock id %"PRIu64"\n", lock->lock_id);
+	printf("Timestamp %"PRIu64"\n", lock->event_cnt);
+	printf("Node id %#x\n", lock->node_id);
+	printf("Node Count %d\n", lock->node_count);
+	printf("Previsious lock %p\n", TAILQ_PREV(lock, dlmd_lock_head, next));
+	printf("Next lock %p\n", TAILQ_NEXT(lock, next));
+	printf("Owner node %s %p\n", lock->node->node_name, lock->node);
+
+	printf("------------------------\n");
+}
+
+static void
+dump_list()
+{
+#ifdef DLMD_LOCK_DEBUG
+	dlmd_lock_shard_t *shard;
+	dlmd_resource_t *res;
+	dlmd_lock_t *lock;
+	uint32_t i, j;
+
+	printf("\n------------------------------------------------------\n");
+	for (i = 0; i <= shard_mask; i++) {
+		shard = &lock_shards[i];
+		pthread_mutex_lock(&shard->mtx);
+		for (j = 0; j <= bucket_mask; j++) {
+			LIST_FOREACH(res, &shard->res_hash[j], hash_next) {
+				printf("Resource %s %p, hash %#x, shard %u\n", res->name, res, res->hash, i);
+				TAILQ_FOREACH(lock, &res->grant_queue, next)
+					dump_lock(lock);
+				TAILQ_FOREACH(lock, &res->wait_queue, next)
+					dump_lock(lock);
+			}
+		}
+		dlmd_lock_shard_exit(shard);
+	}
+	printf("------------------------------------------------------\n\n");
+#endif
+}
+
+/*
+ * Print shard mutex statistics, contended/acquired ratio tells if
+ * lock_shards in config file should be increased. Resources where more than
+ * threshold requests had to wait are candidates for token mode.
+ */
+void
+dlmd_lock_stats(uint32_t threshold)
+{
+	dlmd_lock_shard_t *shard;
+	dlmd_resource_t *res;
+	uint32_t i, j;
+
+	printf("Lock table shards %u\n", shard_mask + 1);
+	for (i = 0; i <= shard_mask; i++) {
+		shard = &lock_shards[i];
+		printf("shard %3u acquired %"PRIu64" contended %"PRIu64"\n",
+		    i, shard->acquired, shard->contended);
+	}
+
+	printf("Tokens sent %"PRIu64" received %"PRIu64"\n", token_sent, token_recv);
+	printf("Async requests finished %"PRIu64"\n", async_done);
+
+	/* Not counted in shard statistics printed above */
+	for (i = 0; i <= shard_mask; i++) {
+		shard = &lock_shards[i];
+		pthread_mutex_lock(&shard->mtx);
+		for (j = 0; j <= bucket_mask; j++) {
+			LIST_FOREACH(res, &shard->res_hash[j], hash_next) {
+				if (res->token != 0)
+					printf("resource %s token %s queue %u contended %"PRIu64"\n",
+					    res->name, (res->token & DLMD_TOKEN_HELD) ? "held" : "remote",
+					    res->token_qlen, res->contended);
+				else if (res->contended >= threshold)
+					printf("resource %s contended %"PRIu64", token mode candidate\n",
+					    res->name, res->contended);
+			}
+		}
+		pthread_mutex_unlock(&shard->mtx);
+	}
+}
+
+/*
+ * Get shard for resource hash.
+ */
+static dlmd_lock_shard_t *
+dlmd_lock_shard(uint32_t hash)
+{
+	return &lock_shards[hash & shard_mask];
+}
+
+static dlmd_lock_shard_t *
+dlmd_lock_shard_id(uint64_t id)
+{
+	return &lock_shards[id & shard_mask];
+}
+
+/*
+ * Lock shard mutex, count how many times I had to wait for it.
+ */
+static void
+dlmd_lock_shard_enter(dlmd_lock_shard_t *shard)
+{
+	if (pthread_mutex_trylock(&shard->mtx) != 0) {
+		pthread_mutex_lock(&shard->mtx);
+		shard->contended++;
+	}
+
+	shard->acquired++;
+}
+
+/*
+ * Unlock shard mutex and send messages queued while I held it, so I never
+ * wait for network with shard mutex held.
+ */
+static void
+dlmd_lock_shard_exit(dlmd_lock_shard_t *shard)
+{
+	struct dlmd_lock_notify_head notify;
+	struct dlmd_lock_done_head done;
+	struct dlmd_lock_notify *n;
+	struct dlmd_lock_done *d;
+
+	STAILQ_INIT(&notify);
+	STAILQ_CONCAT(&notify, &shard->notify);
+	STAILQ_INIT(&done);
+	STAILQ_CONCAT(&done, &shard->done);
+
+	pthread_mutex_unlock(&shard->mtx);
+
+	while ((n = STAILQ_FIRST(&notify)) != NULL) {
+		STAILQ_REMOVE_HEAD(&notify, next);
+
+		n->msg.event = dlmd_event_cnt_inc();
+		dlmd_msg_unicast(n->node, &n->msg);
+
+		dlmd_msg_fini(&n->msg);
+		free(n);
+	}
+
+	while ((d = STAILQ_FIRST(&done)) != NULL) {
+		STAILQ_REMOVE_HEAD(&done, next);
+
+		dlmd_lock_async_done(d->lock_id, d->status, d->ast, d->ast_arg,
+		    d->ast_fd);
+
+		free(d);
+	}
+}
+
+/*
+ * Queue completion of async request. Must be called with shard mutex held.
+ */
+static void
+dlmd_lock_done_queue(dlmd_lock_shard_t *shard, dlmd_lock_t *lock, int status)
+{
+	struct dlmd_lock_done *d;
+
+	if (!lock->async)
+		return;
+
+	/* Only first completion counts */
+	lock->async = 0;
+
+	if ((d = malloc(sizeof(struct dlmd_lock_done))) == NULL)
+		err(EXIT_FAILURE, "Allocation of lock completion failed\n");
+
+	d->lock_id = lock->lock_id;
+	d->status = status;
+	d->ast = lock->ast;
+	d->ast_arg = lock->ast_arg;
+	d->ast_fd = lock->ast_fd;
+
+	STAILQ_INSERT_TAIL(&shard->done, d, next);
+}
+
+/*
+ * Report finished async request lock_id: call its callback, add 1 to
+ * eventfd-like counter in fd and wake threads in dlmd_lock_wait_any. Must
+ * be called without shard mutex.
+ */
+void
+dlmd_lock_async_done(uint64_t lock_id, int status, void (*ast)(int, int, void *),
+    void *arg, int fd)
+{
+	uint64_t one;
+
+	if (ast != NULL)
+		ast(lock_id, status, arg);
+
+	if (fd != -1) {
+		one = 1;
+		if (write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			DPRINTF(("Signaling lock completion descriptor %d failed\n", fd));
+	}
+
+	pthread_mutex_lock(&async_mtx);
+	async_done++;
+	pthread_cond_broadcast(&async_cv);
+	pthread_mutex_unlock(&async_mtx);
+}
+
+/*
+ * Queue message of type for node about resource name, caller fills the
+ * rest of returned message. Must be called with shard mutex held.
+ */
+static dlmd_msg_t *
+dlmd_lock_notify_queue(dlmd_lock_shard_t *shard, dlmd_node_t *node,
+    uint32_t type, const char *name)
+{
+	struct dlmd_lock_notify *n;
+
+	if ((n = malloc(sizeof(struct dlmd_lock_notify))) == NULL)
+		err(EXIT_FAILURE, "Allocation of notify message failed\n");
+
+	n->node = node;
+	dlmd_msg_init(&n->msg, type, name);
+
+	STAILQ_INSERT_TAIL(&shard->notify, n, next);
+
+	return &n->msg;
+}
+
+/*
+ * FNV-1a hash of resource name.
+ */
+uint32_t
+dlmd_lock_hash(const char *name)
+{
+	const uint8_t *p;
+	uint32_t hash;
+
+	hash = 2166136261U;
+
+	for (p = (const uint8_t *)name; *p != '\0'; p++) {
+		hash ^= *p;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/*
+ * Lock mode compatibility matrix, lock modes are translated to matrix index
+ * with ffs(mode) - 1.
+ */
+static const uint8_t lock_compat[DLMD_LOCK_MODES][DLMD_LOCK_MODES] = {
+	/*        NL CR CW PR PW EX */
+	/* NL */ { 1, 1, 1, 1, 1, 1 },
+	/* CR */ { 1, 1, 1, 1, 1, 0 },
+	/* CW */ { 1, 1, 1, 0, 0, 0 },
+	/* PR */ { 1, 1, 0, 1, 0, 0 },
+	/* PW */ { 1, 1, 0, 0, 0, 0 },
+	/* EX */ { 1, 0, 0, 0, 0, 0 },
+};
+
+/*
+ * Check that mode is exactly one of LKM_*MODE.
+ */
+int
+dlmd_lock_mode_valid(uint32_t mode)
+{
+	return mode != 0 && (mode & (mode - 1)) == 0 && mode <= LKM_EXMODE;
+}
+
+int
+dlmd_lock_compat(uint32_t mode1, uint32_t mode2)
+{
+	return lock_compat[ffs(mode1) - 1][ffs(mode2) - 1];
+}
+
+/*
+ * Check if conversion from mode old to mode new is downgrade, new mode
+ * doesn't conflict with anything old mode doesn't conflict with.
+ */
+int
+dlmd_lock_mode_weaker(uint32_t old, uint32_t new)
+{
+	int i;
+
+	for (i = 0; i < DLMD_LOCK_MODES; i++)
+		if (lock_compat[ffs(old) - 1][i] && !lock_compat[ffs(new) - 1][i])
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Check if mode is compatible with all locks in granted group of resource.
+ */
+static int
+dlmd_resource_compat(dlmd_resource_t *res, uint32_t mode)
+{
+	int i;
+
+	for (i = 0; i < DLMD_LOCK_MODES; i++)
+		if (res->grant_cnt[i] != 0 && !lock_compat[i][ffs(mode) - 1])
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Lamport total order of requests, compare timestamps first and use node
+ * id to order requests with same timestamp.
+ */
+static int
+dlmd_lock_cmp(dlmd_lock_t *a, dlmd_lock_t *b)
+{
+	if (a->event_cnt != b->event_cnt)
+		return a->event_cnt < b->event_cnt ? -1 : 1;
+
+	if (a->node_id != b->node_id)
+		return a->node_id < b->node_id ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Insert lock to queue sorted by (event_cnt, node_id). New requests have
+ * usually the highest timestamp, therefore I search from the tail.
+ */
+static void
+dlmd_lock_queue_insert(struct dlmd_lock_head *queue, dlmd_lock_t *lock)
+{
+	dlmd_lock_t *lock2;
+
+	TAILQ_FOREACH_REVERSE(lock2, queue, dlmd_lock_head, next) {
+		if (dlmd_lock_cmp(lock2, lock) < 0)
+			break;
+	}
+
+	if (lock2 == NULL)
+		TAILQ_INSERT_HEAD(queue, lock, next);
+	else
+		TAILQ_INSERT_AFTER(queue, lock2, lock, next);
+}
+
+/*
+ * Local lock can enter critical section when it is in granted group of
+ * its resource and it got replies from all nodes. After that no older
+ * request can arrive, because all nodes have already seen mine.
+ */
+static void
+dlmd_lock_activate(dlmd_lock_t *lock)
+{
+	dlmd_msg_t *msg;
+
+	/* Master grants remote request, it is active since now */
+	if (lock_engine == DLMD_ENGINE_MASTER && lock->state == DLMD_LOCK_GRANTED &&
+	    (lock->type & DLMD_LOCK_REMOTE)) {
+		lock->state = DLMD_LOCK_ACTIVE;
+
+		msg = dlmd_lock_notify_queue(dlmd_lock_shard(lock->hash),
+		    lock->node, DLMD_MSG_GRANT, lock->name);
+		msg->ref = lock->ref;
+		msg->mode = lock->mode;
+		return;
+	}
+
+	if (lock->state != DLMD_LOCK_GRANTED || lock->node_count != 0 ||
+	    !(lock->type & DLMD_LOCK_LOCAL) || lock->status != 0)
+		return;
+
+	lock->state = DLMD_LOCK_ACTIVE;
+	pthread_cond_signal(&lock->lock_cv);
+
+	dlmd_lock_done_queue(dlmd_lock_shard(lock->hash), lock, 0);
+}
+
+/*
+ * Move lock from granted group back to wait queue.
+ */
+static void
+dlmd_resource_ungrant(dlmd_resource_t *res, dlmd_lock_t *lock)
+{
+	TAILQ_REMOVE(&res->grant_queue, lock, next);
+	res->grant_cnt[ffs(lock->mode) - 1]--;
+
+	lock->state = DLMD_LOCK_WAITING;
+	dlmd_lock_queue_insert(&res->wait_queue, lock);
+}
+
+/*
+ * Check if converting lock is compatible with all other granted locks.
+ */
+static int
+dlmd_resource_convert_compat(dlmd_resource_t *res, dlmd_lock_t *lock)
+{
+	uint32_t cnt;
+	int i;
+
+	for (i = 0; i < DLMD_LOCK_MODES; i++) {
+		cnt = res->grant_cnt[i];
+		if (i == ffs(lock->mode) - 1)
+			cnt--;
+		if (cnt != 0 && !lock_compat[i][ffs(lock->convert_mode) - 1])
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Insert lock to convert queue sorted by (convert_event, node_id).
+ */
+static void
+dlmd_lock_convert_insert(dlmd_resource_t *res, dlmd_lock_t *lock)
+{
+	dlmd_lock_t *lock2;
+
+	TAILQ_FOREACH_REVERSE(lock2, &res->convert_queue, dlmd_lock_head, conv_next) {
+		if (lock2->convert_event < lock->convert_event ||
+		    (lock2->convert_event == lock->convert_event &&
+		    lock2->node_id < lock->node_id))
+			break;
+	}
+
+	if (lock2 == NULL)
+		TAILQ_INSERT_HEAD(&res->convert_queue, lock, conv_next);
+	else
+		TAILQ_INSERT_AFTER(&res->convert_queue, lock2, lock, conv_next);
+}
+
+/*
+ * Finish conversion, with status 0 lock gets its new mode otherwise it
+ * keeps the old one. Owner of local lock is woken up.
+ */
+static void
+dlmd_lock_convert_done(dlmd_resource_t *res, dlmd_lock_t *lock, int status)
+{
+	TAILQ_REMOVE(&res->convert_queue, lock, conv_next);
+
+	if (status == 0) {
+		res->grant_cnt[ffs(lock->mode) - 1]--;
+		res->grant_cnt[ffs(lock->convert_mode) - 1]++;
+		lock->mode = lock->convert_mode;
+	}
+
+	lock->convert_mode = 0;
+	lock->convert_status = status;
+
+	if (lock->type & DLMD_LOCK_LOCAL)
+		pthread_cond_signal(&lock->lock_cv);
+}
+
+/*
+ * Two holders converting to modes incompatible with mode of the other one
+ * would wait for each other forever. Older conversion wins, younger one is
+ * refused with EDEADLK. Only owner decides this, after it got replies from
+ * all nodes it knows about all older conversions.
+ */
+static int
+dlmd_lock_convert_deadlock(dlmd_resource_t *res, dlmd_lock_t *lock)
+{
+	dlmd_lock_t *lock2;
+
+	TAILQ_FOREACH(lock2, &res->convert_queue, conv_next) {
+		if (lock2 == lock)
+			break;
+		if (!dlmd_lock_compat(lock2->convert_mode, lock->mode))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Local conversion which got all replies either deadlocks or it is
+ * granted by dlmd_resource_grant when it gets to the head of convert queue.
+ */
+static void
+dlmd_lock_convert_check(dlmd_lock_t *lock)
+{
+	if (lock->node_count != 0 || lock->convert_mode == 0)
+		return;
+
+	if (dlmd_lock_convert_deadlock(lock->res, lock))
+		dlmd_lock_convert_done(lock->res, lock, EDEADLK);
+	else
+		dlmd_resource_grant(lock->res);
+}
+
+/*
+ * Grant pending conversions first, new requests are granted only when there
+ * is no conversion waiting. Then grant all requests from head of wait queue,
+ * which are compatible with granted group. I stop at first incompatible
+ * request so newer requests can't starve older ones.
+ */
+static void
+dlmd_resource_grant(dlmd_resource_t *res)
+{
+	dlmd_lock_t *lock;
+
+	while ((lock = TAILQ_FIRST(&res->convert_queue)) != NULL) {
+		if (!dlmd_resource_convert_compat(res, lock))
+			break;
+
+		/* Local conversion has to wait for replies from all nodes */
+		if ((lock->type & DLMD_LOCK_LOCAL) && lock->node_count != 0)
+			break;
+
+		dlmd_lock_convert_done(res, lock, 0);
+	}
+
+	if (!TAILQ_EMPTY(&res->convert_queue))
+		return;
+
+	while ((lock = TAILQ_FIRST(&res->wait_queue)) != NULL) {
+		if (!dlmd_resource_compat(res, lock->mode))
+			break;
+
+		TAILQ_REMOVE(&res->wait_queue, lock, next);
+		dlmd_lock_queue_insert(&res->grant_queue, lock);
+		res->grant_cnt[ffs(lock->mode) - 1]++;
+
+		lock->state = DLMD_LOCK_GRANTED;
+		dlmd_lock_activate(lock);
+	}
+}
+
+static dlmd_resource_t *
+dlmd_resource_find(dlmd_lock_shard_t *shard, const char *name, uint32_t hash)
+{
+	dlmd_resource_t *res;
+
+	LIST_FOREACH(res, &shard->res_hash[(hash >> shard_bits) & bucket_mask], hash_next) {
+		if (res->hash == hash && strcmp(name, res->name) == 0)
+			return res;
+	}
+
+	return NULL;
+}
+
+/*
+ * Find resource or create new one if it doesn't exist.
+ */
+static dlmd_resource_t *
+dlmd_resource_get(dlmd_lock_shard_t *shard, const char *name, uint32_t hash)
+{
+	dlmd_resource_t *res;
+	size_t len;
+
+	if ((res = dlmd_resource_find(shard, name, hash)) != NULL)
+		return res;
+
+	len = strlen(name) + 1;
+
+	if ((res = malloc(sizeof(dlmd_resource_t) + len)) == NULL)
+		err(EXIT_FAILURE, "Allocation of resource failed\n");
+	memset(res, '\0', sizeof(dlmd_resource_t));
+
+	memcpy(res->name, name, len);
+	res->hash = hash;
+	TAILQ_INIT(&res->grant_queue);
+	TAILQ_INIT(&res->wait_queue);
+	TAILQ_INIT(&res->convert_queue);
+	TAILQ_INIT(&res->deferred);
+
+	LIST_INSERT_HEAD(&shard->res_hash[(hash >> shard_bits) & bucket_mask],
+	    res, hash_next);
+
+	return res;
+}
+
+/*
+ * Destroy resource when there are no more requests for it.
+ */
+static void
+dlmd_resource_put(dlmd_resource_t *res)
+{
+	if (!TAILQ_EMPTY(&res->grant_queue) || !TAILQ_EMPTY(&res->wait_queue) ||
+	    !TAILQ_EMPTY(&res->convert_queue) || !TAILQ_EMPTY(&res->deferred))
+		return;
+
+	/* Token resources stay, other nodes know I have seen token */
+	if (res->token != 0)
+		return;
+
+	/* XXX lock value block keeps resource alive until daemon exits */
+	if (res->lvb_seq != 0)
+		return;
+
+	LIST_REMOVE(res, hash_next);
+	free(res);
+}
+
+/*
+ * Find lock of node_id with request timestamp ref on resource name. Old
+ * plist nodes doesn't send ref, in that case I take the oldest lock of node.
+ * Remote locks of master engine are referenced by lock id of requester.
+ */
+static dlmd_lock_t *
+dlmd_lock_find_ref(dlmd_lock_shard_t *shard, const char *name, uint32_t node_id,
+    uint64_t ref)
+{
+	dlmd_resource_t *res;
+	dlmd_lock_t *lock;
+
+	if ((res = dlmd_resource_find(shard, name, dlmd_lock_hash(name))) == NULL)
+		return NULL;
+
+	TAILQ_FOREACH(lock, &res->grant_queue, next) {
+		if (lock->node_id == node_id && (ref == 0 || DLMD_LOCK_REF(lock) == ref))
+			return lock;
+	}
+
+	TAILQ_FOREACH(lock, &res->wait_queue, next) {
+		if (lock->node_id == node_id && (ref == 0 || DLMD_LOCK_REF(lock) == ref))
+			return lock;
+	}
+	
+	return NULL;
+}
+
+static dlmd_lock_t *
+dlmd_lock_find_id(dlmd_lock_shard_t *shard, uint64_t id)
+{
+	dlmd_lock_t *lock;
+
+	LIST_FOREACH(lock, &shard->id_hash[(id >> shard_bits) & bucket_mask], id_next) {
+		if (lock->lock_id == id)
+			return lock;
+	}
+	
+	return NULL;
+}
+
+/*
+ * Create Lock entry preallocate and preset.
+ * Setting of lock->node for remote locks and inserting to request queue
+ * is left on caller.
+ */
+dlmd_lock_t *
+dlmd_lock_add(const char *name, uint32_t mode, uint64_t event_cnt, uint32_t id, int type){
+	dlmd_lock_t *lock;
+	uint64_t seq;
+	
+	lock = dlmd_lock_alloc(name);
+	
+	lock->hash = dlmd_lock_hash(lock->name);
+
+	pthread_mutex_init(&lock->lock_mtx, NULL);
+	pthread_cond_init(&lock->lock_cv, NULL);
+
+	lock->mode = mode;
+	lock->type = type;
+	lock->state = DLMD_LOCK_WAITING;
+	
+	/* Set value of Lamport logical clock for this lock */
+	lock->event_cnt = event_cnt;
+
+	/* independent from Lamport logical timestamps, low bits are shard index */
+	do {
+		seq = atomic_inc_64_nv(&lck_id) & lck_id_mask;
+	} while (seq == 0);
+
+	lock->lock_id = (seq << shard_bits) | (lock->hash & shard_mask);
+	
+	if (id == 0)
+		lock->node_id = local_node->node_address.sin_addr.s_addr;
+	else
+		lock->node_id = id;
+	
+	if (type & DLMD_LOCK_LOCAL) {
+		lock->node = local_node;
+		lock->node_count = dlmd_node_alive_count();
+	}
+
+	return lock;
+}
+
+/*
+ * Insert Lock into the wait queue of its resource and grant it if it is
+ * compatible with granted group.
+ */
+dlmd_lock_t *
+dlmd_lock_insert_request(dlmd_lock_t *lock)
+{
+	struct dlmd_lock_drop_head drop;
+	dlmd_lock_shard_t *shard;
+	dlmd_resource_t *res;
+	dlmd_lock_t *lock2, *next;
+	dlmd_msg_t msg, *req;
+	uint32_t type, token;
+
+	type = lock->type;
+
+	if (lock_engine == DLMD_ENGINE_MASTER && (type & DLMD_LOCK_LOCAL)) {
+		/* Resource mastered by other node, it will grant my request */
+		if ((lock->master = dlmd_node_master(lock->hash, 1)) != local_node) {
+			dlmd_lock_master_request(lock);
+			return lock;
+		}
+
+		/* I'm master, nobody else has to know about this lock */
+		lock->master = NULL;
+		lock->node_count = 0;
+	}
+
+	shard = dlmd_lock_shard(lock->hash);
+	dlmd_lock_shard_enter(shard);
+
+	res = dlmd_resource_get(shard, lock->name, lock->hash);
+	lock->res = res;
+
+	/* In token mode lock can be granted only while I hold token */
+	token = res->token;
+	if ((type & DLMD_LOCK_LOCAL) && (token & DLMD_TOKEN_MODE)) {
+		if ((token & DLMD_TOKEN_HELD) && res->token_qlen == 0)
+			lock->node_count = 0;
+		else {
+			lock->node_count = 1;
+			if (token & DLMD_TOKEN_HELD)
+				dlmd_resource_token_queue(res, local_node->node_address.sin_addr.s_addr);
+			else if (!(token & DLMD_TOKEN_WANTED)) {
+				res->token |= DLMD_TOKEN_WANTED;
+				req = dlmd_lock_notify_queue(shard, res->owner,
+				    DLMD_MSG_TOKEN_REQUEST, res->name);
+				req->ref = local_node->node_address.sin_addr.s_addr;
+			}
+		}
+	}
+
+	/*
+	 * Request older than some members of granted group has arrived.
+	 * Locks which didn't enter CS yet has to compete with it again,
+	 * otherwise nodes could disagree on order of requests. Active locks
+	 * are always older, all nodes have replied to them already.
+	 */
+	for (lock2 = TAILQ_FIRST(&res->grant_queue); lock2 != NULL; lock2 = next) {
+		next = TAILQ_NEXT(lock2, next);
+		if (lock2->state != DLMD_LOCK_ACTIVE && dlmd_lock_cmp(lock, lock2) < 0)
+			dlmd_resource_ungrant(res, lock2);
+	}
+
+	dlmd_lock_queue_insert(&res->wait_queue, lock);
+
+	LIST_INSERT_HEAD(&shard->id_hash[(lock->lock_id >> shard_bits) & bucket_mask],
+	    lock, id_next);
+
+	dlmd_resource_grant(res);
+
+	SLIST_INIT(&drop);
+	if (lock->state == DLMD_LOCK_WAITING) {
+		res->contended++;
+		dlmd_resource_uncache(res, lock->mode, &drop);
+	}
+		
+	dlmd_lock_shard_exit(shard);
+
+	dlmd_lock_drop(&drop);
+	
+	if ((type & DLMD_LOCK_LOCAL) && lock_engine != DLMD_ENGINE_MASTER &&
+	    !(token & DLMD_TOKEN_MODE)) { 
+		dlmd_msg_init(&msg, DLMD_MSG_REQUEST, lock->name);
+		msg.event = lock->event_cnt;
+		msg.mode = lock->mode;
+		msg.flags = lock->flags & LKM_VALBLK;
+
+		/* Ricart nodes refuse instead of deferring reply */
+		if (lock_engine == DLMD_ENGINE_RICART)
+			msg.flags |= lock->flags & LKM_NOQUEUE;
+
+		/*  Send request message to all nodes */
+		dlmd_msg_broadcast(&msg);
+		dlmd_msg_fini(&msg);
+	}
+	return lock;
+}
+
+/*
+ * Check if remote request (event, node_id) in mode has to wait for some of
+ * my locks on res. It waits for held locks and for older requests, both
+ * only when they are in conflicting mode. Must be called with shard mutex
+ * held.
+ */
+static int
+dlmd_resource_defer_check(dlmd_resource_t *res, uint64_t event, uint32_t node_id,
+    uint32_t mode)
+{
+	dlmd_lock_t *lock;
+	int i;
+	struct dlmd_lock_head *queues[] = { &res->grant_queue, &res->wait_queue };
+
+	for (i = 0; i < 2; i++) {
+		TAILQ_FOREACH(lock, queues[i], next) {
+			if (dlmd_lock_compat(lock->mode, mode) || lock->status != 0)
+				continue;
+
+			if (lock->state == DLMD_LOCK_ACTIVE)
+				return 1;
+
+			if (lock->event_cnt < event ||
+			    (lock->event_cnt == event && lock->node_id < node_id))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Ricart engine, remote request for resource name arrived. Returns 0 when
+ * caller can reply now, EINPROGRESS when reply was deferred and will be sent
+ * at unlock of my conflicting lock, EAGAIN when LKM_NOQUEUE request has to be
+ * refused.
+ */
+int
+dlmd_lock_defer(const char *name, dlmd_node_t *node, uint64_t event,
+    uint32_t node_id, uint32_t mode, uint32_t flags)
+{
+	struct dlmd_lock_drop_head drop;
+	dlmd_lock_shard_t *shard;
+	dlmd_resource_t *res;
+	dlmd_defer_t *defer;
+	uint32_t hash;
+	int r;
+
+	r = 0;
+	hash = dlmd_lock_hash(name);
+
+	SLIST_INIT(&drop);
+
+	shard = dlmd_lock_shard(hash);
+	dlmd_lock_shard_enter(shard);
+
+	if ((res = dlmd_resource_find(shard, name, hash)) != NULL &&
+	    dlmd_resource_defer_check(res, event, node_id, mode)) {
+		if (flags & LKM_NOQUEUE)
+			r = EAGAIN;
+		else {
+			if ((defer = malloc(sizeof(dlmd_defer_t))) == NULL)
+				err(EXIT_FAILURE, "Allocation of deferred reply failed\n");
+
+			defer->node = node;
+			defer->event = event;
+			defer->node_id = node_id;
+			defer->mode = mode;
+			defer->flags = flags;
+			TAILQ_INSERT_TAIL(&res->deferred, defer, next);
+
+			/* Cached lock has to go away for this request */
+			dlmd_resource_uncache(res, mode, &drop);
+
+			r = EINPROGRESS;
+		}
+	}
+
+	dlmd_lock_shard_exit(shard);
+
+	dlmd_lock_drop(&drop);
+
+	return r;
+}
+
+/*
+ * Queue replies for deferred requests which doesn't wait for any of my
+ * locks anymore. Must be called with shard mutex held.
+ */
+static void
+dlmd_resource_undefer(dlmd_lock_shard_t *shard, dlmd_resource_t *res)
+{
+	dlmd_defer_t *defer, *next;
+	dlmd_msg_t *msg;
+
+	for (defer = TAILQ_FIRST(&res->deferred); defer != NULL; defer = next) {
+		next = TAILQ_NEXT(defer, next);
+
+		if (dlmd_resource_defer_check(res, defer->event, defer->node_id,
+		    defer->mode))
+			continue;
+
+		TAILQ_REMOVE(&res->deferred, defer, next);
+
+		msg = dlmd_lock_notify_queue(shard, defer->node, DLMD_MSG_REPLY,
+		    res->name);
+		msg->ref = defer->event;
+		msg->mode = defer->mode;
+
+		/* Deferred reply carries value block written by my holder */
+		if ((defer->flags & LKM_VALBLK) && res->lvb_seq != 0) {
+			msg->flags = DLMD_MSG_F_LVB;
+			msg->lvb_seq = res->lvb_seq;
+			memcpy(msg->lvb, res->lvb, DLMD_LVB_LEN);
+		}
+
+		free(defer);
+	}
+}
+
+/*
+ * Switch resource to token mode. Token starts at node chosen by resource
+ * hash from all configured nodes, so every node knows where it is without
+ * any message.
+ * XXX Token is lost when its holder dies, there is no regeneration.
+ */
+static void
+dlmd_resource_token_init(dlmd_resource_t *res)
+{
+	dlmd_node_t *home;
+
+	res->token = DLMD_TOKEN_MODE;
+	res->token_qlen = 0;
+
+	if ((home = dlmd_node_master(res->hash, 0)) == local_node) {
+		res->token |= DLMD_TOKEN_HELD;
+		res->owner = NULL;
+	} else
+		res->owner = home;
+}
+
+/*
+ * Append node id to token queue, every node is queued only once.
+ */
+static int
+dlmd_resource_token_queue(dlmd_resource_t *res, uint32_t node_id)
+{
+	uint32_t i;
+
+	for (i = 0; i < res->token_qlen; i++)
+		if (res->token_queue[i] == node_id)
+			return EEXIST;
+
+	if (res->token_qlen == DLMD_TOKEN_QUEUE_MAX)
+		return ENOSPC;
+
+	res->token_queue[res->token_qlen++] = node_id;
+
+	return 0;
+}
+
+/*
+ * Other node waits for token, my locks which didn't enter critical section
+ * yet have to wait until token comes back to me.
+ */
+static void
+dlmd_resource_token_yield(dlmd_resource_t *res)
+{
+	dlmd_lock_t *lock;
+	int i, wait;
+	struct dlmd_lock_head *queues[] = { &res->grant_queue, &res->wait_queue };
+
+	wait = 0;
+
+	for (i = 0; i < 2; i++) {
+		TAILQ_FOREACH(lock, queues[i], next) {
+			if (lock->state == DLMD_LOCK_ACTIVE)
+				continue;
+			lock->node_count = 1;
+			wait = 1;
+		}
+	}
+
+	if (wait)
+		dlmd_resource_token_queue(res, local_node->node_address.sin_addr.s_addr);
+}
+
+/*
+ * Pass token to first node in token queue when none of my locks is in
+ * critical section. Rest of queue travels with token. Must be called with
+ * shard mutex held, token is sent at shard exit.
+ */
+static void
+dlmd_resource_token_pass(dlmd_lock_shard_t *shard, dlmd_resource_t *res)
+{
+	dlmd_node_t *node;
+	dlmd_lock_t *lock;
+	dlmd_msg_t *msg;
+	uint32_t next;
+
+	if (!(res->token & DLMD_TOKEN_HELD) || res->token_qlen == 0)
+		return;
+
+	TAILQ_FOREACH(lock, &res->grant_queue, next)
+		if (lock->state == DLMD_LOCK_ACTIVE)
+			return;
+
+	dlmd_resource_token_yield(res);
+
+	do {
+		next = res->token_queue[0];
+		memmove(&res->token_queue[0], &res->token_queue[1],
+		    --res->token_qlen * sizeof(uint32_t));
+
+		if (next == local_node->node_address.sin_addr.s_addr) {
+			dlmd_resource_token_take(shard, res);
+			return;
+		}
+
+		/* XXX requests of unknown nodes are dropped */
+		node = dlmd_node_find(ntohl(next), NULL);
+	} while (node == NULL && res->token_qlen != 0);
+
+	if (node == NULL)
+		return;
+
+	msg = dlmd_lock_notify_queue(shard, node, DLMD_MSG_TOKEN, res->name);
+	msg->flags = DLMD_MSG_F_QUEUE;
+	msg->queue_len = res->token_qlen;
+	memcpy(msg->queue, res->token_queue, res->token_qlen * sizeof(uint32_t));
+
+	/* Value block travels with token */
+	if (res->lvb_seq != 0) {
+		msg->flags |= DLMD_MSG_F_LVB;
+		msg->lvb_seq = res->lvb_seq;
+		memcpy(msg->lvb, res->lvb, DLMD_LVB_LEN);
+	}
+
+	res->token &= ~DLMD_TOKEN_HELD;
+	res->token_qlen = 0;
+	res->owner = node;
+
+	atomic_inc_64(&token_sent);
+}
+
+/*
+ * I have got token, grant my waiting locks. If nobody of mine needs it
+ * token goes on to next node in queue.
+ */
+static void
+dlmd_resource_token_take(dlmd_lock_shard_t *shard, dlmd_resource_t *res)
+{
+	dlmd_lock_t *lock;
+	int i;
+	struct dlmd_lock_head *queues[] = { &res->grant_queue, &res->wait_queue };
+
+	res->token = (res->token | DLMD_TOKEN_HELD) & ~DLMD_TOKEN_WANTED;
+	res->owner = NULL;
+
+	for (i = 0; i < 2; i++)
+		TAILQ_FOREACH(lock, queues[i], next)
+			lock->node_count = 0;
+
+	dlmd_resource_grant(res);
+
+	TAILQ_FOREACH(lock, &res->grant_queue, next)
+		dlmd_lock_activate(lock);
+
+	if (res->token_qlen != 0)
+		dlmd_resource_token_yield(res);
+
+	dlmd_resource_token_pass(shard, res);
+}
+
+/*
+ * Make resource name token resource, called for resources listed in
+ * config file at startup. Resource is never switched later, node in token
+ * mode grants locally while node in request mode replies to everybody,
+ * so all nodes have to list the same resources.
+ */
+void
+dlmd_lock_token_add(const char *name)
+{
+	dlmd_lock_shard_t *shard;
+	dlmd_resource_t *res;
+	uint32_t hash;
+
+	hash = dlmd_lock_hash(name);
+
+	shard = dlmd_lock_shard(hash);
+	dlmd_lock_shard_enter(shard);
+
+	res = dlmd_resource_get(shard, name, hash);
+	if (res->token == 0)
+		dlmd_resource_token_init(res);
+
+	dlmd_lock_shard_exit(shard);
+}
+
+/*
+ * Node requester wants token of resource name. Token holder queues it,
+ * node which waits for token itself remembers it until token arrives,
+ * others forward request to probable token holder. Resource which is not
+ * in my token_resources is refused, requester's config differs from mine.
+ */
+int
+dlmd_lock_token_request(const char *name, uint32_t requester)
+{
+	struct dlmd_lock_drop_head drop;
+	dlmd_lock_shard_t *shard;
+	dlmd_resource_t *res;
+	dlmd_msg_t *msg;
+	uint32_t hash;
+
+	if (requester == local_node->node_address.sin_addr.s_addr)
+		return EINVAL;
+
+	hash = dlmd_lock_hash(name);
+
+	SLIST_INIT(&drop);
+
+	shard = dlmd_lock_shard(hash);
+	dlmd_lock_shard_enter(shard);
+
+	if ((res = dlmd_resource_find(shard, name, hash)) == NULL ||
+	    res->token == 0) {
+		dlmd_lock_shard_exit(shard);
+		DPRINTF(("Token request for %s which is not token resource\n", name));
+		return EINVAL;
+	}
+
+	if (res->token & DLMD_TOKEN_HELD) {
+		dlmd_resource_token_queue(res, requester);
+		dlmd_resource_token_yield(res);
+		/* Cached locks would keep token here forever */
+		dlmd_resource_uncache(res, 0, &drop);
+		dlmd_resource_token_pass(shard, res);
+	} else if (res->token & DLMD_TOKEN_WANTED)
+		dlmd_resource_token_queue(res, requester);
+	else {
+		msg = dlmd_lock_notify_queue(shard, res->owner,
+		    DLMD_MSG_TOKEN_REQUEST, res->name);
+		msg->ref = requester;
+	}
+
+	dlmd_lock_shard_exit(shard);
+
+	dlmd_lock_drop(&drop);
+
+	return 0;
+}
+
+/*
+ * Token message arrived. Requests I have collected while waiting for token
+ * are appended after queue which came with token.
+ * XXX Token of resource which is not in my token_resources is dropped.
+ */
+int
+dlmd_lock_token_grant(const dlmd_msg_t *msg)
+{
+	uint32_t pending[DLMD_TOKEN_QUEUE_MAX];
+	dlmd_lock_shard_t *shard;
+	dlmd_resource_t *res;
+	uint32_t hash, i, npending;
+
+	hash = dlmd_lock_hash(msg->resource);
+
+	shard = dlmd_lock_shard(hash);
+	dlmd_lock_shard_enter(shard);
+
+	if ((res = dlmd_resource_find(shard, msg->resource, hash)) == NULL ||
+	    res->token == 0) {
+		dlmd_lock_shard_exit(shard);
+		DPRINTF(("Token for %s which is not token resource\n", msg->resource));
+		return EINVAL;
+	}
+
+	npending = res->token_qlen;
+	memcpy(pending, res->token_queue, npending * sizeof(uint32_t));
+	res->token_qlen = 0;
+
+	for (i = 0; (msg->flags & DLMD_MSG_F_QUEUE) && i < msg->queue_len; i++)
+		if (msg->queue[i] != local_node->node_address.sin_addr.s_addr)
+			dlmd_resource_token_queue(res, msg->queue[i]);
+
+	for (i = 0; i < npending; i++)
+		dlmd_resource_token_queue(res, pending[i]);
+
+	if ((msg->flags & DLMD_MSG_F_LVB) && msg->lvb_seq > res->lvb_seq) {
+		memcpy(res->lvb, msg->lvb, DLMD_LVB_LEN);
+		res->lvb_seq = msg->lvb_seq;
+	}
+
+	atomic_inc_64(&token_recv);
+
+	dlmd_resource_token_take(shard, res);
+
+	dlmd_lock_shard_exit(shard);
+
+	return 0;
+}
+
+/*
+ * Send local request to remote resource master. Lock is not queued on any
+ * resource here, only master knows about other requests. It waits for
+ * grant message in id hash.
+ */
+static void
+dlmd_lock_master_request(dlmd_lock_t *lock)
+{
+	dlmd_lock_shard_t *shard;
+	dlmd_msg_t msg;
+
+	lock->node_count = 1;
+
+	shard = dlmd_lock_shard(lock->hash);
+	dlmd_lock_shard_enter(shard);
+
+	LIST_INSERT_HEAD(&shard->id_hash[(lock->lock_id >> shard_bits) & bucket_mask],
+	    lock, id_next);
+
+	dlmd_lock_shard_exit(shard);
+
+	dlmd_msg_init(&msg, DLMD_MSG_MASTER_REQUEST, lock->name);
+	msg.event = lock->event_cnt;
+	msg.ref = lock->lock_id;
+	msg.mode = lock->mode;
+	msg.flags = lock->flags & LKM_NOQUEUE;
+
+	dlmd_msg_unicast(lock->master, &msg);
+	dlmd_msg_fini(&msg);
+}
+
+/*
+ * Master has granted (status 0) or refused (EAGAIN) request of local lock
+ * lock_id. Wakeup thread waiting for it.
+ */
+int
+dlmd_lock_granted(uint64_t lock_id, int status)
+{
+	dlmd_lock_shard_t *shard;
+	dlmd_lock_t *lock;
+
+	shard = dlmd_lock_shard_id(lock_id);
+	dlmd_lock_shard_enter(shard);
+
+	if ((lock = dlmd_lock_find_id(shard, lock_id)) == NULL ||
+	    lock->master == NULL || lock->state != DLMD_LOCK_WAITING) {
+		dlmd_lock_shard_exit(shard);
+		return ENOENT;
+	}
+
+	lock->node_count = 0;
+	lock->state = (status == 0) ? DLMD_LOCK_ACTIVE : DLMD_LOCK_DENIED;
+	pthread_cond_signal(&lock->lock_cv);
+
+	dlmd_lock_done_queue(shard, lock, status);
+
+	dlmd_lock_shard_exit(shard);
+
+	return 0;
+}
+
+/*
+ * Remove lock from resource queues and grant waiting requests.
+ * Must be called with shard mutex held.
+ */
+static void
+dlmd_lock_unlink(dlmd_lock_t *lock)
+{
+	dlmd_resource_t *res;
+
+	res = lock->res;
+
+	if (lock->convert_mode != 0) {
+		TAILQ_REMOVE(&res->convert_queue, lock, conv_next);
+		lock->convert_mode = 0;
+	}
+
+	if (lock->state == DLMD_LOCK_WAITING)
+		TAILQ_REMOVE(&res->wait_queue, lock, next);
+	else {
+		TAILQ_REMOVE(&res->grant_queue, lock, next);
+		res->grant_cnt[ffs(lock->mode) - 1]--;
+	}
+
+	LIST_REMOVE(lock, id_next);
+
+	dlmd_resource_grant(res);
+
+	if (lock_engine == DLMD_ENGINE_RICART)
+		dlmd_resource_undefer(dlmd_lock_shard(res->hash), res);
+
+	if (res->token & DLMD_TOKEN_MODE)
+		dlmd_resource_token_pass(dlmd_lock_shard(res->hash), res);
+
+	dlmd_resource_put(res);
+}
+
+/*
+ * Remove local request from resource and send unlock message to all nodes.
+ * Nodes can remove lock from their queues.
+ */
+int
+dlmd_lock_release(uint64_t lock_id) 
+{
+	dlmd_lock_shard_t *shard;
+	dlmd_lock_t *lock;
+	
+	shard = dlmd_lock_shard_id(lock_id);
+	dlmd_lock_shard_enter(shard);
+
+	if ((lock = dlmd_lock_find_id(shard, lock_id)) == NULL ||
+	    !(lock->type & DLMD_LOCK_LOCAL)) {
+		dlmd_lock_shard_exit(shard);
+		return ENOENT;
+	}
+
+	return dlmd_lock_release_held(shard, lock, 1);
+}
+
+/*
+ * Release local lock, must be called with shard mutex held and it is
+ * unlocked on return. Request which gave up waiting is released with cache
+ * 0, it is withdrawn from all nodes even if grant came meanwhile.
+ */
+static int
+dlmd_lock_release_held(dlmd_lock_shard_t *shard, dlmd_lock_t *lock, int cache)
+{
+	dlmd_msg_t msg;
+	int broadcast;
+	uint64_t event = dlmd_event_cnt_inc();
+
+	DPRINTF(("dlmd_lock_release called %s\n", lock->name));
+
+	/* Remote master removes lock from its queues and grants others */
+	if (lock->master != NULL) {
+		dlmd_msg_init(&msg, DLMD_MSG_MASTER_RELEASE, lock->name);
+		msg.event = event;
+		msg.ref = lock->lock_id;
+		msg.mode = lock->mode;
+
+		LIST_REMOVE(lock, id_next);
+
+		dlmd_lock_shard_exit(shard);
+
+		/* Refused request is not queued on master */
+		if (lock->state != DLMD_LOCK_DENIED)
+			dlmd_msg_unicast(lock->master, &msg);
+
+		dlmd_msg_fini(&msg);
+		dlmd_lock_destroy(lock);
+
+		return 0;
+	}
+
+	/*
+	 * Keep LKM_CACHE lock after unlock until somebody else wants it,
+	 * next lock_resource on this node doesn't need to send anything.
+	 */
+	if (cache && (lock->flags & LKM_CACHE) && lock->cache == 0 &&
+	    lock->res != NULL && lock->state == DLMD_LOCK_ACTIVE &&
+	    TAILQ_EMPTY(&lock->res->wait_queue) &&
+	    TAILQ_EMPTY(&lock->res->convert_queue) &&
+	    TAILQ_EMPTY(&lock->res->deferred)) {
+		lock->cache = DLMD_LOCK_CACHED;
+		dlmd_lock_shard_exit(shard);
+		return 0;
+	}
+
+	dlmd_msg_init(&msg, DLMD_MSG_UNLOCK, lock->name);
+	msg.event = event;
+	msg.ref = lock->event_cnt;
+	msg.mode = lock->mode;
+
+	/* Pass value block written by holder to other nodes */
+	if (lock->lvb_dirty) {
+		msg.flags = DLMD_MSG_F_LVB;
+		msg.lvb_seq = lock->res->lvb_seq;
+		memcpy(msg.lvb, lock->res->lvb, DLMD_LVB_LEN);
+	}
+
+	/* Other nodes don't know about locks on token resources */
+	broadcast = (lock_engine == DLMD_ENGINE_LAMPORT && lock->res->token == 0);
+
+	dlmd_lock_unlink(lock);
+	
+	dlmd_lock_shard_exit(shard);
+	
+	/*  Send release message to all nodes */
+	if (broadcast)
+		dlmd_msg_broadcast(&msg);
+	
+	dlmd_msg_fini(&msg);
+	dlmd_lock_destroy(lock);
+
+	dump_list();
+
+	return 0;
+}
+
+/*
+ * Remove remote request of node_id with timestamp ref after unlock message.
+ */
+int
+dlmd_lock_release_ref(const char *name, uint32_t node_id, uint64_t ref)
+{
+	dlmd_lock_shard_t *shard;
+	dlmd_lock_t *lock;
+
+	shard = dlmd_lock_shard(dlmd_lock_hash(name));
+	dlmd_lock_shard_enter(shard);
+
+	if ((lock = dlmd_lock_find_ref(shard, name, node_id, ref)) == NULL ||
+	    !(lock->type & DLMD_LOCK_REMOTE)) {
+		dlmd_lock_shard_exit(shard);
+		return ENOENT;
+	}
+
+	dlmd_lock_unlink(lock);
+
+	dlmd_lock_shard_exit(shard);
+
+	dlmd_lock_destroy(lock);
+
+	dump_list();
+
+	return 0;
+}
+
+/*
+ * Sleep on per-lock condvar until lock becomes active,
+ * I need two things 1) be in granted group of resource
+ *                   2) get replies from all nodes
+ * to enter critical section.
+ */
+void
+dlmd_lock_wait(dlmd_lock_t *lock)
+{
+	dlmd_lock_shard_t *shard;
+
+	shard = dlmd_lock_shard(lock->hash);
+	dlmd_lock_shard_enter(shard);
+
+	DPRINTF(("dlmd_lock_wait to acquire lock %s, count %d, cv %p\n", lock->name, lock->node_count, &lock->lock_cv));
+	/* wait for all replies from other locks */
+	while (lock->state != DLMD_LOCK_ACTIVE)
+		pthread_cond_wait(&lock->lock_cv, &shard->mtx);
+
+	dlmd_lock_shard_exit(shard);
+}
+
+/*
+ * Like dlmd_lock_wait, but give up at deadline (CLOCK_REALTIME). Request
+ * which is still not active then is released, so it is removed from all
+ * nodes with single unlock message, and ETIMEDOUT is returned.
+ */
+int
+dlmd_lock_timedwait(dlmd_lock_t *lock, const struct timespec *deadline)
+{
+	dlmd_lock_shard_t *shard;
+	int r;
+
+	shard = dlmd_lock_shard(lock->hash);
+	dlmd_lock_shard_enter(shard);
+
+	r = 0;
+	while (lock->state != DLMD_LOCK_ACTIVE && r != ETIMEDOUT)
+		r = pthread_cond_timedwait(&lock->lock_cv, &shard->mtx, deadline);
+
+	/* Grant which came with timeout wins */
+	if (lock->state == DLMD_LOCK_ACTIVE) {
+		dlmd_lock_shard_exit(shard);
+		return 0;
+	}
+
+	DPRINTF(("Lock request %s timed out\n", lock->name));
+
+	/* Grant can't come between decision and release */
+	dlmd_lock_release_held(shard, lock, 0);
+
+	return ETIMEDOUT;
+}
+
+/*
+ * Cancel async request lock_id which is not granted yet. It is released
+ * like in dlmd_lock_timedwait and completion is reported with ECANCELED.
+ * Returns EBUSY for active lock or request with waiting thread.
+ */
+int
+dlmd_lock_cancel(uint64_t lock_id)
+{
+	dlmd_lock_shard_t *shard;
+	dlmd_lock_t *lock;
+	void (*ast)(int, int, void *);
+	void *arg;
+	int fd;
+
+	shard = dlmd_lock_shard_id(lock_id);
+	dlmd_lock_shard_enter(shard);
+
+	if ((lock = dlmd_lock_find_id(shard, lock_id)) == NULL ||
+	    !(lock->type & DLMD_LOCK_LOCAL)) {
+		dlmd_lock_shard_exit(shard);
+		return ENOENT;
+	}
+
+	if (!lock->async || lock->state == DLMD_LOCK_ACTIVE) {
+		dlmd_lock_shard_exit(shard);
+		return EBUSY;
+	}
+
+	/* Grant can't be reported any more */
+	lock->async = 0;
+	ast = lock->ast;
+	arg = lock->ast_arg;
+	fd = lock->ast_fd;
+
+	DPRINTF(("Cancelling lock request %"PRIu64"\n", lock_id));
+
+	dlmd_lock_release_held(shard, lock, 0);
+
+	/* Lock is gone already, dlmd_lock_wait_any sees ENOENT */
+	dlmd_lock_async_done(lock_id, ECANCELED, ast, arg, fd);
+
+	return 0;
+}
+
+/*
+ * State of async request lock_id: 0 when it is active, EINPROGRESS while
+ * it waits, EAGAIN when master refused it and ENOENT when there is no such
+ * lock (it was cancelled or unlocked).
+ */
+static int
+dlmd_lock_async_state(uint64_t lock_id)
+{
+	dlmd_lock_shard_t *shard;
+	dlmd_lock_t *lock;
+	int r;
+
+	shard = dlmd_lock_shard_id(lock_id);
+	dlmd_lock_shard_enter(shard);
+
+	if ((lock = dlmd_lock_find_id(shard, lock_id)) == NULL ||
+	    !(lock->type & DLMD_LOCK_LOCAL))
+		r = ENOENT;
+	else if (lock->state == DLMD_LOCK_ACTIVE)
+		r = 0;
+	else if (lock->state == DLMD_LOCK_DENIED)
+		r = EAGAIN;
+	else
+		r = EINPROGRESS;
+
+	dlmd_lock_shard_exit(shard);
+
+	return r;
+}
+
+/*
+ * Wait until any of n requests in lock_ids is finished, at most msec
+ * milliseconds (forever when negative). *index is set to first finished
+ * request and its status is returned, ETIMEDOUT when none finished in time.
+ */
+int
+dlmd_lock_wait_any(const int *lock_ids, int n, int msec, int *index)
+{
+	struct timespec ts;
+	int i, r, timedout;
+
+	if (n <= 0)
+		return EINVAL;
+
+	if (msec >= 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += msec / 1000;
+		ts.tv_nsec += (msec % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+
+	/*
+	 * Completion changes lock state before it takes async_mtx, so holding
+	 * it while I look at requests I can't miss wakeup.
+	 */
+	pthread_mutex_lock(&async_mtx);
+
+	for (timedout = 0; !timedout;) {
+		for (i = 0; i < n; i++) {
+			if ((r = dlmd_lock_async_state(lock_ids[i])) != EINPROGRESS) {
+				pthread_mutex_unlock(&async_mtx);
+				*index = i;
+				return r;
+			}
+		}
 
-uint64_t lck_id;
+		/* After timeout requests are checked once more */
+		if (msec < 0)
+			pthread_cond_wait(&async_cv, &async_mtx);
+		else
+			timedout = (pthread_cond_timedwait(&async_cv, &async_mtx,
+			    &ts) == ETIMEDOUT);
+	}
 
-static dlmd_lock_t* dlmd_lock_alloc();
-static dlmd_lock_t* dlmd_lock_find_id(uint64_t, int);
-static dlmd_lock_t* dlmd_lock_find_name(const char *, int);
-static void dlmd_lock_destroy(dlmd_lock_t *);
-static void dump_list();
+	pthread_mutex_unlock(&async_mtx);
 
-static void
-dump_list()
+	return ETIMEDOUT;
+}
+
+/*
+ * Wait only for replies from all nodes, after that I know about all older
+ * requests. If lock can't enter critical section now, it is removed from
+ * all nodes again and EAGAIN is returned. In token mode node_count waits
+ * for token, which can take forever, so without token I refuse right away.
+ */
+int
+dlmd_lock_trywait(dlmd_lock_t *lock)
 {
-	dlmd_lock_t *lock;
-	dlmd_node_t *node;
+	dlmd_lock_shard_t *shard;
 
-	printf("\n------------------------------------------------------\n");
-	TAILQ_FOREACH(lock, &lock_list, next) {
-		printf("Lock name %s %p\n", lock->name, lock);
-		printf("Lock flags %d, type %d\n", lock->flags, lock->type);
-		printf("Lock id %"PRIu64"\n", lock->lock_id);
-		printf("Timestamp %"PRIu64"\n", lock->event_cnt);
-		printf("Node Count %d\n", lock->node_count);
-		printf("Previsious lock %p\n", TAILQ_PREV(lock, dlmd_lock_head, next));
-		printf("Next lock %p\n", TAILQ_NEXT(lock, next));
-		printf("First entry in list %p\n", TAILQ_FIRST(&lock_list));
-		printf("Last entry in list %p\n", TAILQ_LAST(&lock_list, dlmd_lock_head));
-		printf("Node list \n");
-		SLIST_FOREACH(node, &lock->nodes, lock_next)
-			printf("Lock node list: %s %p next: %p\n", node->node_name, node, SLIST_NEXT(node, lock_next));
-		
-		printf("------------------------\n");
+	shard = dlmd_lock_shard(lock->hash);
+	dlmd_lock_shard_enter(shard);
 
+	if (lock->state != DLMD_LOCK_ACTIVE && lock->res != NULL &&
+	    (lock->res->token & DLMD_TOKEN_MODE) &&
+	    !(lock->res->token & DLMD_TOKEN_HELD)) {
+		dlmd_lock_release_held(shard, lock, 0);
+		return EAGAIN;
 	}
-	printf("------------------------------------------------------\n\n");
-}
 
+	while (lock->state != DLMD_LOCK_ACTIVE && lock->node_count != 0)
+		pthread_cond_wait(&lock->lock_cv, &shard->mtx);
 
-static dlmd_lock_t *
-dlmd_lock_find_name(const char *name, int type)
-{
-	dlmd_lock_t *lock;
-	size_t slen, dlen;
+	if (lock->state == DLMD_LOCK_ACTIVE) {
+		dlmd_lock_shard_exit(shard);
+		return 0;
+	}
 
-	slen = strlen(name);
-	TAILQ_FOREACH(lock, &lock_list, next) {
-		dlen = strlen(lock->name);
+	dlmd_lock_release_held(shard, lock, 0);
 
-		if (slen != dlen)
-			continue;
-		
-		if ((strncmp(name, lock->name, slen) == 0) &&
-			(lock->type & type))
-				return lock;
-	}
-	
-	return NULL;
+	return EAGAIN;
 }
 
-static dlmd_lock_t *
-dlmd_lock_find_id(uint64_t id, int type)
+/*
+ * Check if new request for resource name in mode would be granted
+ * right now by my view of resource. Returns EAGAIN when there is granted
+ * conflicting lock, there are already waiting requests or resource is in
+ * token mode and token is elsewhere.
+ */
+int
+dlmd_lock_probe(const char *name, uint32_t mode)
 {
+	dlmd_lock_shard_t *shard;
+	dlmd_resource_t *res;
 	dlmd_lock_t *lock;
+	uint32_t hash;
+	int r;
 
-	TAILQ_FOREACH(lock, &lock_list, next) {
-		DPRINTF(("%"PRIu64"-- %"PRIu64", %d -- %d\n", lock->lock_id, id, lock->type, type));
-		if (lock->lock_id == id){
-				printf("FIRE!!\n");
-			return lock;
+	r = 0;
+	hash = dlmd_lock_hash(name);
+
+	shard = dlmd_lock_shard(hash);
+	dlmd_lock_shard_enter(shard);
+
+	if ((res = dlmd_resource_find(shard, name, hash)) != NULL) {
+		if (!TAILQ_EMPTY(&res->wait_queue) || !TAILQ_EMPTY(&res->convert_queue))
+			r = EAGAIN;
+
+		if ((res->token & DLMD_TOKEN_MODE) && !(res->token & DLMD_TOKEN_HELD))
+			r = EAGAIN;
+
+		/* Idle cached locks of this node will be dropped for me */
+		TAILQ_FOREACH(lock, &res->grant_queue, next) {
+			if (!(lock->cache & DLMD_LOCK_CACHED) &&
+			    !dlmd_lock_compat(lock->mode, mode))
+				r = EAGAIN;
 		}
 	}
-	
-	return NULL;
+
+	dlmd_lock_shard_exit(shard);
+
+	return r;
 }
 
 /*
- * Find lock in a global lock list, search for id and name.
+ * Count reply for local lock with request timestamp ref and wakeup thread
+ * sleeping on per-lock cv if it can enter critical section now. Non zero
+ * status means node has refused LKM_NOQUEUE request.
  */
-dlmd_lock_t *
-dlmd_lock_find(const char *name, uint64_t id, int type)
+int
+dlmd_lock_reply(const char *name, uint64_t ref, int status)
 {
+	dlmd_lock_shard_t *shard;
 	dlmd_lock_t *lock;
 
-	pthread_mutex_lock(&lock_list_mtx);
-	
-	if (id != 0)
-		if ((lock = dlmd_lock_find_id(id, type)) != NULL){
-			pthread_mutex_unlock(&lock_list_mtx);
-			return lock;
-		}
-	
-	if (name != NULL)
-		if ((lock = dlmd_lock_find_name(name, type)) != NULL){
-			pthread_mutex_unlock(&lock_list_mtx);
-			return lock;
-		}	
-	
-	pthread_mutex_unlock(&lock_list_mtx);
+	shard = dlmd_lock_shard(dlmd_lock_hash(name));
+	dlmd_lock_shard_enter(shard);
 
-	return NULL;
+	if ((lock = dlmd_lock_find_ref(shard, name,
+	    local_node->node_address.sin_addr.s_addr, ref)) == NULL) {
+		dlmd_lock_shard_exit(shard);
+		return ENOENT;
+	}
+	/*
+	 * Probably better approach is use node_count for storing number of received replies
+	 * and compare it to actual active node count. Problem in current system is that I
+	 * can wait for reply from, node which was removed from cluster after I have requested
+	 * lock.
+	 *
+	 * Probably best approach is implementation of better keepalive/cluster memmbership code.
+	 */
+			
+	if (lock->node_count > 0)
+		lock->node_count--;
+
+	if (status != 0)
+		lock->status = status;
+		
+	DPRINTF(("Sending signal to %s count %d\n", lock->name, lock->node_count));
+	if (lock->convert_mode != 0)
+		dlmd_lock_convert_check(lock);
+	else
+		dlmd_lock_activate(lock);
+
+	/* Non blocking request decides after last reply */
+	if (lock->node_count == 0 && (lock->flags & LKM_NOQUEUE))
+		pthread_cond_signal(&lock->lock_cv);
+
+	dlmd_lock_shard_exit(shard);
+
+	return 0;
 }
 
 /*
- * Create Lock entry preallocate and preset.
- * Setting of lock->node and inserting to request TAILQ is left on caller.
+ * Convert active local lock to new mode in place. Downgrade is done
+ * immediately and other nodes are only notified. Upgrade has to be ordered
+ * like a new request, but it waits only for conflicting holders and older
+ * conversions. Returns EDEADLK when older conversion waits for this lock,
+ * lock keeps its old mode then.
  */
-dlmd_lock_t *
-dlmd_lock_add(const char *name, int flags, uint64_t event_cnt, uint32_t id, int type){
+int
+dlmd_lock_convert(uint64_t lock_id, uint32_t mode)
+{
+	dlmd_lock_shard_t *shard;
 	dlmd_lock_t *lock;
-	
-	lock = dlmd_lock_alloc();
-	
-	strlcpy(lock->name, name, MAX_NAME_LEN);
+	dlmd_msg_t msg;
+	int upgrade, status;
 
-	pthread_mutex_init(&lock->lock_mtx, NULL);
-	pthread_cond_init(&lock->lock_cv, NULL);
+	shard = dlmd_lock_shard_id(lock_id);
+	dlmd_lock_shard_enter(shard);
 
-	lock->flags = flags;
-	lock->type = type;
-	
-	/* Set value of Lamport logical clock for this lock */
-	lock->event_cnt = event_cnt;
+	if ((lock = dlmd_lock_find_id(shard, lock_id)) == NULL ||
+	    !(lock->type & DLMD_LOCK_LOCAL)) {
+		dlmd_lock_shard_exit(shard);
+		return ENOENT;
+	}
 
-	/* independent from Lamport logical timestamps */
-	lock->lock_id = atomic_inc_64_nv(&lck_id);
-	
-	if (id == 0)
-		lock->node_id = local_node->node_address.sin_addr.s_addr;
-	
-	SLIST_INIT(&lock->nodes);
-	
-	if (type & DLMD_LOCK_LOCAL)
-		SLIST_INSERT_HEAD(&lock->nodes, local_node, lock_next);
-		
-	lock->node_count = dlmd_node_alive_count();
+	/* XXX conversion is not implemented in other engines and token mode yet */
+	if (lock_engine != DLMD_ENGINE_LAMPORT || lock->res->token != 0) {
+		dlmd_lock_shard_exit(shard);
+		return EOPNOTSUPP;
+	}
 
-	return lock;
+	if (lock->state != DLMD_LOCK_ACTIVE || lock->convert_mode != 0) {
+		dlmd_lock_shard_exit(shard);
+		return EBUSY;
+	}
+
+	if (lock->mode == mode) {
+		dlmd_lock_shard_exit(shard);
+		return 0;
+	}
+
+	dlmd_msg_init(&msg, DLMD_MSG_CONVERT, lock->name);
+	msg.event = dlmd_event_cnt_inc();
+	msg.ref = lock->event_cnt;
+	msg.mode = mode;
+
+	upgrade = !dlmd_lock_mode_weaker(lock->mode, mode);
+
+	if (upgrade) {
+		lock->convert_mode = mode;
+		lock->convert_event = msg.event;
+		lock->node_count = dlmd_node_alive_count();
+		dlmd_lock_convert_insert(lock->res, lock);
+	} else {
+		lock->res->grant_cnt[ffs(lock->mode) - 1]--;
+		lock->res->grant_cnt[ffs(mode) - 1]++;
+		lock->mode = mode;
+		dlmd_resource_grant(lock->res);
+	}
+
+	dlmd_lock_shard_exit(shard);
+
+	DPRINTF(("Converting lock %s to mode %d, upgrade %d\n", lock->name, mode, upgrade));
+
+	dlmd_msg_broadcast(&msg);
+	dlmd_msg_fini(&msg);
+
+	if (!upgrade)
+		return 0;
+
+	dlmd_lock_shard_enter(shard);
+
+	dlmd_lock_convert_check(lock);
+
+	while (lock->convert_mode != 0)
+		pthread_cond_wait(&lock->lock_cv, &shard->mtx);
+
+	status = lock->convert_status;
+
+	dlmd_lock_shard_exit(shard);
+
+	/* Withdraw refused conversion, same mode as held cancels it */
+	if (status != 0) {
+		dlmd_msg_init(&msg, DLMD_MSG_CONVERT, lock->name);
+		msg.event = dlmd_event_cnt_inc();
+		msg.ref = lock->event_cnt;
+		msg.mode = lock->mode;
+		dlmd_msg_broadcast(&msg);
+		dlmd_msg_fini(&msg);
+	}
+
+	return status;
 }
 
 /*
- * Insert Lock into the request list. 
+ * Apply conversion message of remote lock. Returns 1 when conversion is an
+ * upgrade and sender waits for my reply.
  */
-dlmd_lock_t *
-dlmd_lock_insert_request(dlmd_lock_t *lock)
+int
+dlmd_lock_convert_ref(const char *name, uint32_t node_id, uint64_t ref, uint32_t mode,
+    uint64_t event)
 {
-	dlmd_lock_t *lock2;
-	char *msg;
-	size_t len;
-	size_t slen, dlen;
-	uint8_t concurent;
-	uint32_t type;
-
-	concurent = 0;
-	type = lock->type;
+	dlmd_lock_shard_t *shard;
+	dlmd_lock_t *lock;
+	int upgrade;
 
-	pthread_mutex_lock(&lock_list_mtx);
+	upgrade = 0;
 
-	slen = strlen(lock->name);
-	TAILQ_FOREACH(lock2, &lock_list, next) {
-		dlen = strlen(lock2->name);
+	shard = dlmd_lock_shard(dlmd_lock_hash(name));
+	dlmd_lock_shard_enter(shard);
 
-		if (slen != dlen)
-			continue;
-		
-		/* I have found same resource lock as I want to set, now I haveto test 
-			if I can steal this one or I have to insert new entry into the queue */
-		if ((strncmp(lock->name, lock2->name, slen) == 0)) {
-		
-			/* IF I want to set CR lock and it was already set go for it */
-			if ((lock2->flags == LKM_CRMODE) && (lock->flags == LKM_CRMODE)) {
-				printf("Found lock %s, with flag %d -> %d\n", lock->name, lock2->flags, LKM_CRMODE);
-				/* Insert requesting lock node into the old one node list */
-				SLIST_INSERT_HEAD(&lock2->nodes, SLIST_FIRST(&lock->nodes), lock_next);
-				
-				dlmd_lock_destroy(lock);
-							
-				lock = lock2;
-				
-				lock->type |= DLMD_LOCK_CR;
-				goto exit;
-			}
-		}	
-    }
+	if ((lock = dlmd_lock_find_ref(shard, name, node_id, ref)) == NULL ||
+	    !(lock->type & DLMD_LOCK_REMOTE)) {
+		dlmd_lock_shard_exit(shard);
+		return 0;
+	}
 
 	/*
-	 * Search whole list for lock with same event number, if there is such lock,
-	 * I need to totaly order by node_id. I need totally ordered Lamport timestamps
-	 * because with only partialy ordered timestamps two nodes can ask for same 
-	 * lock and enter CS.
+	 * Owner converts only active locks. If I still see its lock waiting,
+	 * I haven't got some unlock message yet, lock simply waits for new mode.
 	 */
-	
-	TAILQ_FOREACH(lock2, &lock_list, next) {
-		/* There is event with same timestamp already */
-		if (lock->event_cnt == lock2->event_cnt) {
-			if (lock->node_id > lock2->node_id)
-				TAILQ_INSERT_BEFORE(lock2, lock, next);
-			else
-				TAILQ_INSERT_AFTER(&lock_list, lock2, lock, next);
-			concurent = 1;
-			break;
-		}		
+	if (lock->state == DLMD_LOCK_WAITING) {
+		upgrade = !dlmd_lock_mode_weaker(lock->mode, mode);
+		lock->mode = mode;
+		dlmd_lock_shard_exit(shard);
+		return upgrade;
 	}
-	
-	/* Insert lock to the HEAD of list */
-	if(concurent == 0)
-		TAILQ_INSERT_HEAD(&lock_list, lock, next);
-		
-exit:	
-	pthread_mutex_unlock(&lock_list_mtx);
-	
-	if (type & DLMD_LOCK_LOCAL) { 
-		msg = request_msg_init(local_node->node_name, lock->name, lock->event_cnt, 
-							lock->flags, lock->node_id);
-	    len = strlen(msg);
 
-		/*  Send request message to all nodes */
-		dlmd_node_broadcast_msg(msg, len);
+	/* Owner is in CS, this lock can't be moved back to wait queue */
+	lock->state = DLMD_LOCK_ACTIVE;
 
-		free(msg);
+	if (lock->convert_mode != 0) {
+		/* Owner has withdrawn its conversion */
+		TAILQ_REMOVE(&lock->res->convert_queue, lock, conv_next);
+		lock->convert_mode = 0;
 	}
-	return lock;
+
+	if (lock->mode == mode) {
+		/* nothing to do */
+	} else if (dlmd_lock_mode_weaker(lock->mode, mode)) {
+		lock->res->grant_cnt[ffs(lock->mode) - 1]--;
+		lock->res->grant_cnt[ffs(mode) - 1]++;
+		lock->mode = mode;
+	} else {
+		lock->convert_mode = mode;
+		lock->convert_event = event;
+		dlmd_lock_convert_insert(lock->res, lock);
+		upgrade = 1;
+	}
+
+	dlmd_resource_grant(lock->res);
+
+	dlmd_lock_shard_exit(shard);
+
+	return upgrade;
 }
 
 /*
- * Remove request from list and send unlock message to all nodes.
- * Nodes can remove lock from their lock list.
+ * Copy lock value block of resource to buf, lock has to be held with
+ * LKM_VALBLK. Never written value block reads as zeroes.
  */
 int
-dlmd_lock_release(uint64_t lock_id, int type, dlmd_node_t *node) 
+dlmd_lock_value_get(uint64_t lock_id, void *buf)
 {
+	dlmd_lock_shard_t *shard;
 	dlmd_lock_t *lock;
-	dlmd_lock_t *last;
-	dlmd_node_t *nodel;
-	size_t len;
-	uint64_t event = dlmd_event_cnt_inc();
-	char *msg;
-	
-	pthread_mutex_lock(&lock_list_mtx);
-	/* FIXME 
-	 * With concurent read there is one issue in code when node A requests
-	 * resource lock CR_lock. This lock is then added to queue on node B 
-	 * as DLMD_LOCK_REMOTE. 
-	 * When node B request CR lock on the same resource it will add node to lock 
-	 * node list. 
-	 *
-	 * Problem is that dlmd_lock_find_id will return NULL when it is called on B 
-	 * from unlock_resource because lock type doesn't match.
-	 */
-	 /* XXX do I need to check type for lock_id find ??? lock_id is different 
-	    for all locks */
-	if ((lock = dlmd_lock_find_id(lock_id, type)) == NULL)
-		return ENOENT;
-	
-	DPRINTF(("dlmd_lock_release called %s\n", lock->name));
-	
-	if (type & DLMD_LOCK_LOCAL)
-		node = local_node;
-			
-	SLIST_FOREACH (nodel, &lock->nodes, lock_next) {
-		if (nodel == node)
-			SLIST_REMOVE(&lock->nodes, nodel, dlmd_node, lock_next);
-    }
-	
-	if (SLIST_EMPTY(&lock->nodes))
-			TAILQ_REMOVE(&lock_list, lock, next);
-	
+	int r;
 
-	/* Wake up last element */
-	if ((last = TAILQ_LAST(&lock_list, dlmd_lock_head)) != NULL)
-		pthread_cond_signal(&last->lock_cv);
-	
-	pthread_mutex_unlock(&lock_list_mtx);
+	r = 0;
 
-	if (type & DLMD_LOCK_LOCAL) {
-					
-		msg = unlock_msg_init(local_node->node_name, lock->name, event, lock->flags);
-		len = strlen(msg);
-	
-		/*  Send release message to all nodes */
-		dlmd_node_broadcast_msg(msg, len);
+	shard = dlmd_lock_shard_id(lock_id);
+	dlmd_lock_shard_enter(shard);
+
+	if ((lock = dlmd_lock_find_id(shard, lock_id)) == NULL ||
+	    !(lock->type & DLMD_LOCK_LOCAL))
+		r = ENOENT;
+	else if (lock->state != DLMD_LOCK_ACTIVE || !(lock->flags & LKM_VALBLK))
+		r = EINVAL;
+	else if (lock->res == NULL)
+		r = EOPNOTSUPP;	/* XXX value block isn't passed by remote master */
+	else
+		memcpy(buf, lock->res->lvb, DLMD_LVB_LEN);
+
+	dlmd_lock_shard_exit(shard);
+
+	return r;
+}
+
+/*
+ * Write lock value block, only PW and EX holders can do that. New value is
+ * sent to other nodes with unlock message.
+ */
+int
+dlmd_lock_value_set(uint64_t lock_id, const void *buf)
+{
+	dlmd_lock_shard_t *shard;
+	dlmd_lock_t *lock;
+	int r;
+
+	r = 0;
 
-		free(msg);
+	shard = dlmd_lock_shard_id(lock_id);
+	dlmd_lock_shard_enter(shard);
+
+	if ((lock = dlmd_lock_find_id(shard, lock_id)) == NULL ||
+	    !(lock->type & DLMD_LOCK_LOCAL))
+		r = ENOENT;
+	else if (lock->state != DLMD_LOCK_ACTIVE || !(lock->flags & LKM_VALBLK))
+		r = EINVAL;
+	else if (lock->res == NULL)
+		r = EOPNOTSUPP;	/* XXX value block isn't passed by remote master */
+	else if (lock->mode != LKM_PWMODE && lock->mode != LKM_EXMODE)
+		r = EPERM;
+	else {
+		memcpy(lock->res->lvb, buf, DLMD_LVB_LEN);
+		lock->res->lvb_seq++;
+		lock->lvb_dirty = 1;
 	}
-	
-	if (SLIST_EMPTY(&lock->nodes))
-		dlmd_lock_destroy(lock);
 
-	dump_list();
+	dlmd_lock_shard_exit(shard);
 
-	return 0;
+	return r;
 }
 
 /*
- * Sleep on per-lock condvar to become head of list,
- * I need two things 1) be head of a list
- *                   2) get replies from all nodes
- * to enter critical section.
+ * Read lock value block of resource name so I can send it to requester.
+ * Returns ENOENT when I don't know valid value block.
  */
-void
-dlmd_lock_wait(dlmd_lock_t *lock)
+int
+dlmd_lock_lvb_read(const char *name, void *buf, uint64_t *seq)
 {
-	pthread_mutex_lock(&lock_list_mtx);
+	dlmd_lock_shard_t *shard;
+	dlmd_resource_t *res;
+	uint32_t hash;
+	int r;
 
-	DPRINTF(("dlmd_lock_wait to acquire lock %s, count %d, cv %p\n", lock->name, lock->node_count, &lock->lock_cv));
-	/* wait for all replies from other locks */
-	while ((lock->node_count != 0) ||
-	       (TAILQ_LAST(&lock_list, dlmd_lock_head)) != lock)
-		pthread_cond_wait(&lock->lock_cv, &lock_list_mtx);
+	r = ENOENT;
+	hash = dlmd_lock_hash(name);
+
+	shard = dlmd_lock_shard(hash);
+	dlmd_lock_shard_enter(shard);
+
+	if ((res = dlmd_resource_find(shard, name, hash)) != NULL &&
+	    res->lvb_seq != 0) {
+		memcpy(buf, res->lvb, DLMD_LVB_LEN);
+		*seq = res->lvb_seq;
+		r = 0;
+	}
+
+	dlmd_lock_shard_exit(shard);
 
-	pthread_mutex_unlock(&lock_list_mtx);
+	return r;
 }
 
 /*
- * Wakeup thread which is sleeping on per-lock list cv.
- * Thread should sleep only when it has received replies from other nodes but
- * it is not at the head of list.
+ * Store lock value block received from other node if it is newer than
+ * the one I have. Writers are exclusive, so version is cluster wide.
  */
 void
-dlmd_lock_signal(dlmd_lock_t *lock)
+dlmd_lock_lvb_update(const char *name, const void *buf, uint64_t seq)
 {
-	
-	pthread_mutex_lock(&lock_list_mtx);
-	/*
-	 * Probably better approach is use node_count for storing number of received replies
-	 * and compare it to actual active node count. Problem in current system is that I
-	 * can wait for reply from, node which was removed from cluster after I have requested
-	 * lock.
-	 *
-	 * Probably best approach is implementation of better keepalive/cluster memmbership code.
-	 */
-			
-	if (lock->node_count > 0)
-		lock->node_count--;
-		
-	DPRINTF(("Sending signal to %s timestamp %d\n", lock->name, lock->node_count));
-	if ((lock->node_count == 0) && ((TAILQ_LAST(&lock_list, dlmd_lock_head)) == lock))
-		pthread_cond_signal(&lock->lock_cv);
+	dlmd_lock_shard_t *shard;
+	dlmd_resource_t *res;
+	uint32_t hash;
+
+	hash = dlmd_lock_hash(name);
+
+	shard = dlmd_lock_shard(hash);
+	dlmd_lock_shard_enter(shard);
 
-	pthread_mutex_unlock(&lock_list_mtx);
+	res = dlmd_resource_get(shard, name, hash);
+
+	if (seq > res->lvb_seq) {
+		memcpy(res->lvb, buf, DLMD_LVB_LEN);
+		res->lvb_seq = seq;
+	}
+
+	dlmd_lock_shard_exit(shard);
+}
+
+/*
+ * Find cached locks of this node which block request in mode, mode 0 means
+ * all cached locks. Idle ones will be released, owners of used ones get
+ * blocking callback and lock is released at their unlock. Must be called
+ * with shard mutex held.
+ */
+static void
+dlmd_resource_uncache(dlmd_resource_t *res, uint32_t mode,
+    struct dlmd_lock_drop_head *drop)
+{
+	struct dlmd_lock_drop *d;
+	dlmd_lock_t *lock2;
+
+	TAILQ_FOREACH(lock2, &res->grant_queue, next) {
+		if (!(lock2->flags & LKM_CACHE) || !(lock2->type & DLMD_LOCK_LOCAL) ||
+		    (lock2->cache & (DLMD_LOCK_BLOCKED | DLMD_LOCK_DROPPING)))
+			continue;
+
+		if (mode != 0 && dlmd_lock_compat(lock2->mode, mode))
+			continue;
+
+		if ((d = malloc(sizeof(struct dlmd_lock_drop) +
+		    strlen(lock2->name) + 1)) == NULL)
+			continue;
+
+		d->lock_id = lock2->lock_id;
+		d->mode = lock2->mode;
+		d->idle = (lock2->cache & DLMD_LOCK_CACHED) != 0;
+		strcpy(d->name, lock2->name);
+
+		lock2->cache = d->idle ? DLMD_LOCK_DROPPING : DLMD_LOCK_BLOCKED;
+
+		SLIST_INSERT_HEAD(drop, d, next);
+	}
+}
+
+/*
+ * Release idle cached locks and call blocking callback for used ones.
+ */
+static void
+dlmd_lock_drop(struct dlmd_lock_drop_head *drop)
+{
+	struct dlmd_lock_drop *d;
+
+	while ((d = SLIST_FIRST(drop)) != NULL) {
+		SLIST_REMOVE_HEAD(drop, next);
+
+		DPRINTF(("Dropping cached lock %s, idle %d\n", d->name, d->idle));
+
+		if (d->idle)
+			dlmd_lock_release(d->lock_id);
+		else if (lock_bast != NULL)
+			lock_bast(d->name, d->mode, d->lock_id, lock_bast_arg);
+
+		free(d);
+	}
+}
+
+/*
+ * Reuse idle cached lock of this node for resource name, if it is held in
+ * mode at least as strong as mode and with LKM_VALBLK if flags asks for
+ * it. Returns lock id or 0.
+ */
+uint64_t
+dlmd_lock_cache_get(const char *name, uint32_t mode, uint32_t flags)
+{
+	dlmd_lock_shard_t *shard;
+	dlmd_resource_t *res;
+	dlmd_lock_t *lock;
+	uint64_t lock_id;
+	uint32_t hash;
+
+	lock_id = 0;
+	hash = dlmd_lock_hash(name);
+
+	shard = dlmd_lock_shard(hash);
+	dlmd_lock_shard_enter(shard);
+
+	if ((res = dlmd_resource_find(shard, name, hash)) != NULL) {
+		TAILQ_FOREACH(lock, &res->grant_queue, next) {
+			if (lock->cache == DLMD_LOCK_CACHED &&
+			    dlmd_lock_mode_weaker(lock->mode, mode) &&
+			    (lock->flags & flags & LKM_VALBLK) == (flags & LKM_VALBLK)) {
+				lock->cache = 0;
+				lock_id = lock->lock_id;
+				break;
+			}
+		}
+	}
+
+	dlmd_lock_shard_exit(shard);
+
+	return lock_id;
+}
+
+void
+dlmd_lock_set_bast(void (*bast)(const char *, int, int, void *), void *arg)
+{
+	lock_bast = bast;
+	lock_bast_arg = arg;
 }
 
 dlmd_lock_t *
-dlmd_lock_alloc()
+dlmd_lock_alloc(const char *name)
 {
 	dlmd_lock_t *lock;
-	lock = (dlmd_lock_t *)malloc(sizeof(dlmd_lock_t));
+	size_t len;
+
+	len = strlen(name) + 1;
+	if ((lock = (dlmd_lock_t *)malloc(sizeof(dlmd_lock_t) + len)) == NULL)
+		err(EXIT_FAILURE, "Allocation of lock failed\n");
         memset(lock, '\0', sizeof(dlmd_lock_t));
+	memcpy(lock->name, name, len);
 	return lock;
 }
 
@@ -380,11 +2269,50 @@ dlmd_lock_destroy(dlmd_lock_t *lock) {
         free(lock);
 }
 
+/*
+ * Initialize lock table with nshards shards, nshards is rounded up to
+ * power of 2. DLMD_LOCK_HASH_SIZE buckets are split between shards.
+ * engine selects locking protocol DLMD_ENGINE_*.
+ */
 void
-dlmd_lock_init()
+dlmd_lock_init(uint32_t nshards, uint32_t engine)
 {
-	pthread_mutex_init(&lock_list_mtx, NULL);
-	TAILQ_INIT(&lock_list);
-}
+	dlmd_lock_shard_t *shard;
+	uint32_t i, j, nbuckets;
+
+	lock_engine = engine;
+
+	for (shard_bits = 0; (1U << shard_bits) < nshards &&
+	    (1U << shard_bits) < DLMD_LOCK_HASH_SIZE; shard_bits++)
+		continue;
 
+	shard_mask = (1U << shard_bits) - 1;
+	lck_id_mask = (1ULL << (31 - shard_bits)) - 1;
+	nbuckets = DLMD_LOCK_HASH_SIZE >> shard_bits;
+	bucket_mask = nbuckets - 1;
 
+	if (posix_memalign((void **)&lock_shards, DLMD_CACHE_LINE,
+	    (shard_mask + 1) * sizeof(dlmd_lock_shard_t)) != 0)
+		err(EXIT_FAILURE, "Allocation of lock table failed\n");
+
+	for (i = 0; i <= shard_mask; i++) {
+		shard = &lock_shards[i];
+		memset(shard, '\0', sizeof(dlmd_lock_shard_t));
+
+		pthread_mutex_init(&shard->mtx, NULL);
+		STAILQ_INIT(&shard->notify);
+		STAILQ_INIT(&shard->done);
+
+		shard->res_hash = calloc(nbuckets, sizeof(struct dlmd_resource_bucket));
+		shard->id_hash = calloc(nbuckets, sizeof(struct dlmd_lock_bucket));
+		if (shard->res_hash == NULL || shard->id_hash == NULL)
+			err(EXIT_FAILURE, "Allocation of lock table failed\n");
+
+		for (j = 0; j < nbuckets; j++) {
+			LIST_INIT(&shard->res_hash[j]);
+			LIST_INIT(&shard->id_hash[j]);
+		}
+	}
+
+	DPRINTF(("Lock table has %u shards, %u buckets per shard\n", shard_mask + 1, nbuckets));
+}
@@ -0,0 +1,584 @@
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/endian.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <prop/proplib.h>
+
+#include "dlmd.h"
+
+/*
+ * Stream transport. With conf.transport tcp every message to other node is
+ * sent as frame over persistent TCP connection to it:
+ *
+ *  0          4
+ *  +----------+----------------------------+
+ *  | length   | datagram (plist, binary or |
+ *  |          | bundle)                    |
+ *  +----------+----------------------------+
+ *
+ * length is big endian. I connect to every node I talk to and every node
+ * connects to me, so there is one connection for each direction and
+ * messages from one node are parsed in order in which they were sent.
+ * Connection is established with first message and again after it breaks,
+ * any number of messages can be outstanding on it. All nodes in cluster
+ * have to use the same transport.
+ *
+ * Connect and writes don't block, they are called from event loop callbacks
+ * and from sender. Frames wait in output buffer of node until connection is
+ * up and socket takes them, event loop or writer thread of node finishes
+ * the connect and writes them.
+ *
+ * Messages which go reliably over udp (see reliable.c) go reliably over
+ * stream too. Frames queued to connection which breaks or fails to come up
+ * are lost, as well as frames which don't fit to full buffer of node which
+ * doesn't read, sequence numbers and retransmissions take care of them.
+ * Only plist messages, keepalives among them, are lost then.
+ */
+
+extern dlmd_conf_t conf;
+
+static uint64_t stream_frames_sent;
+static uint64_t stream_frames_recv;
+static uint64_t stream_frames_dropped;
+static uint64_t stream_connects;
+
+static int dlmd_stream_connect(dlmd_node_t *);
+static int dlmd_stream_connected(dlmd_node_t *);
+static void dlmd_stream_close(dlmd_node_t *);
+static int dlmd_stream_flush(dlmd_node_t *);
+static void dlmd_stream_write_wait(dlmd_node_t *);
+static void dlmd_stream_event_write(int, void *);
+static void * dlmd_stream_writer(void *);
+static int dlmd_stream_read(int, char *, size_t);
+static void * dlmd_stream_reader(void *);
+static void dlmd_stream_event_read(int, void *);
+
+/* Connection read by event loop */
+struct dlmd_stream_conn {
+	int fd;
+	struct dlmd_event *ev;
+	size_t len;			/* bytes in buf */
+	char buf[4 + DLMD_STREAM_FRAME_MAX + 1];
+};
+
+/*
+ * Start connecting to node, connect is finished by event loop or writer
+ * thread. The first connect allocates output buffer of node and, without
+ * event loop, starts its writer thread. Returns EINPROGRESS when frames
+ * have to wait for connection. Must be called with stream_mtx held.
+ */
+static int
+dlmd_stream_connect(dlmd_node_t *node)
+{
+	pthread_t writer;
+	time_t now;
+	int fd, error, one;
+
+	/* Don't hammer node which refused me a moment ago */
+	now = time(NULL);
+	if (node->stream_retry == now)
+		return ECONNREFUSED;
+	node->stream_retry = now;
+
+	if (node->stream_out == NULL) {
+		if ((node->stream_out = malloc(DLMD_STREAM_OUT_MAX)) == NULL)
+			err(EXIT_FAILURE, "Allocating stream buffer failed\n");
+
+		if (!conf.event_loop) {
+			if (pthread_create(&writer, NULL, &dlmd_stream_writer,
+			    node) != 0)
+				err(EXIT_FAILURE, "Creating stream writer failed\n");
+			pthread_detach(writer);
+		}
+	}
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		return errno;
+
+	/* Messages are small and latency matters */
+	one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	node->stream_fd = fd;
+	node->stream_connecting = 1;
+
+	if (connect(fd, (struct sockaddr *)&node->node_address,
+	    sizeof(struct sockaddr_in)) == -1) {
+		if (errno != EINPROGRESS) {
+			error = errno;
+			dlmd_stream_close(node);
+			return error;
+		}
+
+		dlmd_stream_write_wait(node);
+		return EINPROGRESS;
+	}
+
+	DPRINTF(("Connected stream to node %s\n", node->node_name));
+
+	node->stream_connecting = 0;
+	stream_connects++;
+
+	return 0;
+}
+
+/*
+ * Check whether connect in progress finished. Connection which failed is
+ * closed. Must be called with stream_mtx held.
+ */
+static int
+dlmd_stream_connected(dlmd_node_t *node)
+{
+	struct pollfd pfd;
+	socklen_t len;
+	int error;
+
+	pfd.fd = node->stream_fd;
+	pfd.events = POLLOUT;
+
+	if (poll(&pfd, 1, 0) != 1)
+		return EINPROGRESS;
+
+	len = sizeof(error);
+	if (getsockopt(node->stream_fd, SOL_SOCKET, SO_ERROR, &error,
+	    &len) == -1)
+		error = errno;
+
+	if (error != 0) {
+		DPRINTF(("Stream to node %s failed: %s\n", node->node_name,
+			strerror(error)));
+		dlmd_stream_close(node);
+		return error;
+	}
+
+	DPRINTF(("Connected stream to node %s\n", node->node_name));
+
+	node->stream_connecting = 0;
+	stream_connects++;
+
+	return 0;
+}
+
+/*
+ * Close connection to node, frames not written yet are lost. Must be called
+ * with stream_mtx held, from event loop thread when write event is set.
+ */
+static void
+dlmd_stream_close(dlmd_node_t *node)
+{
+	if (node->stream_wev != NULL) {
+		dlmd_event_del(node->stream_wev);
+		node->stream_wev = NULL;
+	}
+
+	close(node->stream_fd);
+	node->stream_fd = -1;
+	node->stream_connecting = 0;
+	node->stream_out_len = 0;
+}
+
+/*
+ * Finish connect and write queued frames while socket takes them. Returns
+ * EAGAIN when connect is in progress or some frames are left, connection
+ * which breaks is closed. Must be called with stream_mtx held.
+ */
+static int
+dlmd_stream_flush(dlmd_node_t *node)
+{
+	size_t off;
+	ssize_t n;
+	int error;
+
+	if (node->stream_connecting &&
+	    (error = dlmd_stream_connected(node)) != 0)
+		return error == EINPROGRESS ? EAGAIN : error;
+
+	for (off = 0; off < node->stream_out_len; off += n) {
+		if ((n = send(node->stream_fd, node->stream_out + off,
+		    node->stream_out_len - off,
+		    MSG_DONTWAIT | MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+
+			if (errno == EAGAIN)
+				break;
+
+			error = errno;
+			DPRINTF(("Stream to node %s broken: %s\n", node->node_name,
+				strerror(error)));
+			dlmd_stream_close(node);
+			return error;
+		}
+	}
+
+	memmove(node->stream_out, node->stream_out + off,
+	    node->stream_out_len - off);
+	node->stream_out_len -= off;
+
+	return node->stream_out_len > 0 ? EAGAIN : 0;
+}
+
+/*
+ * Have connect finished and queued frames written when socket becomes
+ * writable. Must be called with stream_mtx held.
+ */
+static void
+dlmd_stream_write_wait(dlmd_node_t *node)
+{
+	if (!conf.event_loop) {
+		pthread_cond_signal(&node->stream_cv);
+		return;
+	}
+
+	if (node->stream_wev == NULL &&
+	    (node->stream_wev = dlmd_event_add_write(node->stream_fd,
+	    &dlmd_stream_event_write, node)) == NULL)
+		dlmd_stream_close(node);
+}
+
+/*
+ * Event loop callback, connect finished or socket takes queued frames
+ * again.
+ */
+static void
+dlmd_stream_event_write(int fd, void *arg)
+{
+	dlmd_node_t *node = arg;
+
+	pthread_mutex_lock(&node->stream_mtx);
+
+	/* Closed connection has no write event any more */
+	if (dlmd_stream_flush(node) != EAGAIN && node->stream_wev != NULL) {
+		dlmd_event_del(node->stream_wev);
+		node->stream_wev = NULL;
+	}
+
+	pthread_mutex_unlock(&node->stream_mtx);
+}
+
+/*
+ * Writer thread of node, used when event loop is off. It finishes connect
+ * and writes frames which socket didn't take right away.
+ */
+static void *
+dlmd_stream_writer(void *arg)
+{
+	dlmd_node_t *node = arg;
+	struct pollfd pfd;
+
+	pthread_mutex_lock(&node->stream_mtx);
+
+	while (1) {
+		if (node->stream_fd == -1 ||
+		    (!node->stream_connecting && node->stream_out_len == 0)) {
+			pthread_cond_wait(&node->stream_cv, &node->stream_mtx);
+			continue;
+		}
+
+		/* Nobody else touches connection while frames wait for me */
+		pfd.fd = node->stream_fd;
+		pfd.events = POLLOUT;
+
+		pthread_mutex_unlock(&node->stream_mtx);
+		poll(&pfd, 1, INFTIM);
+		pthread_mutex_lock(&node->stream_mtx);
+
+		dlmd_stream_flush(node);
+	}
+
+	return NULL;
+}
+
+/*
+ * Send datagram to node as one frame. Frame is queued to output buffer of
+ * node and written right away when nothing is waiting before it, the rest
+ * is written by event loop or writer thread, so sender never blocks on
+ * node. Frame is lost when connection breaks or when node doesn't read and
+ * buffer is full, reliable datagrams carried in it are sent again.
+ */
+int
+dlmd_stream_send(dlmd_node_t *node, const char *buf, size_t buf_len)
+{
+	char *out;
+	int error;
+
+	if (buf_len > DLMD_STREAM_FRAME_MAX)
+		return EMSGSIZE;
+
+	pthread_mutex_lock(&node->stream_mtx);
+
+	if (node->stream_fd == -1 &&
+	    (error = dlmd_stream_connect(node)) != 0 && error != EINPROGRESS) {
+		pthread_mutex_unlock(&node->stream_mtx);
+		return error;
+	}
+
+	if (node->stream_out_len + 4 + buf_len > DLMD_STREAM_OUT_MAX) {
+		atomic_inc_64(&stream_frames_dropped);
+		pthread_mutex_unlock(&node->stream_mtx);
+		return ENOBUFS;
+	}
+
+	out = node->stream_out + node->stream_out_len;
+	be32enc(out, buf_len);
+	memcpy(out + 4, buf, buf_len);
+	node->stream_out_len += 4 + buf_len;
+
+	atomic_inc_64(&stream_frames_sent);
+
+	/* Frames before this one wait for connect or writable socket */
+	error = 0;
+	if (!node->stream_connecting && node->stream_out_len == 4 + buf_len &&
+	    (error = dlmd_stream_flush(node)) == EAGAIN) {
+		dlmd_stream_write_wait(node);
+		error = 0;
+	}
+
+	pthread_mutex_unlock(&node->stream_mtx);
+
+	return error;
+}
+
+/*
+ * Read exactly len bytes from connection.
+ */
+static int
+dlmd_stream_read(int fd, char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		if (n == 0)
+			return ECONNRESET;
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Connection reader thread, it parses frames from one node until the node
+ * closes connection.
+ */
+static void *
+dlmd_stream_reader(void *arg)
+{
+	char hdr[4];
+	char *buf;
+	size_t len;
+	int fd;
+
+	fd = (int)(intptr_t)arg;
+
+	if ((buf = malloc(DLMD_STREAM_FRAME_MAX + 1)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	while (dlmd_stream_read(fd, hdr, sizeof(hdr)) == 0) {
+		if ((len = be32dec(hdr)) > DLMD_STREAM_FRAME_MAX) {
+			DPRINTF(("Stream frame too long %zu\n", len));
+			break;
+		}
+
+		if (dlmd_stream_read(fd, buf, len) != 0)
+			break;
+
+		/* Plist parser needs NUL */
+		buf[len] = '\0';
+
+		atomic_inc_64(&stream_frames_recv);
+
+		listener_buf_parse(buf, len);
+	}
+
+	free(buf);
+	close(fd);
+
+	return NULL;
+}
+
+/*
+ * Create socket listening on my address and port.
+ */
+int
+dlmd_stream_listen(dlmd_conf_t *conf)
+{
+	int sock, one;
+
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(EXIT_FAILURE, "Creating stream socket failed");
+
+	one = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(sock, (struct sockaddr *)&conf->address,
+	    sizeof(struct sockaddr_in)) == -1)
+		err(EXIT_FAILURE, "Binding stream socket failed");
+
+	if (listen(sock, DLMD_STREAM_BACKLOG) == -1)
+		err(EXIT_FAILURE, "Listening on stream socket failed");
+
+	return sock;
+}
+
+/*
+ * Accept thread, it starts reader thread for every node which connects to
+ * me.
+ */
+void *
+dlmd_stream_accept_start(void *arg)
+{
+	dlmd_conf_t *conf = (dlmd_conf_t *)arg;
+	pthread_t reader;
+	int sock, fd, one;
+
+	sock = dlmd_stream_listen(conf);
+	one = 1;
+
+	while (1) {
+		if ((fd = accept(sock, NULL, NULL)) == -1) {
+			DPRINTF(("accept failed."));
+			continue;
+		}
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		if (pthread_create(&reader, NULL, &dlmd_stream_reader,
+		    (void *)(intptr_t)fd) != 0) {
+			close(fd);
+			continue;
+		}
+
+		pthread_detach(reader);
+	}
+
+	return NULL;
+}
+
+/*
+ * Event loop callback, node connects to me. Connection is read by event
+ * loop without blocking, so frame is collected in connection buffer.
+ */
+void
+dlmd_stream_event_accept(int sock, void *arg)
+{
+	struct dlmd_stream_conn *conn;
+	int fd, one;
+
+	if ((fd = accept(sock, NULL, NULL)) == -1) {
+		DPRINTF(("accept failed."));
+		return;
+	}
+
+	one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	if ((conn = malloc(sizeof(struct dlmd_stream_conn))) == NULL) {
+		close(fd);
+		return;
+	}
+
+	conn->fd = fd;
+	conn->len = 0;
+
+	if ((conn->ev = dlmd_event_add_fd(fd, dlmd_stream_event_read,
+	    conn)) == NULL) {
+		close(fd);
+		free(conn);
+	}
+}
+
+/*
+ * Event loop callback, connection is readable. Everything available is
+ * read and all complete frames are parsed.
+ */
+static void
+dlmd_stream_event_read(int fd, void *arg)
+{
+	struct dlmd_stream_conn *conn = arg;
+	size_t len, off;
+	ssize_t n;
+	char save;
+
+	n = read(fd, conn->buf + conn->len, sizeof(conn->buf) - 1 - conn->len);
+
+	if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+		dlmd_event_del(conn->ev);
+		close(fd);
+		free(conn);
+		return;
+	}
+
+	if (n == -1)
+		return;
+
+	conn->len += n;
+
+	for (off = 0; conn->len - off >= 4; off += 4 + len) {
+		if ((len = be32dec(conn->buf + off)) > DLMD_STREAM_FRAME_MAX) {
+			DPRINTF(("Stream frame too long %zu\n", len));
+			dlmd_event_del(conn->ev);
+			close(fd);
+			free(conn);
+			return;
+		}
+
+		if (conn->len - off - 4 < len)
+			break;
+
+		/* Plist parser needs NUL, it hides next frame for a while */
+		save = conn->buf[off + 4 + len];
+		conn->buf[off + 4 + len] = '\0';
+
+		atomic_inc_64(&stream_frames_recv);
+
+		listener_buf_parse(conn->buf + off + 4, len);
+
+		conn->buf[off + 4 + len] = save;
+	}
+
+	/* Keep partial frame */
+	memmove(conn->buf, conn->buf + off, conn->len - off);
+	conn->len -= off;
+}
+
+/*
+ * Print stream transport counters.
+ */
+void
+dlmd_stream_stats()
+{
+	printf("Stream sent %"PRIu64" frames, dropped %"PRIu64", received "
+	    "%"PRIu64" frames, %"PRIu64" connects\n", stream_frames_sent,
+	    stream_frames_dropped, stream_frames_recv, stream_connects);
+}